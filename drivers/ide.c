@@ -22,6 +22,7 @@
 #include <lib.h>
 #include <fs.h>
 #include <timer.h>
+#include <task.h>
 #ifdef CONFIG_SUPPORT_PCI
 #include <pci.h>
 #endif
@@ -1041,7 +1042,7 @@ static int atapi_detect_medium(struct harddisk_info *info)
 			}
 		}
 
-		mdelay(100);
+		task_delay(100);
 	}
 	debug("read capacity failed\n");
 	return -1;
@@ -19,6 +19,7 @@
 #include <config.h>
 
 #include <fs.h>
+#include <task.h>
 #include <endian.h>
 #include "ide_new.h"
 #include "hdreg.h"
@@ -566,7 +567,7 @@ ob_ide_atapi_packet(struct ide_drive *drive, struct atapi_command *cmd)
 			if (cmd->sense->asc == 0x04) {
 				/* The drive is becoming ready, give it some
 				 * more time. */
-				mdelay(3000);
+				task_delay(3000);
 			} else if (cmd->sense->asc == 0x3a) {
 				/*
 				 * 'medium not present' is not an error,
@@ -923,7 +924,9 @@ ob_ide_identify_drive(struct ide_drive *drive)
 		drive->media = (id.config >> 8) & 0x1f;
 		drive->sectors = 0x7fffffff;
 		drive->bs = 2048;
-		drive->max_sectors = 31;
+		/* in 512-byte units; keep it a multiple of the 2048-byte
+		   block and the transfer below the 16-bit byte count */
+		drive->max_sectors = 120;
 	} else {
 		drive->media = ide_media_disk;
 		drive->sectors = id.lba_capacity;
@@ -1143,7 +1146,8 @@ ob_ide_read_blocks(struct ide_drive *drive, int n, u32 blk, unsigned char* dest)
 		}
 		debug("done\n");
 
-		dest += len * drive->bs;
+		/* n and blk are counted in 512-byte units, even for ATAPI */
+		dest += len * 512;
 		n -= len;
 		blk += len;
 	}
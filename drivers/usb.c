@@ -22,6 +22,7 @@
 /* Only use this code if libpayload is compiled with USB stack */
 #if IS_ENABLED(CONFIG_LP_USB)
 #include <fs.h>
+#include <task.h>
 #include <usb/usb.h>
 #include <usb/usbmsc.h>
 
@@ -54,13 +55,27 @@ void usbdisk_remove (usbdev_t* dev)
 	}
 }
 
+/* Devices that are slow to show up are found while FILO waits anyway,
+   e.g. for drives or in the menu. */
+static struct task poll_task;
+
+static int usb_poll_task(struct task *t)
+{
+	TASK_BEGIN(t);
+	for (;;) {
+		usb_poll();
+		TASK_SLEEP(t, 50);
+	}
+	TASK_END(t);
+}
+
+void usb_start_polling(void)
+{
+	task_start(&poll_task, "usb", usb_poll_task, 0);
+}
+
 int usb_probe(int drive)
 {
-	/* FIXME: need a place to periodically poll usb_poll().
-	   or at least at sensible times.
-	   this would be a nice place, but the usb disk handling
-	   must be more clever for that.
-	*/
 	usb_poll();
 	if (count >= drive) return 0;
 	return -1;
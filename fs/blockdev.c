@@ -26,12 +26,27 @@
 #endif
 #include <config.h>
 #include <fs.h>
+#include "filesys.h"
+#include <boottime.h>
+#include <iostat.h>
+#include <iotrace.h>
+#include <readahead.h>
+#include <task.h>
+#if IS_ENABLED(CONFIG_X86_PAE)
+#include <pae.h>
+#endif
 
 #define DEBUG_THIS CONFIG_DEBUG_BLOCKDEV
 #include <debug.h>
 
 #define NUM_CACHE		64
 
+/* Spans of at least DIRECT_MIN sectors bypass the cache and are read
+   with a single device request of up to DIRECT_MAX sectors. Both are
+   multiples of four, so 2048-byte ATAPI blocks are never split. */
+#define DIRECT_MIN		16
+#define DIRECT_MAX		120
+
 static unsigned char buf_cache[NUM_CACHE][DEV_SECTOR_SIZE];
 static unsigned long cache_sect[NUM_CACHE];
 
@@ -42,6 +57,11 @@ unsigned long part_start;
 unsigned long part_length;
 int using_devsize;
 
+void (*devread_map_func)(unsigned long sector, unsigned long byte_offset,
+			 unsigned long byte_len, void *buf);
+void (*devread_watch_func)(unsigned long sector, unsigned long byte_offset,
+			   unsigned long byte_len, const void *buf);
+
 static inline int has_pc_part_magic(unsigned char *sect)
 {
 	return sect[510] == 0x55 && sect[511] == 0xAA;
@@ -216,51 +236,43 @@ static int parse_device_name(const char *name, int *type, int *drive,
 	return 1;
 }
 
-int devopen(const char *name, int *reopen)
-{
-	int type, drive, part;
-	uint64_t offset, length;
-	uint32_t disk_size = 0;
-
-	/* Don't re-open the device that's already open */
-	if (strcmp(name, dev_name) == 0 && dev_type != -1) {
-		debug("already open\n");
-		*reopen = 1;
-		return 1;
-	}
-	*reopen = 0;
+/* Bring up the drive, and find out its size in sectors */
+/*
+ * (S)ATA drives get CONFIG_SATA_SPINUP_DELAY seconds from FILO's start
+ * to settle. Everything else is set up in the meantime, and only the
+ * first probe of such a drive waits for the rest of it.
+ */
+static struct task spinup_task;
 
-	if (!parse_device_name
-	    (name, &type, &drive, &part, &offset, &length)) {
-		debug("failed to parse device name: %s\n", name);
-		return 0;
-	}
+static int spinup(struct task *t)
+{
+	/* Runs once, when the delay is over */
+	return TASK_DONE;
+}
 
-	/* If we have another dev open, close it first! */
-	if (dev_type != type && dev_type != -1)
-		devclose();
+void devspinup(void)
+{
+	if (!CONFIG_SATA_SPINUP_DELAY)
+		return;
 
-	/* Do simple sanity check first */
-	if (offset & DEV_SECTOR_MASK) {
-		printf("Device offset must be a multiple of %d.\n", DEV_SECTOR_SIZE);
-		return 0;
-	}
-	if (length & DEV_SECTOR_MASK) {
-		printf("WARNING: length is rounded up to multiple of %d.\n", DEV_SECTOR_SIZE);
-		length = (length + DEV_SECTOR_MASK) & ~DEV_SECTOR_MASK;
-	}
+	task_start(&spinup_task, "spinup", spinup, 0);
+	task_set_wake(&spinup_task, CONFIG_SATA_SPINUP_DELAY * 1000);
+}
 
+static int probe_drive(int type, int drive, uint32_t *disk_size)
+{
 	int tmp_drive = drive;
 
 	switch (type) {
 #if (IS_ENABLED(CONFIG_LIBPAYLOAD_STORAGE) && IS_ENABLED(CONFIG_LP_STORAGE)) || \
 		IS_ENABLED(CONFIG_IDE_DISK) || IS_ENABLED(CONFIG_IDE_NEW_DISK)
 	case DISK_IDE:
+		task_wait(&spinup_task);
 #if IS_ENABLED(CONFIG_LIBPAYLOAD_STORAGE) && IS_ENABLED(CONFIG_LP_STORAGE)
 		if (drive < storage_device_count()) {
 			if (storage_probe(drive) != POLL_MEDIUM_PRESENT)
 				return 0;
-			disk_size = (uint32_t) - 1;	/* FIXME */
+			*disk_size = (uint32_t) - 1;	/* FIXME */
 			break;
 		} else {
 			tmp_drive -= storage_device_count();
@@ -271,7 +283,7 @@ int devopen(const char *name, int *reopen)
 			debug("Failed to open IDE.\n");
 			return 0;
 		}
-		disk_size = (uint32_t) - 1;	/* FIXME */
+		*disk_size = (uint32_t) - 1;	/* FIXME */
 #endif
 		break;
 #endif
@@ -281,7 +293,7 @@ int devopen(const char *name, int *reopen)
 			debug("Failed to open USB.\n");
 			return 0;
 		}
-		disk_size = (uint32_t) - 1;	/* FIXME */
+		*disk_size = (uint32_t) - 1;	/* FIXME */
 		break;
 #endif
 
@@ -291,12 +303,12 @@ int devopen(const char *name, int *reopen)
 			debug("Failed to open FLASH.\n");
 			return 0;
 		}
-		disk_size = (uint32_t) - 1;	/* FIXME */
+		*disk_size = (uint32_t) - 1;	/* FIXME */
 		break;
 #endif
 
 	case DISK_MEM:
-		disk_size = 1 << (32 - DEV_SECTOR_BITS);	/* 4GB/512-byte */
+		*disk_size = 1 << (32 - DEV_SECTOR_BITS);	/* 4GB/512-byte */
 		break;
 
 	default:
@@ -304,6 +316,51 @@ int devopen(const char *name, int *reopen)
 		return 0;
 	}
 
+	return 1;
+}
+
+int devopen(const char *name, int *reopen)
+{
+	int type, drive, part;
+	uint64_t offset, length;
+	uint32_t disk_size = 0;
+	int ret;
+
+	/* Don't re-open the device that's already open */
+	if (strcmp(name, dev_name) == 0 && dev_type != -1) {
+		debug("already open\n");
+		*reopen = 1;
+		return 1;
+	}
+	*reopen = 0;
+	file_generation++;
+
+	if (!parse_device_name
+	    (name, &type, &drive, &part, &offset, &length)) {
+		debug("failed to parse device name: %s\n", name);
+		return 0;
+	}
+
+	/* If we have another dev open, close it first! */
+	if (dev_type != type && dev_type != -1)
+		devclose();
+
+	/* Do simple sanity check first */
+	if (offset & DEV_SECTOR_MASK) {
+		printf("Device offset must be a multiple of %d.\n", DEV_SECTOR_SIZE);
+		return 0;
+	}
+	if (length & DEV_SECTOR_MASK) {
+		printf("WARNING: length is rounded up to multiple of %d.\n", DEV_SECTOR_SIZE);
+		length = (length + DEV_SECTOR_MASK) & ~DEV_SECTOR_MASK;
+	}
+
+	boottime_start(STAGE_DRIVE_PROBE);
+	ret = probe_drive(type, drive, &disk_size);
+	boottime_end(STAGE_DRIVE_PROBE);
+	if (!ret)
+		return 0;
+
 	if (dev_type != type || dev_drive != drive)
 		flush_cache();
 
@@ -316,8 +373,6 @@ int devopen(const char *name, int *reopen)
 
 	if (part != 0) {
 		/* partition is specified */
-		int ret;
-
 		ret =
 		    open_pc_partition(part - 1, &part_start, &part_length);
 		if (ret == PARTITION_UNKNOWN) {
@@ -361,6 +416,9 @@ int devopen(const char *name, int *reopen)
 
 	strncpy(dev_name, name, sizeof(dev_name) - 1);
 
+	/* The medium may have been changed since it was read ahead */
+	readahead_opened(type, drive);
+
 	return 1;
 }
 
@@ -373,6 +431,21 @@ void devclose(void)
 #endif
 
 	dev_type = -1;
+	file_generation++;
+}
+
+#if IS_ENABLED(CONFIG_IO_STATS) || IS_ENABLED(CONFIG_IO_TRACE)
+#define io_start() currticks()
+#else
+#define io_start() 0
+#endif
+
+/* Account for a driver request that started at io_start() value `start` */
+static void io_request(u64 start, unsigned long sector, unsigned long count,
+		       int ok)
+{
+	iostat_request(dev_type, dev_drive, start, count, ok);
+	iotrace_request(dev_type, dev_drive, start, sector, count, ok);
 }
 
 /* Read a sector from opened device with simple/stupid buffer cache */
@@ -391,7 +464,18 @@ static void *read_sector(unsigned long sector)
 	/* Search in the cache */
 	hash = sector % NUM_CACHE;
 	buf = buf_cache[hash];
+	iostat_cache(dev_type, dev_drive, cache_sect[hash] == sector);
+	iotrace_cache(dev_type, dev_drive, sector, cache_sect[hash] == sector);
 	if (cache_sect[hash] != sector) {
+		u64 start;
+		int ok;
+
+		readahead_note(dev_type, dev_drive, sector);
+		if (readahead_lookup(dev_type, dev_drive, sector, buf)) {
+			cache_sect[hash] = sector;
+			return buf;
+		}
+
 		cache_sect[hash] = (unsigned long) -1;
 		switch (dev_type) {
 #if (IS_ENABLED(CONFIG_LIBPAYLOAD_STORAGE) && IS_ENABLED(CONFIG_LP_STORAGE)) || \
@@ -407,8 +491,11 @@ static void *read_sector(unsigned long sector)
 					printf("No disk in drive.\n");
 					goto err_out;
 				}
-				if (storage_read_blocks512(tmp_drive,
-							sector, count, buf) != count)
+				start = io_start();
+				ok = storage_read_blocks512(tmp_drive,
+						sector, count, buf) == count;
+				io_request(start, sector, count, ok);
+				if (!ok)
 					goto readerr;
 				while (--count>0) {
 					cache_sect[hash+count] = sector + count;
@@ -419,13 +506,18 @@ static void *read_sector(unsigned long sector)
 			}
 #endif
 #if IS_ENABLED(CONFIG_IDE_DISK)
-			if (ide_read(tmp_drive, sector, buf) != 0)
+			start = io_start();
+			ok = ide_read(tmp_drive, sector, buf) == 0;
+			io_request(start, sector, 1, ok);
+			if (!ok)
 				goto readerr;
 #elif IS_ENABLED(CONFIG_IDE_NEW_DISK)
 			int count = (NUM_CACHE-hash>8)?8:(NUM_CACHE-hash);
 			int ret;
 
+			start = io_start();
 			ret = ide_read_blocks(tmp_drive, sector, count, buf);
+			io_request(start, sector, count, !ret);
 			if (ret == 2) {
 				printf("No disk in drive.\n");
 				goto err_out;
@@ -444,7 +536,10 @@ static void *read_sector(unsigned long sector)
 		{
 			int count = (NUM_CACHE-hash>8)?8:(NUM_CACHE-hash);
 
-			if (usb_read(dev_drive, sector, count, buf) != 0)
+			start = io_start();
+			ok = usb_read(dev_drive, sector, count, buf) == 0;
+			io_request(start, sector, count, ok);
+			if (!ok)
 				goto readerr;
 			while (--count>0) {
 				cache_sect[hash+count] = sector + count;
@@ -455,7 +550,10 @@ static void *read_sector(unsigned long sector)
 
 #if IS_ENABLED(CONFIG_FLASH_DISK)
 		case DISK_FLASH:
-			if (flash_read(dev_drive, sector, buf) != 0)
+			start = io_start();
+			ok = flash_read(dev_drive, sector, buf) == 0;
+			io_request(start, sector, 1, ok);
+			if (!ok)
 				return 0;
 			break;
 #endif
@@ -476,45 +574,153 @@ static void *read_sector(unsigned long sector)
       err_out:
 #endif
 	flush_cache();
+	readahead_drop();
 	dev_name[0] = '\0';	/* force re-open the device next time */
 	return 0;
 }
 
-int devread(unsigned long sector, unsigned long byte_offset,
-	    unsigned long byte_len, void *buf)
+/* Read `count` whole sectors straight into `dest`, bypassing the cache.
+ * Returns `count`, 0 on errors and -1 if the driver only reads single
+ * sectors through read_sector(). */
+static int read_blocks(unsigned long sector, int count, void *dest)
 {
-	char *sector_buffer;
-	char *dest = buf;
-	unsigned long len;
+	int ok;
+	u64 start;
 
-	/* while sectors are technically 512b in filo, iso9660 requires
-	   some special handling. This wastes up to three sectors worth
-	   of RAM on a 512b filesystem, but enables iso9660 to work. */
-	sector += (byte_offset >> 11) * 4;
-	byte_offset &= 0x7ff;
+	switch (dev_type) {
+#if (IS_ENABLED(CONFIG_LIBPAYLOAD_STORAGE) && IS_ENABLED(CONFIG_LP_STORAGE)) || \
+		IS_ENABLED(CONFIG_IDE_NEW_DISK)
+	case DISK_IDE:
+	{
+		int tmp_drive = dev_drive;
+#if IS_ENABLED(CONFIG_LIBPAYLOAD_STORAGE) && IS_ENABLED(CONFIG_LP_STORAGE)
+		if (dev_drive < storage_device_count()) {
+			start = io_start();
+			ok = storage_read_blocks512(tmp_drive,
+					sector, count, dest) == count;
+			io_request(start, sector, count, ok);
+			return ok ? count : 0;
+		} else {
+			tmp_drive -= storage_device_count();
+		}
+#endif
+#if IS_ENABLED(CONFIG_IDE_NEW_DISK)
+		start = io_start();
+		ok = ide_read_blocks(tmp_drive, sector, count, dest) == 0;
+		io_request(start, sector, count, ok);
+		return ok ? count : 0;
+#else
+		return -1;
+#endif
+	}
+#endif
+#if IS_ENABLED(CONFIG_USB_DISK)
+	case DISK_USB:
+		start = io_start();
+		ok = usb_read(dev_drive, sector, count, dest) == 0;
+		io_request(start, sector, count, ok);
+		return ok ? count : 0;
+#endif
+	default:
+		/* memory is mapped anyway, the rest reads single sectors */
+		return -1;
+	}
+}
 
-	if (sector + ((byte_len + 0x1ff) >> 9) > part_length) {
-		printf("Attempt to read beyond device/partition.\n");
-		debug("sector=%lu part_length=%lu byte_len=%lu\n",
-		      sector, part_length, byte_len);
+/* Read whole sectors straight into `dest`, bypassing the cache.
+ * Returns the number of sectors read, 0 if the caller should fall
+ * back to read_sector() (which also does the error reporting). */
+static int read_sectors_direct(unsigned long sector, unsigned long len,
+			       void *dest)
+{
+	int count;
+
+	if ((sector & 3) || len < DIRECT_MIN)
+		return 0;
+	count = (len > DIRECT_MAX ? DIRECT_MAX : len) & ~3;
+#if IS_ENABLED(CONFIG_X86_PAE)
+	/* The drivers would DMA to virt_to_phys(dest), which isn't
+	   where a mapped PAE window puts it. */
+	if (pae_window_mapped(dest, count << DEV_SECTOR_BITS))
 		return 0;
+#endif
+	return MAX(read_blocks(sector, count, dest), 0);
+}
+
+/* Read `count` sectors at the absolute `sector` straight from the
+ * driver, in requests of up to DIRECT_MAX sectors, with neither the
+ * cache nor the alignment rules of devread(). For measuring the raw
+ * speed of a drive. Returns 1 on success, 0 on errors and -1 if the
+ * driver can't do it. */
+int devread_blocks(unsigned long sector, unsigned long count, void *buf)
+{
+	char *dest = buf;
+	int n;
+
+	if (dev_type == DISK_MEM) {
+		memcpy(dest, phys_to_virt(sector << DEV_SECTOR_BITS),
+		       count << DEV_SECTOR_BITS);
+		return 1;
+	}
+
+	while (count) {
+		n = read_blocks(sector, MIN(count, DIRECT_MAX), dest);
+		if (n <= 0)
+			return n;
+		sector += n;
+		count -= n;
+		dest += n << DEV_SECTOR_BITS;
 	}
+	return 1;
+}
 
+/* Return a pointer to the data at (sector, byte_offset) if the device
+ * is mapped into memory, so callers can use it in place instead of
+ * copying it with devread(). Returns NULL for every other device. */
+void *devmap(unsigned long sector, unsigned long byte_offset,
+	     unsigned long byte_len)
+{
+	if (dev_type != DISK_MEM)
+		return NULL;
+
+	sector += byte_offset >> DEV_SECTOR_BITS;
+	byte_offset &= DEV_SECTOR_MASK;
+	if (sector + ((byte_offset + byte_len + 0x1ff) >> 9) > part_length)
+		return NULL;
+
+	return (char *)phys_to_virt((part_start + sector) << DEV_SECTOR_BITS)
+		+ byte_offset;
+}
+
+/* Read from the open drive, `sector` is absolute */
+static int devread_at(unsigned long sector, unsigned long byte_offset,
+		      unsigned long byte_len, void *buf)
+{
+	char *sector_buffer;
+	char *dest = buf;
+	unsigned long len;
+	int count;
+
+	iostat_read(dev_type, dev_drive, byte_len);
 	while (byte_len > 0) {
-		sector_buffer = read_sector(part_start + sector);
+		if (!byte_offset) {
+			count = read_sectors_direct(sector,
+					byte_len >> DEV_SECTOR_BITS, dest);
+			if (count) {
+				sector += count;
+				byte_len -= count << DEV_SECTOR_BITS;
+				dest += count << DEV_SECTOR_BITS;
+				continue;
+			}
+		}
+
+		/* Partial sectors and short spans go through the cache,
+		   which also irons out the issues with 2048b sectors. */
+		sector_buffer = read_sector(sector);
 		if (!sector_buffer) {
 			debug("Couldn't read sector.\n");
 			return 0;
 		}
-		/* now, we always only request one sector at a time,
-		   but rely on the cache system to iron out the
-		   issues with 2048b sectors. Yet, we have to skip
-		   the first fake sectors in processing. */
-		if (byte_offset >= 512) {
-			byte_offset -= 512;
-			sector++;
-			continue;
-		}
 		len = 512 - byte_offset;
 		if (len > byte_len)
 			len = byte_len;
@@ -526,3 +732,54 @@ int devread(unsigned long sector, unsigned long byte_offset,
 	}
 	return 1;
 }
+
+int devread(unsigned long sector, unsigned long byte_offset,
+	    unsigned long byte_len, void *buf)
+{
+	/* while sectors are technically 512b in filo, iso9660 passes
+	   offsets within its 2048b sectors. Skip whole 512b sectors
+	   up front instead of reading and discarding them. */
+	sector += byte_offset >> DEV_SECTOR_BITS;
+	byte_offset &= DEV_SECTOR_MASK;
+
+	if (sector + ((byte_len + 0x1ff) >> 9) > part_length) {
+		printf("Attempt to read beyond device/partition.\n");
+		debug("sector=%lu part_length=%lu byte_len=%lu\n",
+		      sector, part_length, byte_len);
+		return 0;
+	}
+
+	/* Only note where file data lies, see file_map() */
+	if (devread_map_func && disk_read_func) {
+		devread_map_func(part_start + sector, byte_offset, byte_len, buf);
+		return 1;
+	}
+
+	if (!devread_at(part_start + sector, byte_offset, byte_len, buf))
+		return 0;
+	if (devread_watch_func)
+		devread_watch_func(sector, byte_offset, byte_len, buf);
+	return 1;
+}
+
+void dev_get_partition(unsigned long *start, unsigned long *size)
+{
+	*start = part_start;
+	*size = part_length;
+}
+
+int devread_raw(unsigned long sector, unsigned long byte_offset,
+		unsigned long byte_len, void *buf)
+{
+	sector += byte_offset >> DEV_SECTOR_BITS;
+	byte_offset &= DEV_SECTOR_MASK;
+
+	return devread_at(sector, byte_offset, byte_len, buf);
+}
+
+const char *dev_get_name(int *type, int *drive)
+{
+	*type = dev_type;
+	*drive = dev_drive;
+	return dev_name;
+}
@@ -0,0 +1,597 @@
+/*
+ * This file is part of FILO.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Transparent decompression of gzip and LZ4 compressed files
+ *
+ * Like GRUB's gunzip.c, this presents the decompressed data through
+ * filepos and filemax while compressed_file is set. The compressed
+ * data is read in small chunks and inflated straight into the buffer
+ * passed to file_read(), so a kernel is decompressed right to its
+ * load address and no buffer of the full size is needed. Reading
+ * backwards restarts decompression from the beginning.
+ */
+
+#include <libpayload.h>
+#include <config.h>
+#include <fs.h>
+#include "filesys.h"
+#include "squashfs_zlib.h"
+
+#define DEBUG_THIS CONFIG_DEBUG_VFS
+#include <debug.h>
+
+/* Size of the buffer for compressed data */
+#define DECOMP_INBUF	(32 << 10)
+
+/* The furthest an LZ4 match may reach back */
+#define LZ4_WINDOW	(64 << 10)
+
+enum {
+	FORMAT_GZIP = 1,
+	FORMAT_LZ4,
+};
+
+/* gzip header flags */
+#define GZ_FHCRC	0x02
+#define GZ_FEXTRA	0x04
+#define GZ_FNAME	0x08
+#define GZ_FCOMMENT	0x10
+#define GZ_RESERVED	0xe0
+
+/* LZ4 frame descriptor flags */
+#define LZ4_VERSION_MASK	0xc0
+#define LZ4_VERSION		0x40
+#define LZ4_BLOCK_INDEP		0x20
+#define LZ4_BLOCK_CSUM		0x10
+#define LZ4_CONTENT_SIZE	0x08
+#define LZ4_DICT_ID		0x01
+#define LZ4_BLOCK_RAW		0x80000000U
+
+int compressed_file;
+
+/* The raw file position and size while the decompressed ones are
+   in filepos and filemax, see decompress_swap() */
+static u64 raw_pos, raw_max;
+
+static struct {
+	int format;
+	int failed;
+	u64 data_start;		/* raw offset of the compressed data */
+	u64 out_pos;		/* decompressed bytes produced so far */
+
+	unsigned char *in;
+	unsigned char *in_next;
+	unsigned long in_avail;
+
+	/* gzip */
+	z_stream z;
+
+	/* LZ4 */
+	unsigned char *hist;	/* the last LZ4_WINDOW bytes of output */
+	unsigned long hist_pos;
+	unsigned long hist_fill;
+	unsigned long block_max;
+	int linked;		/* matches may reach into earlier blocks */
+	int block_csum;
+	int in_block;
+	int block_raw;
+	unsigned long block_left;	/* compressed bytes left in the block */
+	unsigned long lit_left;
+	unsigned long match_left;
+	unsigned long match_off;
+	int match_pending;
+	unsigned char token;
+} dc;
+
+static inline u32 get_le32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (u32)p[3] << 24;
+}
+
+/* Exchange the decompressed and raw views of filepos and filemax */
+void decompress_swap(void)
+{
+	u64 tmp;
+
+	tmp = filepos;
+	filepos = raw_pos;
+	raw_pos = tmp;
+
+	tmp = filemax;
+	filemax = raw_max;
+	raw_max = tmp;
+}
+
+static void decompress_error(void)
+{
+	if (!dc.failed)
+		printf("Corrupt compressed data at offset 0x%llx\n", dc.out_pos);
+	dc.failed = 1;
+	errnum = ERR_BAD_GZIP_DATA;
+}
+
+/* Read the next chunk of compressed data */
+static int fill_input(void)
+{
+	int n;
+
+	decompress_swap();
+	n = file_read_raw((char *)dc.in, DECOMP_INBUF);
+	decompress_swap();
+
+	if (n <= 0) {
+		dc.in_avail = 0;
+		return 0;
+	}
+	dc.in_next = dc.in;
+	dc.in_avail = n;
+	return n;
+}
+
+/*
+ * gzip
+ */
+
+static int gzip_open(const unsigned char *head, int len)
+{
+	unsigned char trailer[4];
+	int flags, pos = 10;
+
+	if (len < 18 || head[0] != 0x1f || head[1] != 0x8b || head[2] != 8)
+		return 0;
+
+	flags = head[3];
+	if (flags & GZ_RESERVED)
+		return 0;
+	if (flags & GZ_FEXTRA)
+		pos += 2 + (head[pos] | head[pos + 1] << 8);
+	if (flags & GZ_FNAME)
+		while (pos < len && head[pos++]) ;
+	if (flags & GZ_FCOMMENT)
+		while (pos < len && head[pos++]) ;
+	if (flags & GZ_FHCRC)
+		pos += 2;
+	if (pos >= len) {
+		debug("gzip header too long\n");
+		return 0;
+	}
+
+	/* The uncompressed size (mod 2^32) is at the very end */
+	filepos = filemax - 4;
+	if (file_read_raw((char *)trailer, 4) != 4)
+		return 0;
+
+	dc.z.workspace = malloc(zlib_inflate_workspacesize());
+	if (!dc.z.workspace)
+		return 0;
+	memset(dc.z.workspace, 0, zlib_inflate_workspacesize());
+	/* Raw deflate data, the gzip header has been parsed here */
+	if (zlib_inflateInit2(&dc.z, -MAX_WBITS) != Z_OK) {
+		free(dc.z.workspace);
+		return 0;
+	}
+
+	dc.format = FORMAT_GZIP;
+	dc.data_start = pos;
+	filemax = get_le32(trailer);
+	return 1;
+}
+
+static void gzip_reset(void)
+{
+	zlib_inflateReset(&dc.z);
+	dc.z.avail_in = 0;
+}
+
+static int gzip_inflate(unsigned char *out, unsigned long len)
+{
+	z_stream *const z = &dc.z;
+	unsigned long n;
+	int err;
+
+	z->next_out = out;
+	z->avail_out = len;
+	while (z->avail_out) {
+		if (!z->avail_in) {
+			if (!fill_input()) {
+				decompress_error();
+				break;
+			}
+			z->next_in = dc.in_next;
+			z->avail_in = dc.in_avail;
+		}
+		err = zlib_inflate(z, Z_SYNC_FLUSH);
+		if (err == Z_STREAM_END)
+			break;
+		if (err != Z_OK) {
+			decompress_error();
+			break;
+		}
+	}
+
+	n = len - z->avail_out;
+	dc.out_pos += n;
+	return n;
+}
+
+/*
+ * LZ4 frames
+ *
+ * Blocks are decoded sequence by sequence, so decoding can stop at any
+ * byte when the caller's buffer is full. The last LZ4_WINDOW bytes of
+ * output are kept for matches that reach back into earlier reads.
+ */
+
+static int lz4_open(const unsigned char *head, int len)
+{
+	int flags, bd;
+	u64 size;
+
+	if (len < 15 || get_le32(head) != 0x184d2204)
+		return 0;
+
+	flags = head[4];
+	bd = head[5];
+	if ((flags & LZ4_VERSION_MASK) != LZ4_VERSION || (bd >> 4) < 4) {
+		debug("unsupported LZ4 frame\n");
+		return 0;
+	}
+	/* Without the content size file_size() can't be answered */
+	if (!(flags & LZ4_CONTENT_SIZE) || (flags & LZ4_DICT_ID)) {
+		debug("LZ4 frame without content size\n");
+		return 0;
+	}
+	size = get_le32(head + 6) | (u64)get_le32(head + 10) << 32;
+
+	dc.hist = malloc(LZ4_WINDOW);
+	if (!dc.hist)
+		return 0;
+
+	dc.format = FORMAT_LZ4;
+	dc.block_max = 1UL << (8 + 2 * ((bd >> 4) & 7));
+	dc.linked = !(flags & LZ4_BLOCK_INDEP);
+	dc.block_csum = !!(flags & LZ4_BLOCK_CSUM);
+	dc.data_start = 15;	/* magic, FLG, BD, content size, HC */
+	filemax = size;
+	return 1;
+}
+
+static void lz4_reset(void)
+{
+	dc.hist_pos = 0;
+	dc.hist_fill = 0;
+	dc.in_block = 0;
+	dc.block_left = 0;
+	dc.lit_left = 0;
+	dc.match_left = 0;
+	dc.match_pending = 0;
+}
+
+/* Take one byte of compressed input, returns -1 at the end of it */
+static int lz4_in_byte(void)
+{
+	if (!dc.in_avail && !fill_input())
+		return -1;
+	dc.in_avail--;
+	return *dc.in_next++;
+}
+
+static int lz4_block_byte(void)
+{
+	if (!dc.block_left)
+		return -1;
+	dc.block_left--;
+	return lz4_in_byte();
+}
+
+static int lz4_in_le32(u32 *val)
+{
+	unsigned char b[4];
+	int i, c;
+
+	for (i = 0; i < 4; i++) {
+		c = lz4_in_byte();
+		if (c < 0)
+			return 0;
+		b[i] = c;
+	}
+	*val = get_le32(b);
+	return 1;
+}
+
+/* Read an extended length, 255 means another byte follows */
+static int lz4_length(unsigned long *len)
+{
+	int c;
+
+	do {
+		c = lz4_block_byte();
+		if (c < 0)
+			return 0;
+		*len += c;
+	} while (c == 255);
+	return 1;
+}
+
+static void lz4_history(const unsigned char *buf, unsigned long len)
+{
+	unsigned long n;
+
+	dc.hist_fill = MIN(dc.hist_fill + len, LZ4_WINDOW);
+	if (len > LZ4_WINDOW) {
+		buf += len - LZ4_WINDOW;
+		dc.hist_pos += len - LZ4_WINDOW;
+		len = LZ4_WINDOW;
+	}
+	while (len) {
+		const unsigned long pos = dc.hist_pos & (LZ4_WINDOW - 1);
+
+		n = MIN(len, LZ4_WINDOW - pos);
+		memcpy(dc.hist + pos, buf, n);
+		dc.hist_pos += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+/* Copy up to `len` literals, returns the number copied */
+static unsigned long lz4_literals(unsigned char *out, unsigned long len)
+{
+	unsigned long n, done = 0;
+
+	while (done < len) {
+		if (!dc.in_avail && !fill_input())
+			break;
+		n = MIN(len - done, dc.in_avail);
+		memcpy(out + done, dc.in_next, n);
+		dc.in_next += n;
+		dc.in_avail -= n;
+		done += n;
+	}
+	dc.block_left -= done;
+	lz4_history(out, done);
+	return done;
+}
+
+static void lz4_match(unsigned char *out, unsigned long len)
+{
+	const unsigned long mask = LZ4_WINDOW - 1;
+	unsigned long i;
+
+	for (i = 0; i < len; i++) {
+		out[i] = dc.hist[(dc.hist_pos - dc.match_off) & mask];
+		dc.hist[dc.hist_pos & mask] = out[i];
+		dc.hist_pos++;
+	}
+	dc.hist_fill = MIN(dc.hist_fill + len, LZ4_WINDOW);
+}
+
+/* Start the next block, returns 0 at the end of the frame */
+static int lz4_next_block(void)
+{
+	u32 size, csum;
+
+	if (dc.in_block && dc.block_csum && !lz4_in_le32(&csum))
+		return -1;
+	if (!lz4_in_le32(&size))
+		return -1;
+	if (!size)
+		return 0;
+
+	dc.in_block = 1;
+	dc.block_raw = !!(size & LZ4_BLOCK_RAW);
+	dc.block_left = size & ~LZ4_BLOCK_RAW;
+	if (dc.block_left > dc.block_max)
+		return -1;
+	if (!dc.linked)
+		dc.hist_fill = 0;
+	return 1;
+}
+
+/* Parse the offset and length of the match following the literals */
+static int lz4_start_match(void)
+{
+	int lo, hi;
+
+	dc.match_pending = 0;
+	if (!dc.block_left)
+		return 1;	/* the last sequence has no match */
+
+	lo = lz4_block_byte();
+	hi = lz4_block_byte();
+	if (lo < 0 || hi < 0)
+		return 0;
+	dc.match_off = lo | hi << 8;
+	if (!dc.match_off || dc.match_off > dc.hist_fill)
+		return 0;
+
+	dc.match_left = dc.token & 15;
+	if (dc.match_left == 15 && !lz4_length(&dc.match_left))
+		return 0;
+	dc.match_left += 4;
+	return 1;
+}
+
+static int lz4_start_sequence(void)
+{
+	int c;
+
+	if (dc.block_raw) {
+		dc.lit_left = dc.block_left;
+		return 1;
+	}
+
+	c = lz4_block_byte();
+	if (c < 0)
+		return 0;
+	dc.token = c;
+	dc.lit_left = dc.token >> 4;
+	if (dc.lit_left == 15 && !lz4_length(&dc.lit_left))
+		return 0;
+	if (dc.lit_left > dc.block_left)
+		return 0;
+	dc.match_pending = 1;
+	return 1;
+}
+
+static int lz4_inflate(unsigned char *out, unsigned long len)
+{
+	unsigned long n, done = 0;
+	int ret;
+
+	while (done < len) {
+		if (dc.match_left) {
+			n = MIN(dc.match_left, len - done);
+			lz4_match(out + done, n);
+			dc.match_left -= n;
+			done += n;
+		} else if (dc.lit_left) {
+			n = lz4_literals(out + done,
+					MIN(dc.lit_left, len - done));
+			if (!n)
+				goto corrupt;
+			dc.lit_left -= n;
+			done += n;
+		} else if (dc.match_pending) {
+			if (!lz4_start_match())
+				goto corrupt;
+		} else if (!dc.block_left) {
+			ret = lz4_next_block();
+			if (ret <= 0) {
+				if (ret < 0)
+					goto corrupt;
+				break;
+			}
+		} else if (!lz4_start_sequence()) {
+			goto corrupt;
+		}
+	}
+
+	dc.out_pos += done;
+	return done;
+
+corrupt:
+	decompress_error();
+	dc.out_pos += done;
+	return done;
+}
+
+static int decompress_inflate(unsigned char *out, unsigned long len)
+{
+	if (dc.failed)
+		return 0;
+	if (dc.format == FORMAT_GZIP)
+		return gzip_inflate(out, len);
+	return lz4_inflate(out, len);
+}
+
+/* Go back to the beginning of the compressed data */
+static void decompress_restart(void)
+{
+	debug("restarting decompression\n");
+
+	raw_pos = dc.data_start;
+	dc.in_avail = 0;
+	dc.out_pos = 0;
+	dc.failed = 0;
+	if (dc.format == FORMAT_GZIP)
+		gzip_reset();
+	else
+		lz4_reset();
+}
+
+/*
+ * Check the open file for a known compression format. If it's
+ * compressed, switch filepos and filemax to the decompressed data and
+ * return 1. The header is read without touching a digest that might
+ * be in progress.
+ */
+static unsigned char head[512];
+
+int decompress_open(void)
+{
+	const u64 saved_pos = filepos;
+	const u64 saved_max = filemax;
+	int len;
+
+	if (compressed_file)
+		return 1;
+
+	memset(&dc, 0, sizeof(dc));
+
+	filepos = 0;
+	len = file_read_raw((char *)head, sizeof(head));
+	if (len <= 0 || !(gzip_open(head, len) || lz4_open(head, len))) {
+		filepos = saved_pos;
+		filemax = saved_max;
+		return 0;
+	}
+
+	dc.in = malloc(DECOMP_INBUF);
+	if (!dc.in) {
+		filemax = saved_max;
+		decompress_close();
+		filepos = saved_pos;
+		return 0;
+	}
+
+	debug("%s compressed, %llu bytes -> %llu bytes\n",
+			dc.format == FORMAT_GZIP ? "gzip" : "LZ4",
+			saved_max, filemax);
+
+	raw_max = saved_max;
+	compressed_file = 1;
+	decompress_restart();
+	filepos = 0;
+	return 1;
+}
+
+/* The header that decompress_open() parsed, up to the compressed data */
+const unsigned char *decompress_head(unsigned long *len)
+{
+	*len = dc.data_start;
+	return head;
+}
+
+int decompress_read(char *buf, unsigned long len)
+{
+	static unsigned char skip[4096];
+	unsigned long n;
+	int ret;
+
+	if (filepos < dc.out_pos)
+		decompress_restart();
+
+	/* Seeking forward means decompressing what's in between */
+	while (dc.out_pos < filepos) {
+		n = MIN(filepos - dc.out_pos, sizeof(skip));
+		if (decompress_inflate(skip, n) != n)
+			return 0;
+	}
+
+	ret = decompress_inflate((unsigned char *)buf, len);
+	filepos = dc.out_pos;
+	return ret;
+}
+
+void decompress_close(void)
+{
+	free(dc.in);
+	free(dc.hist);
+	free(dc.z.workspace);
+	dc.in = NULL;
+	dc.hist = NULL;
+	dc.z.workspace = NULL;
+	compressed_file = 0;
+}
@@ -0,0 +1,531 @@
+/*
+ * This file is part of FILO.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Boot fast path
+ *
+ * A fast path record lists, for some files, where they lie on the
+ * drive: the partition window, the file size and the extents of its
+ * data. file_open() finds a recorded file without probing filesystems
+ * and walking the path, and its data is read straight from the
+ * extents.
+ *
+ * FILO can't write to drives, so the record is kept in a file of its
+ * own (usually in CBFS). "fastpath FILE..." looks the files up the
+ * normal way and prints their record, to be stored there.
+ *
+ * To find out whether a record is still valid, we remember everything
+ * the filesystem read during the path lookup (directories, inodes,
+ * allocation data), with a CRC32C of it. If any of that changed, the
+ * lookup might have gone differently, and the file is opened the
+ * normal way instead.
+ */
+
+#include <libpayload.h>
+#include <config.h>
+#include <fs.h>
+#include <lib.h>
+#include <digest.h>
+#include <physmem.h>
+#include <fastpath.h>
+#include "filesys.h"
+
+#define DEBUG_THIS CONFIG_DEBUG_VFS
+#include <debug.h>
+
+#define FASTPATH_MAX_SIZE	(64 << 10)	/* of the record file */
+#define FASTPATH_MAX_CHECKS	64
+#define FASTPATH_MAX_CHECK_LEN	(64 << 10)
+#define FASTPATH_MAX_EXTENTS	256
+
+struct fastpath_check {
+	unsigned long sector;	/* in the partition, like devread() */
+	unsigned long offset;
+	unsigned long len;
+	u32 crc;
+};
+
+struct fastpath_extent {
+	u64 file_offset;
+	u64 pos;		/* byte position in the partition */
+	unsigned long len;
+};
+
+enum fastpath_state {
+	FP_UNCHECKED,
+	FP_VALID,
+	FP_STALE,
+};
+
+struct fastpath_file {
+	char *dev;
+	char *path;
+	u64 size;
+	unsigned long part_start;
+	unsigned long part_length;
+	struct fastpath_check *checks;
+	int nchecks;
+	struct fastpath_extent *extents;
+	int nextents;
+	enum fastpath_state state;
+	unsigned int hits;
+};
+
+static struct fastpath_file *files;
+static int nfiles;
+
+/* The file that's open through the fast path */
+static const struct fastpath_file *cur;
+
+/* The file that's being recorded */
+static struct {
+	struct fastpath_file file;
+	struct fastpath_check checks[FASTPATH_MAX_CHECKS];
+	struct fastpath_extent extents[FASTPATH_MAX_EXTENTS];
+	int active;
+	const char *failed;	/* why it can't be recorded */
+} rec;
+
+static u32 fastpath_crc(const void *buf, unsigned long len)
+{
+	struct digest d;
+	u8 out[DIGEST_MAX_SIZE];
+
+	digest_init(&d, DIGEST_CRC32C);
+	digest_update(&d, buf, len);
+	digest_final(&d, out);
+	return out[0] << 24 | out[1] << 16 | out[2] << 8 | out[3];
+}
+
+/*
+ * Opening files
+ * ^^^^^^^^^^^^^
+ */
+
+static int fastpath_validate(const struct fastpath_file *f)
+{
+	const struct fastpath_check *c;
+	unsigned long start, length;
+	char *buf;
+	int ok = 1;
+
+	dev_get_partition(&start, &length);
+	if (start != f->part_start || length != f->part_length)
+		return 0;
+
+	buf = malloc(FASTPATH_MAX_CHECK_LEN);
+	if (!buf)
+		return 0;
+	for (c = f->checks; c < f->checks + f->nchecks; c++) {
+		if (!devread(c->sector, c->offset, c->len, buf) ||
+				fastpath_crc(buf, c->len) != c->crc) {
+			debug("check at sector %lu failed\n", c->sector);
+			ok = 0;
+			break;
+		}
+	}
+	free(buf);
+	return ok;
+}
+
+int fastpath_open(const char *path)
+{
+	struct fastpath_file *f;
+	const char *dev;
+	int type, drive;
+
+	cur = NULL;
+	if (rec.active)
+		return 0;
+
+	dev = dev_get_name(&type, &drive);
+	for (f = files; f < files + nfiles; f++) {
+		if (!strcmp(f->dev, dev) && !strcmp(f->path, path))
+			break;
+	}
+	if (f == files + nfiles || f->state == FP_STALE)
+		return 0;
+
+	if (f->state == FP_UNCHECKED) {
+		f->state = fastpath_validate(f) ? FP_VALID : FP_STALE;
+		if (f->state == FP_STALE) {
+			printf("Fast path record of %s:%s is out of date.\n",
+					dev, path);
+			return 0;
+		}
+	}
+
+	debug("%s:%s via the fast path\n", dev, path);
+	f->hits++;
+	cur = f;
+	return 1;
+}
+
+int fastpath_dir(char *dirname)
+{
+	if (!cur)
+		return 0;
+
+	filepos = 0;
+	filemax = cur->size;
+	return 1;
+}
+
+int fastpath_read(char *buf, int len)
+{
+	const struct fastpath_extent *e = cur->extents;
+	const struct fastpath_extent *const end = e + cur->nextents;
+	unsigned long n;
+	int total = 0;
+
+	while (len > 0) {
+		while (e < end && e->file_offset + e->len <= filepos)
+			e++;
+
+		if (e < end && e->file_offset <= filepos) {
+			const u64 pos = e->pos + (filepos - e->file_offset);
+
+			n = MIN(len, e->file_offset + e->len - filepos);
+			disk_read_func = disk_read_hook;
+			if (!devread(pos >> DEV_SECTOR_BITS,
+					pos & DEV_SECTOR_MASK, n, buf)) {
+				disk_read_func = NULL;
+				return 0;
+			}
+			disk_read_func = NULL;
+		} else {
+			/* a hole */
+			n = MIN(len, (e < end ? e->file_offset : filemax) -
+					filepos);
+			memset(buf, 0, n);
+		}
+		filepos += n;
+		buf += n;
+		len -= n;
+		total += n;
+	}
+	return total;
+}
+
+/*
+ * Recording
+ * ^^^^^^^^^
+ */
+
+static void record_check(unsigned long sector, unsigned long byte_offset,
+		unsigned long byte_len, const void *buf)
+{
+	struct fastpath_file *const f = &rec.file;
+	struct fastpath_check *c;
+
+	for (c = f->checks; c < f->checks + f->nchecks; c++) {
+		if (c->sector == sector && c->offset == byte_offset &&
+				c->len == byte_len)
+			return;
+	}
+
+	if (f->nchecks == FASTPATH_MAX_CHECKS ||
+			byte_len > FASTPATH_MAX_CHECK_LEN) {
+		rec.failed = "the lookup reads too much data";
+		return;
+	}
+	c->sector = sector;
+	c->offset = byte_offset;
+	c->len = byte_len;
+	c->crc = fastpath_crc(buf, byte_len);
+	f->nchecks++;
+}
+
+void fastpath_watch(int on)
+{
+	if (rec.active)
+		devread_watch_func = on ? record_check : NULL;
+}
+
+static void record_extent(unsigned long file_offset, unsigned long sector,
+		unsigned long byte_offset, unsigned long byte_len)
+{
+	struct fastpath_file *const f = &rec.file;
+	struct fastpath_extent *const last = f->nextents ?
+		&f->extents[f->nextents - 1] : NULL;
+	const u64 pos = ((u64)(sector - f->part_start) << DEV_SECTOR_BITS) +
+		byte_offset;
+
+	if (last && last->file_offset + last->len == file_offset &&
+			last->pos + last->len == pos) {
+		last->len += byte_len;
+		return;
+	}
+	if (last && last->file_offset + last->len > file_offset) {
+		rec.failed = "the file is read out of order";
+		return;
+	}
+	if (f->nextents == FASTPATH_MAX_EXTENTS) {
+		rec.failed = "the file has too many extents";
+		return;
+	}
+	f->extents[f->nextents].file_offset = file_offset;
+	f->extents[f->nextents].pos = pos;
+	f->extents[f->nextents].len = byte_len;
+	f->nextents++;
+}
+
+/* Everything that isn't in an extent must be a hole */
+static int holes_are_zero(const char *buf)
+{
+	const struct fastpath_file *const f = &rec.file;
+	u64 pos = 0, next;
+	int i;
+
+	for (i = 0; i <= f->nextents; i++) {
+		next = i < f->nextents ? f->extents[i].file_offset : f->size;
+		for (; pos < next; pos++) {
+			if (buf[pos])
+				return 0;
+		}
+		if (i < f->nextents)
+			pos = next + f->extents[i].len;
+	}
+	return 1;
+}
+
+static int record_file(const char *filename)
+{
+	struct fastpath_file *const f = &rec.file;
+	u64 addr;
+	int ret;
+
+	/* Start from scratch, so the lookup reads everything it needs */
+	file_close();
+
+	memset(f, 0, sizeof(*f));
+	f->checks = rec.checks;
+	f->extents = rec.extents;
+	rec.failed = NULL;
+
+	rec.active = 1;
+	ret = file_open(filename);
+	rec.active = 0;
+	devread_watch_func = NULL;
+	if (!ret)
+		return 0;
+	if (rec.failed)
+		goto fail;
+
+	f->size = file_size();
+	dev_get_partition(&f->part_start, &f->part_length);
+
+	addr = physmem_alloc(MAX(f->size, 1), 0x1000, 0,
+			(uint64_t)UINTPTR_MAX + 1);
+	if (!addr) {
+		rec.failed = "there's not enough memory to map it";
+		goto fail;
+	}
+	memset(phys_to_virt(addr), 0, f->size);
+	if (!file_map(phys_to_virt(addr), record_extent)) {
+		if (!rec.failed)
+			rec.failed = "its filesystem can't map it";
+	} else if (!holes_are_zero(phys_to_virt(addr))) {
+		rec.failed = "some of its data is kept in metadata";
+	}
+	physmem_free(addr, MAX(f->size, 1));
+	if (rec.failed)
+		goto fail;
+
+	file_close();
+	return 1;
+
+fail:
+	printf("Can't record %s, %s.\n", filename, rec.failed);
+	file_close();
+	return 0;
+}
+
+int fastpath_record(const char *filename)
+{
+	const struct fastpath_file *const f = &rec.file;
+	const char *path = strchr(filename, ':');
+	int i;
+
+	if (!path || path == filename) {
+		printf("Give the file with its device, e.g. hda1:/boot/vmlinuz\n");
+		return 0;
+	}
+	if (!record_file(filename))
+		return 0;
+
+	printf("file %.*s %s %llx %lx %lx\n", (int)(path - filename),
+			filename, path + 1, f->size, f->part_start,
+			f->part_length);
+	for (i = 0; i < f->nchecks; i++)
+		printf("check %lx %lx %lx %08x\n", f->checks[i].sector,
+				f->checks[i].offset, f->checks[i].len,
+				f->checks[i].crc);
+	for (i = 0; i < f->nextents; i++)
+		printf("extent %llx %llx %lx\n", f->extents[i].file_offset,
+				f->extents[i].pos, f->extents[i].len);
+	return 1;
+}
+
+/*
+ * Loading the record
+ * ^^^^^^^^^^^^^^^^^^
+ *
+ * It's a text file, lines of hex numbers:
+ *
+ *   file <device> <path> <size> <partition start> <partition length>
+ *   check <sector> <offset> <length> <crc32c>
+ *   extent <file offset> <position> <length>
+ *
+ * Lines that start with '#' are ignored. check and extent lines belong
+ * to the last file line.
+ */
+
+static char *next_word(char **line)
+{
+	char *word;
+
+	while (**line == ' ' || **line == '\t')
+		(*line)++;
+	word = *line;
+	while (**line && **line != ' ' && **line != '\t')
+		(*line)++;
+	if (**line)
+		*(*line)++ = '\0';
+	return word;
+}
+
+static unsigned long long next_hex(char **line)
+{
+	return simple_strtoull(next_word(line), NULL, 16);
+}
+
+static void *grow(void *array, int count, size_t size)
+{
+	return realloc(array, (count + 1) * size);
+}
+
+static int parse_line(char *line)
+{
+	struct fastpath_file *f = nfiles ? &files[nfiles - 1] : NULL;
+	const char *const type = next_word(&line);
+	void *p;
+
+	if (!type[0] || type[0] == '#')
+		return 0;
+
+	if (!strcmp(type, "file")) {
+		p = grow(files, nfiles, sizeof(*files));
+		if (!p)
+			return -1;
+		files = p;
+		f = &files[nfiles++];
+		memset(f, 0, sizeof(*f));
+		f->dev = strdup(next_word(&line));
+		f->path = strdup(next_word(&line));
+		f->size = next_hex(&line);
+		f->part_start = next_hex(&line);
+		f->part_length = next_hex(&line);
+		return f->dev && f->path ? 0 : -1;
+	}
+
+	if (!f)
+		return 0;
+
+	if (!strcmp(type, "check")) {
+		struct fastpath_check *c;
+
+		p = grow(f->checks, f->nchecks, sizeof(*f->checks));
+		if (!p)
+			return -1;
+		f->checks = p;
+		c = &f->checks[f->nchecks++];
+		c->sector = next_hex(&line);
+		c->offset = next_hex(&line);
+		c->len = next_hex(&line);
+		c->crc = next_hex(&line);
+		if (c->len > FASTPATH_MAX_CHECK_LEN)
+			f->state = FP_STALE;
+	} else if (!strcmp(type, "extent")) {
+		struct fastpath_extent *e;
+
+		p = grow(f->extents, f->nextents, sizeof(*f->extents));
+		if (!p)
+			return -1;
+		f->extents = p;
+		e = &f->extents[f->nextents++];
+		e->file_offset = next_hex(&line);
+		e->pos = next_hex(&line);
+		e->len = next_hex(&line);
+	}
+	return 0;
+}
+
+void fastpath_load(void)
+{
+	char *buf, *line, *next;
+	unsigned long size;
+
+	if (!CONFIG_FASTPATH_RECORD[0])
+		return;
+
+	if (!file_open_optional(CONFIG_FASTPATH_RECORD))
+		return;
+	size = file_size();
+	if (size > FASTPATH_MAX_SIZE) {
+		printf("Fast path record too big\n");
+		file_close();
+		return;
+	}
+	buf = malloc(size + 1);
+	if (!buf || file_read(buf, size) != (int)size) {
+		printf("Can't read fast path record\n");
+		free(buf);
+		file_close();
+		return;
+	}
+	file_close();
+	buf[size] = '\0';
+
+	for (line = buf; line; line = next) {
+		next = strpbrk(line, "\r\n");
+		if (next)
+			*next++ = '\0';
+		if (parse_line(line) < 0) {
+			printf("Out of memory reading fast path record\n");
+			break;
+		}
+	}
+	free(buf);
+	debug("%d files in the fast path record\n", nfiles);
+}
+
+void fastpath_show(void)
+{
+	static const char *const states[] = {
+		[FP_UNCHECKED]	= "not used yet",
+		[FP_VALID]	= "valid",
+		[FP_STALE]	= "out of date",
+	};
+	const struct fastpath_file *f;
+
+	if (!nfiles) {
+		printf("No fast path record loaded.\n");
+		return;
+	}
+	for (f = files; f < files + nfiles; f++)
+		printf("%s:%s: %llu bytes in %d extents, %d checks, %s, "
+				"used %u times\n", f->dev, f->path, f->size,
+				f->nextents, f->nchecks, states[f->state],
+				f->hits);
+}
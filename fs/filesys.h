@@ -186,6 +186,38 @@ int aboot_read (char *buf, int len);
 int aboot_dir (char *dirname);
 #endif
 
+/* Read the open file as stored on disk, bypassing decompression */
+int file_read_raw (char *buf, unsigned long len);
+
+#if IS_ENABLED(CONFIG_FASTPATH)
+/* Open `path` on the open device through the fast path, if recorded */
+int fastpath_open (const char *path);
+int fastpath_dir (char *dirname);
+int fastpath_read (char *buf, int len);
+/* Note what the filesystem reads while on, when recording */
+void fastpath_watch (int on);
+#else
+#define fastpath_open(x) 0 /* nop */
+#define fastpath_watch(x) do {} while (0) /* nop */
+#endif
+
+#if IS_ENABLED(CONFIG_PREFETCH)
+/* Open `filename` from memory, if it was prefetched */
+int prefetch_open (const char *filename);
+int prefetch_dir (char *filename);
+int prefetch_read (char *buf, int len);
+#endif
+
+#ifdef CONFIG_DECOMPRESS_IMAGES
+/* While set, filepos and filemax refer to the decompressed data */
+extern int compressed_file;
+int decompress_open (void);
+int decompress_read (char *buf, unsigned long len);
+void decompress_swap (void);
+const unsigned char *decompress_head (unsigned long *len);
+void decompress_close (void);
+#endif
+
 /* This is not a flag actually, but used as if it were a flag.  */
 #define PC_SLICE_TYPE_HIDDEN_FLAG	0x10
 
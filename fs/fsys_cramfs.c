@@ -105,15 +105,25 @@ struct cramfs_buf {
 	u32 block_ptrs[CRAMFS_MAX_BLOCKS];
 	unsigned char data[CRAMFS_BLOCK * 2];
 	unsigned char temp[CRAMFS_BLOCK];
+	long ptrs_offset;		/* inode offset block_ptrs belongs to */
 	/* menu.lst is read 1 byte at a time, try to aleviate *
 	 * the performance problem */
-	long cached_block;		/* the uncompressed block in cramfs_buf->data */
+	long batch_first;		/* first compressed block in the batch buffer */
+	long batch_count;		/* number of compressed blocks in it */
+	u32 batch_start;		/* device offset of the batch */
 	long decompressed_block;	/* the decompressed block in cramfs_buf->temp */
 	long decompressed_size;		/* the size that is got decompressed to */
 };
 
 static struct cramfs_buf *cramfs_buf;
 
+/* Consecutive compressed blocks are read in one go into this buffer.
+ * Falls back to cramfs_buf->data if it can't be allocated. */
+#define CRAMFS_BATCH (CRAMFS_BLOCK * 16)
+static unsigned char *cramfs_batch;
+static unsigned char *batch_buf;
+static u32 batch_size;
+
 #define CRAMFS_ROOT_INO (sizeof(struct cramfs_super) - sizeof(struct cramfs_inode))
 
 #ifndef STAGE1_5
@@ -186,71 +196,157 @@ cramfs_mount(void)
 		return 0;
 	}
 
+	if (!cramfs_batch)
+		cramfs_batch = malloc(CRAMFS_BATCH);
+	if (cramfs_batch) {
+		batch_buf = cramfs_batch;
+		batch_size = CRAMFS_BATCH;
+	} else {
+		batch_buf = cramfs_buf->data;
+		batch_size = sizeof(cramfs_buf->data);
+	}
+	cramfs_buf->ptrs_offset = -1;
+	cramfs_buf->batch_count = 0;
+	cramfs_buf->decompressed_block = -1;
+
 	debug_cramfs("cramfs mounted\n");
 	return 1;
 }
 
+/* load the block pointer array of INODE, unless it is already there */
+static int
+cramfs_load_ptrs(int nblocks)
+{
+	if (cramfs_buf->ptrs_offset == cramfs_buf->inode.offset)
+		return 1;
+
+	if (!devread(0, cramfs_buf->inode.offset << 2, nblocks << 2, (char *) &cramfs_buf->block_ptrs))
+		return 0;
+
+	cramfs_buf->ptrs_offset = cramfs_buf->inode.offset;
+	cramfs_buf->batch_count = 0;
+	cramfs_buf->decompressed_block = -1;
+	return 1;
+}
+
+/* device offset of the compressed data of BLOCK */
+static u32
+cramfs_block_start(int block, int nblocks)
+{
+	if (block)
+		return cramfs_buf->block_ptrs[block - 1];
+	return (cramfs_buf->inode.offset + nblocks) << 2;
+}
+
+/* return a pointer to the compressed data of BLOCK.  On memory mapped
+ * devices that is the data in place, otherwise BLOCK and up to WANT - 1
+ * following blocks are read into the batch buffer with one devread. */
+static unsigned char *
+cramfs_block_data(int block, int nblocks, int want)
+{
+	u32 start = cramfs_block_start(block, nblocks);
+	u32 end = cramfs_buf->block_ptrs[block];
+	unsigned char *data;
+	int count;
+
+	if (end < start || end - start > batch_size) {
+		errnum = ERR_FSYS_CORRUPT;
+		return NULL;
+	}
+
+	data = devmap(0, start, end - start);
+	if (data)
+		return data;
+
+	if (block >= cramfs_buf->batch_first
+	    && block < cramfs_buf->batch_first + cramfs_buf->batch_count) {
+		debug_cramfs("%d was cached...", block);
+		return batch_buf + (start - cramfs_buf->batch_start);
+	}
+
+	for (count = 1; count < want && block + count < nblocks; count++) {
+		end = cramfs_buf->block_ptrs[block + count];
+		if (end < start || end - start > batch_size)
+			break;
+	}
+	end = cramfs_buf->block_ptrs[block + count - 1];
+
+	debug_cramfs("reading %d blocks at offset %d, %d bytes...", count, start, end - start);
+	cramfs_buf->batch_count = 0;
+	disk_read_func = disk_read_hook;
+	if (!devread(0, start, end - start, batch_buf)) {
+		disk_read_func = NULL;
+		return NULL;
+	}
+	disk_read_func = NULL;
+
+	cramfs_buf->batch_first = block;
+	cramfs_buf->batch_count = count;
+	cramfs_buf->batch_start = start;
+	return batch_buf;
+}
+
 /* read from INODE into BUF */
 int
 cramfs_read (char *buf, int len)
 {
-	u32 start;
-	u32 end;
+	unsigned char *data;
 	int nblocks;
 	int block;
-	int block_len;
+	int want;
+	int offset;
 	int ret = 0;
 	long size = 0;
 
 	nblocks = (cramfs_buf->inode.size - 1) / CRAMFS_BLOCK + 1;
 	block = filepos / CRAMFS_BLOCK;
 
-	if (!devread(0, cramfs_buf->inode.offset << 2, nblocks << 2, (char *) &cramfs_buf->block_ptrs))
+	if (!cramfs_load_ptrs(nblocks))
 		return 0;
 
-	if (block)
-		start = cramfs_buf->block_ptrs[block - 1];
-	else start = (cramfs_buf->inode.offset + nblocks) << 2;
-
-	debug_cramfs("reading a file of %d blocks starting at offset %d (block %d)\n", nblocks, start, block);
+	debug_cramfs("reading a file of %d blocks starting at block %d\n", nblocks, block);
 	debug_cramfs("filepos is %d\n", filepos);
 
 	while (block < nblocks && len > 0) {
-		end = cramfs_buf->block_ptrs[block];
-		block_len = end - start;
-
-		debug_cramfs("reading to %d bytes at block %d at offset %d, %d bytes...",
-			len, block, start, block_len);
-		if (cramfs_buf->cached_block != block) {
-			disk_read_func = disk_read_hook;
-			devread(0, start, block_len, cramfs_buf->data);
-			disk_read_func = NULL;
-			cramfs_buf->cached_block = block;
-		} else debug_cramfs("%d was cached...", block);
-
-		if (!ret && (filepos % CRAMFS_BLOCK)) {
-			/* its the first read, and its not block aligned */
-			debug_cramfs("doing a non-aligned decompression of block %d at offset %d\n",
-					block, filepos % CRAMFS_BLOCK);
+		offset = filepos % CRAMFS_BLOCK;
+		want = (offset + len + CRAMFS_BLOCK - 1) / CRAMFS_BLOCK;
+
+		debug_cramfs("reading to %d bytes at block %d...", len, block);
+
+		if (offset || (len < CRAMFS_BLOCK && len < cramfs_buf->inode.size - filepos)) {
+			/* not block aligned, or only part of the block is
+			   wanted: decompress into temp and copy from there */
+			debug_cramfs("doing a partial decompression of block %d at offset %d\n",
+					block, offset);
 			if (cramfs_buf->decompressed_block != block) {
-				size = decompress_block(cramfs_buf->temp, cramfs_buf->data + 2, memcpy);
+				data = cramfs_block_data(block, nblocks, want);
+				if (!data)
+					return 0;
+				size = decompress_block(cramfs_buf->temp, data + 2, memcpy);
 				cramfs_buf->decompressed_size = size;
 				cramfs_buf->decompressed_block = block;
 			} else size = cramfs_buf->decompressed_size;
-			size -= filepos % CRAMFS_BLOCK;
-			if (size > len) size = len;
-			if (size > 0)
-				memcpy(buf, cramfs_buf->temp + (filepos % CRAMFS_BLOCK), size);
+			if (size >= 0) {
+				size -= offset;
+				if (size > len) size = len;
+				if (size > 0)
+					memcpy(buf, cramfs_buf->temp + offset, size);
+			}
 		} else  {
 			/* just another full block read */
-			size = decompress_block((unsigned char *)buf, cramfs_buf->data + 2, memcpy);
+			data = cramfs_block_data(block, nblocks, want);
+			if (!data)
+				return 0;
+			size = decompress_block((unsigned char *)buf, data + 2, memcpy);
 		}
 		if (size < 0) {
 			debug_cramfs("error in decomp (error %d)\n", size);
-			cramfs_buf->cached_block = -1;
+			cramfs_buf->batch_count = 0;
 			cramfs_buf->decompressed_block = -1;
 			return 0;
 		}
+		if (size == 0)
+			break;
 		debug_cramfs("decomp`d %d bytes\n", size);
 		buf += size;
 		len -= size;
@@ -258,7 +354,6 @@ cramfs_read (char *buf, int len)
 		ret += size;
 
 		block++;
-		start = end;
 	}
 
 	return ret;
@@ -366,8 +461,6 @@ cramfs_dir(char *dirname)
 			}
 			filemax = cramfs_buf->inode.size;
 			debug_cramfs("file found, size %d\n", filemax);
-			cramfs_buf->cached_block = -1;
-			cramfs_buf->decompressed_block = -1;
 			return 1;
 		}
 
@@ -51,6 +51,25 @@ struct iso_superblock {
 #define RRCONT_BUF      ((unsigned char *)(FSYS_BUF + 6144))
 #define NAME_BUF        ((unsigned char *)(FSYS_BUF + 8192))
 
+/* Upper bound for the cached path table (about 30000 directories) */
+#define ISO_PATH_TABLE_MAX	(512 * 1024)
+
+/*
+ *  Directories are resolved through the path table, which is read
+ *  once at mount time. Directory number N is path_dirs[N - 1].
+ */
+struct iso_path_dir {
+    unsigned int extent;
+    unsigned int parent;
+    unsigned int name_len;
+    const unsigned char *name;
+};
+
+static unsigned char *path_table;
+static struct iso_path_dir *path_dirs;
+static unsigned int path_ndirs;
+static int rock_ridge;
+
 static int
 iso9660_devread (int sector, int byte_offset, int byte_len, char *buf)
 {
@@ -59,6 +78,302 @@ iso9660_devread (int sector, int byte_offset, int byte_len, char *buf)
   return devread(sector<<2, byte_offset, byte_len, buf);
 }
 
+static void
+iso9660_free_path_table (void)
+{
+  free(path_table);
+  free(path_dirs);
+  path_table = NULL;
+  path_dirs = NULL;
+  path_ndirs = 0;
+}
+
+static void
+iso9660_load_path_table (void)
+{
+  const struct iso_path_table_record *ptr;
+  unsigned int size = PRIMDESC->path_table_size.l;
+  unsigned int extent = *(u_int32_t *)PRIMDESC->type_l_path_table;
+  unsigned int off, n;
+
+  iso9660_free_path_table();
+
+  /* Missing or huge path tables just disable the fast lookup */
+  if (size < sizeof(*ptr) || size > ISO_PATH_TABLE_MAX)
+    return;
+
+  path_table = malloc(size);
+  if (!path_table)
+    return;
+  if (!iso9660_devread(extent, 0, size, (char *)path_table))
+    goto fail;
+
+  for (off = 0, n = 0; off + sizeof(*ptr) - 1 < size; n++)
+    {
+      ptr = (const struct iso_path_table_record *)(path_table + off);
+      if (!ptr->name_len)
+	break;
+      off += (sizeof(*ptr) - 1 + ptr->name_len + 1) & ~1;
+    }
+  if (!n || off > size)
+    goto fail;
+
+  path_dirs = malloc(n * sizeof(*path_dirs));
+  if (!path_dirs)
+    goto fail;
+
+  for (off = 0; path_ndirs < n; path_ndirs++)
+    {
+      struct iso_path_dir *dir = &path_dirs[path_ndirs];
+
+      ptr = (const struct iso_path_table_record *)(path_table + off);
+      /* Records are sorted by parent, and parents come first */
+      if (ptr->parent < 1 || ptr->parent > path_ndirs + 1
+	  || (path_ndirs && ptr->parent < path_dirs[path_ndirs - 1].parent))
+	goto fail;
+      dir->extent = ptr->extent;
+      dir->parent = ptr->parent;
+      dir->name_len = ptr->name_len;
+      dir->name = ptr->name;
+      off += (sizeof(*ptr) - 1 + ptr->name_len + 1) & ~1;
+    }
+
+  debug("path table: %u directories\n", path_ndirs);
+  return;
+
+fail:
+  debug("unusable path table, walking directories instead\n");
+  iso9660_free_path_table();
+}
+
+/* A SUSP "SP" entry in the root's "." record announces Rock Ridge */
+static int
+iso9660_detect_rock_ridge (void)
+{
+  struct iso_directory_record *idr = (struct iso_directory_record *)DIRREC;
+  unsigned char *su;
+
+  if (!iso9660_devread(PRIMDESC->root_directory_record.extent.l, 0,
+		       ISO_SECTOR_SIZE, (char *)DIRREC))
+    return 0;
+
+  su = (unsigned char *)idr + sizeof(struct iso_directory_record)
+       - sizeof(idr->name) + idr->name_len.l;
+  if (idr->name_len.l & 1)
+    su++;
+
+  return su + 7 <= (unsigned char *)idr + idr->length.l
+	 && CHECK2(su, 'S', 'P') && su[4] == 0xbe && su[5] == 0xef;
+}
+
+/*
+ *  Get the name of directory record IDR, the Rock Ridge NM name if it
+ *  has one, and its file type. The name may be left in NAME_BUF.
+ */
+static void
+iso9660_record_name (struct iso_directory_record *idr,
+		     const unsigned char **namep, unsigned int *name_lenp,
+		     unsigned char *file_typep)
+{
+  const unsigned char *name = idr->name;
+  unsigned int name_len = idr->name_len.l;
+  unsigned char file_type = (idr->flags.l & 2) ? ISO_DIRECTORY : ISO_REGULAR;
+  RR_ptr_t rr_ptr;
+  struct rock_ridge *ce_ptr;
+  unsigned int rr_len;
+  unsigned char rr_flag;
+
+  if (name_len > 2 && CHECK2(name + name_len - 2, ';', '1'))
+  {
+      name_len -= 2;	/* truncate trailing file version */
+      if (name_len > 1 && name[name_len - 1] == '.')
+	name_len--;		/* truncate trailing dot */
+  }
+
+  /*
+   *  Parse Rock-Ridge extension
+   */
+  rr_len = (idr->length.l - idr->name_len.l
+	    - (unsigned char)sizeof(struct iso_directory_record)
+	    + (unsigned char)sizeof(idr->name));
+  rr_ptr.ptr = ((unsigned char *)idr + idr->name_len.l
+		+ sizeof(struct iso_directory_record)
+		- sizeof(idr->name));
+  if (rr_len & 1)
+    rr_ptr.ptr++, rr_len--;
+  ce_ptr = NULL;
+  rr_flag = RR_FLAG_NM | RR_FLAG_PX;
+
+  while (rr_len >= 4)
+  {
+      if (rr_ptr.rr->version != 1)
+      {
+#ifndef STAGE1_5
+	  debug(
+		"Non-supported version (%d) RockRidge chunk "
+		"`%c%c'\n", rr_ptr.rr->version,
+		rr_ptr.rr->signature & 0xFF,
+		rr_ptr.rr->signature >> 8);
+#endif
+      }
+      else if (rr_ptr.rr->signature == RRMAGIC('R', 'R')
+	       && rr_ptr.rr->len >= 5)
+	rr_flag &= rr_ptr.rr->u.rr.flags.l;
+      else if (rr_ptr.rr->signature == RRMAGIC('N', 'M'))
+      {
+	  name = rr_ptr.rr->u.nm.name;
+	  name_len = rr_ptr.rr->len - 5;
+	  rr_flag &= ~RR_FLAG_NM;
+      }
+      else if (rr_ptr.rr->signature == RRMAGIC('P', 'X')
+	       && rr_ptr.rr->len >= 36)
+      {
+	  file_type = ((rr_ptr.rr->u.px.mode.l & POSIX_S_IFMT)
+		       == POSIX_S_IFREG
+		       ? ISO_REGULAR
+		       : ((rr_ptr.rr->u.px.mode.l & POSIX_S_IFMT)
+			  == POSIX_S_IFDIR
+			  ? ISO_DIRECTORY : ISO_OTHER));
+	  rr_flag &= ~RR_FLAG_PX;
+      }
+      else if (rr_ptr.rr->signature == RRMAGIC('C', 'E')
+	       && rr_ptr.rr->len >= 28)
+	ce_ptr = rr_ptr.rr;
+      if (!rr_flag)
+	/*
+	 * There is no more extension we expects...
+	 */
+	break;
+      rr_len -= rr_ptr.rr->len;
+      rr_ptr.ptr += rr_ptr.rr->len;
+      if (rr_len < 4 && ce_ptr != NULL)
+      {
+	  /* preserve name before loading new extent. */
+	  if( RRCONT_BUF <= (unsigned char *)name
+	      && (unsigned char *)name < RRCONT_BUF + ISO_SECTOR_SIZE )
+	  {
+	      memcpy(NAME_BUF, name, name_len);
+	      name = NAME_BUF;
+	  }
+	  rr_ptr.ptr = RRCONT_BUF + ce_ptr->u.ce.offset.l;
+	  rr_len = ce_ptr->u.ce.size.l;
+	  if (!iso9660_devread(ce_ptr->u.ce.extent.l, 0, ISO_SECTOR_SIZE, (char *)RRCONT_BUF))
+	  {
+	      errnum = 0;	/* this is not fatal. */
+	      break;
+	  }
+	  ce_ptr = NULL;
+       }
+  } /* rr_len >= 4 */
+
+  *namep = name;
+  *name_lenp = name_len;
+  *file_typep = file_type;
+}
+
+/*
+ *  With Rock Ridge, the path table only has the plain ISO 9660 names,
+ *  and the names we look for are the NM names. mkisofs derives the
+ *  former from the latter, so a directory found by its ISO 9660 name
+ *  is likely the right one. Confirm that its record in the parent
+ *  directory has the NM name NAME. Only that record's Rock Ridge
+ *  entries are parsed.
+ */
+static int
+iso9660_path_confirm (unsigned int dirno, const char *name,
+		      unsigned int name_len)
+{
+  const struct iso_path_dir *dir = &path_dirs[dirno - 1];
+  unsigned int extent = path_dirs[dir->parent - 1].extent;
+  struct iso_directory_record *idr;
+  const unsigned char *rr_name;
+  unsigned int rr_name_len;
+  unsigned char file_type;
+  int size;
+
+  if (!iso9660_devread(extent, 0, ISO_SECTOR_SIZE, (char *)DIRREC))
+    goto fail;
+  size = ((struct iso_directory_record *)DIRREC)->size.l;
+
+  for (; size > 0; size -= ISO_SECTOR_SIZE, extent++)
+    {
+      if (!iso9660_devread(extent, 0, ISO_SECTOR_SIZE, (char *)DIRREC))
+	goto fail;
+
+      for (idr = (struct iso_directory_record *)DIRREC; idr->length.l > 0;
+	   idr = (struct iso_directory_record *)((char *)idr + idr->length.l))
+	{
+	  if (idr->extent.l != dir->extent || !(idr->flags.l & 2))
+	    continue;
+	  if (idr->name_len.l == 1 && idr->name[0] <= 1)
+	    continue;		/* self or parent */
+
+	  iso9660_record_name(idr, &rr_name, &rr_name_len, &file_type);
+	  return file_type == ISO_DIRECTORY && rr_name_len == name_len
+		 && !memcmp(rr_name, name, name_len);
+	}
+    }
+  return 0;
+
+fail:
+  errnum = 0;	/* walking the parent will tell */
+  return 0;
+}
+
+/*
+ *  Look up directory NAME below directory number PARENT in the path
+ *  table. Without Rock Ridge, the names must match exactly. With Rock
+ *  Ridge, the ISO 9660 name is matched regardless of case and then
+ *  confirmed, see iso9660_path_confirm().
+ */
+static unsigned int
+iso9660_path_lookup (unsigned int parent, const char *name,
+		     unsigned int name_len)
+{
+  unsigned int i, j;
+
+  /* Subdirectories always have higher numbers than their parent */
+  for (i = parent; i < path_ndirs; i++)
+    {
+      const struct iso_path_dir *dir = &path_dirs[i];
+
+      if (dir->parent < parent)
+	continue;
+      if (dir->parent > parent)
+	break;
+      if (dir->name_len != name_len)
+	continue;
+      if (!rock_ridge)
+	{
+	  if (!memcmp(dir->name, name, name_len))
+	    return i + 1;
+	  continue;
+	}
+
+      for (j = 0; j < name_len; j++)
+	if (dir->name[j] != toupper((unsigned char)name[j]))
+	  break;
+      if (j == name_len)
+	/* ISO 9660 names are unique within a directory */
+	return iso9660_path_confirm(i + 1, name, name_len) ? i + 1 : 0;
+    }
+
+  return 0;
+}
+
+/* Directory number of the directory at EXTENT, 0 if unknown */
+static unsigned int
+iso9660_path_find (unsigned int extent)
+{
+  unsigned int i;
+
+  for (i = 0; i < path_ndirs; i++)
+    if (path_dirs[i].extent == extent)
+      return i + 1;
+
+  return 0;
+}
+
 int
 iso9660_mount (void)
 {
@@ -88,6 +403,8 @@ iso9660_mount (void)
 	  ISO_SUPER->vol_sector = sector;
 	  ISO_SUPER->file_start = 0;
 	  fsmax = PRIMDESC->volume_space_size.l;
+	  rock_ridge = iso9660_detect_rock_ridge();
+	  iso9660_load_path_table();
 	  return 1;
 	}
     }
@@ -99,16 +416,16 @@ int
 iso9660_dir (char *dirname)
 {
   struct iso_directory_record *idr;
-  RR_ptr_t rr_ptr;
-  struct rock_ridge *ce_ptr;
   unsigned int pathlen;
   int size;
   unsigned int extent;
-  unsigned int rr_len;
   unsigned char file_type;
-  unsigned char rr_flag;
+  unsigned int dirno;
 
   idr = &PRIMDESC->root_directory_record;
+  size = idr->size.l;
+  extent = idr->extent.l;
+  dirno = path_ndirs ? 1 : 0;
   ISO_SUPER->file_start = 0;
 
   do
@@ -122,8 +439,29 @@ iso9660_dir (char *dirname)
 	  pathlen++)
 	;
 
-      size = idr->size.l;
-      extent = idr->extent.l;
+      /* Intermediate directories come from the path table */
+      if (dirno && dirname[pathlen] == '/')
+      {
+	  unsigned int sub = iso9660_path_lookup(dirno, dirname, pathlen);
+
+	  if (sub)
+	  {
+	      dirno = sub;
+	      extent = path_dirs[sub - 1].extent;
+	      size = -1;	/* taken from the "." record */
+	      goto next_dir_level;
+	  }
+      }
+
+      if (size < 0)
+      {
+	  if (!iso9660_devread(extent, 0, ISO_SECTOR_SIZE, (char *)DIRREC))
+	  {
+	      errnum = ERR_FSYS_CORRUPT;
+	      return 0;
+	  }
+	  size = ((struct iso_directory_record *)DIRREC)->size.l;
+      }
 
       while (size > 0)
       {
@@ -141,95 +479,14 @@ iso9660_dir (char *dirname)
 	      const unsigned char *name = idr->name;
 	      unsigned int name_len = idr->name_len.l;
 
-	      file_type = (idr->flags.l & 2) ? ISO_DIRECTORY : ISO_REGULAR;
 	      if (name_len == 1)
 	      {
 		  if ((name[0] == 0) ||	/* self */
 		      (name[0] == 1))	/* parent */
 		    continue;
 	      }
-	      if (name_len > 2 && CHECK2(name + name_len - 2, ';', '1'))
-	      {
-		  name_len -= 2;	/* truncate trailing file version */
-		  if (name_len > 1 && name[name_len - 1] == '.')
-		    name_len--;		/* truncate trailing dot */
-	      }
 
-	      /*
-	       *  Parse Rock-Ridge extension
-	       */
-	      rr_len = (idr->length.l - idr->name_len.l
-			- (unsigned char)sizeof(struct iso_directory_record)
-			+ (unsigned char)sizeof(idr->name));
-	      rr_ptr.ptr = ((unsigned char *)idr + idr->name_len.l
-			    + sizeof(struct iso_directory_record)
-			    - sizeof(idr->name));
-	      if (rr_len & 1)
-		rr_ptr.ptr++, rr_len--;
-	      ce_ptr = NULL;
-	      rr_flag = RR_FLAG_NM | RR_FLAG_PX;
-
-	      while (rr_len >= 4)
-	      {
-		  if (rr_ptr.rr->version != 1)
-		  {
-#ifndef STAGE1_5
-		      debug(
-			    "Non-supported version (%d) RockRidge chunk "
-			    "`%c%c'\n", rr_ptr.rr->version,
-			    rr_ptr.rr->signature & 0xFF,
-			    rr_ptr.rr->signature >> 8);
-#endif
-		  }
-		  else if (rr_ptr.rr->signature == RRMAGIC('R', 'R')
-			   && rr_ptr.rr->len >= 5)
-		    rr_flag &= rr_ptr.rr->u.rr.flags.l;
-		  else if (rr_ptr.rr->signature == RRMAGIC('N', 'M'))
-		  {
-		      name = rr_ptr.rr->u.nm.name;
-		      name_len = rr_ptr.rr->len - 5;
-		      rr_flag &= ~RR_FLAG_NM;
-		  }
-		  else if (rr_ptr.rr->signature == RRMAGIC('P', 'X')
-			   && rr_ptr.rr->len >= 36)
-		  {
-		      file_type = ((rr_ptr.rr->u.px.mode.l & POSIX_S_IFMT)
-				   == POSIX_S_IFREG
-				   ? ISO_REGULAR
-				   : ((rr_ptr.rr->u.px.mode.l & POSIX_S_IFMT)
-				      == POSIX_S_IFDIR
-				      ? ISO_DIRECTORY : ISO_OTHER));
-		      rr_flag &= ~RR_FLAG_PX;
-		  }
-		  else if (rr_ptr.rr->signature == RRMAGIC('C', 'E')
-			   && rr_ptr.rr->len >= 28)
-		    ce_ptr = rr_ptr.rr;
-		  if (!rr_flag)
-		    /*
-		     * There is no more extension we expects...
-		     */
-		    break;
-		  rr_len -= rr_ptr.rr->len;
-		  rr_ptr.ptr += rr_ptr.rr->len;
-		  if (rr_len < 4 && ce_ptr != NULL)
-		  {
-		      /* preserve name before loading new extent. */
-		      if( RRCONT_BUF <= (unsigned char *)name
-			  && (unsigned char *)name < RRCONT_BUF + ISO_SECTOR_SIZE )
-		      {
-			  memcpy(NAME_BUF, name, name_len);
-			  name = NAME_BUF;
-		      }
-		      rr_ptr.ptr = RRCONT_BUF + ce_ptr->u.ce.offset.l;
-		      rr_len = ce_ptr->u.ce.size.l;
-		      if (!iso9660_devread(ce_ptr->u.ce.extent.l, 0, ISO_SECTOR_SIZE, (char *)RRCONT_BUF))
-		      {
-			  errnum = 0;	/* this is not fatal. */
-			  break;
-		      }
-		      ce_ptr = NULL;
-		   }
-	      } /* rr_len >= 4 */
+	      iso9660_record_name(idr, &name, &name_len, &file_type);
 
 	      filemax = MAXINT;
 	      if (name_len >= pathlen
@@ -250,6 +507,9 @@ iso9660_dir (char *dirname)
 			      errnum = ERR_BAD_FILETYPE;
 			      return 0;
 			  }
+			  size = idr->size.l;
+			  extent = idr->extent.l;
+			  dirno = iso9660_path_find(extent);
 			  goto next_dir_level;
 		      }
 		      if (file_type != ISO_REGULAR)
@@ -296,35 +556,24 @@ next_dir_level:
 int
 iso9660_read (char *buf, int len)
 {
-  int sector, blkoffset, size, ret;
-
   if (ISO_SUPER->file_start == 0)
     return 0;
 
-  ret = 0;
-  blkoffset = filepos & (ISO_SECTOR_SIZE - 1);
-  sector = filepos >> ISO_SECTOR_BITS;
-  while (len > 0)
-  {
-    size = ISO_SECTOR_SIZE - blkoffset;
-    if (size > len)
-	size = len;
-
-    disk_read_func = disk_read_hook;
-
-    if (!iso9660_devread(ISO_SUPER->file_start + sector, blkoffset, size, buf))
-	return 0;
-
-    disk_read_func = NULL;
+  /*
+   *  Files are single contiguous extents, so the whole span goes to
+   *  the device layer at once, which can then issue large requests.
+   */
+  disk_read_func = disk_read_hook;
 
-    len -= size;
-    buf += size;
-    ret += size;
-    filepos += size;
-    sector++;
-    blkoffset = 0;
+  if (!iso9660_devread(ISO_SUPER->file_start + (filepos >> ISO_SECTOR_BITS),
+		       filepos & (ISO_SECTOR_SIZE - 1), len, buf))
+  {
+      disk_read_func = NULL;
+      return 0;
   }
 
-  return ret;
-}
+  disk_read_func = NULL;
 
+  filepos += len;
+  return len;
+}
@@ -345,15 +345,23 @@ struct fsys_reiser_info
 #define INFO \
     ((struct fsys_reiser_info *) ((int) FSYS_BUF + FSYSREISER_CACHE_SIZE))
 /*
- * The journal cache.  For each transaction it contains the number of
- * blocks followed by the real block numbers of this transaction.
- *
- * If the block numbers of some transaction won't fit in this space,
- * this list is stopped with a 0xffffffff marker and the remaining
- * uncommitted transactions aren't cached.
+ * The journal map.  An open addressing hash table from real block
+ * numbers to the journal block (relative to journal_block) holding
+ * the latest copy.  It is built once by journal_init() and lives on
+ * the heap, so it isn't limited by FSYS_BUF.
  */
-#define JOURNAL_START    ((__u32 *) (INFO + 1))
-#define JOURNAL_END      ((__u32 *) (FSYS_BUF + FSYS_BUFLEN))
+struct journal_map_entry
+{
+  __u32 blockNr;
+  __u32 journalNr;
+};
+
+#define JOURNAL_MAP_EMPTY	0xffffffff
+#define JOURNAL_MAP_MIN_SIZE	256
+
+static struct journal_map_entry *journal_map;
+static unsigned int journal_map_size;	/* always a power of two */
+static unsigned int journal_map_used;
 
 static __inline__ int
 is_power_of_two (unsigned long word)
@@ -368,6 +376,80 @@ journal_read (int block, int len, char *buffer)
 		  0, len, buffer);
 }
 
+static __inline__ unsigned int
+journal_map_hash (__u32 blockNr)
+{
+  __u32 h = blockNr * 0x9e3779b1;
+
+  return (h ^ (h >> 16)) & (journal_map_size - 1);
+}
+
+static struct journal_map_entry *
+journal_map_slot (__u32 blockNr)
+{
+  unsigned int i = journal_map_hash (blockNr);
+
+  while (journal_map[i].journalNr != JOURNAL_MAP_EMPTY
+	 && journal_map[i].blockNr != blockNr)
+    i = (i + 1) & (journal_map_size - 1);
+
+  return &journal_map[i];
+}
+
+static void
+journal_map_free (void)
+{
+  free (journal_map);
+  journal_map = NULL;
+  journal_map_size = journal_map_used = 0;
+}
+
+static int
+journal_map_resize (unsigned int size)
+{
+  struct journal_map_entry *old = journal_map;
+  unsigned int old_size = journal_map_size;
+  unsigned int i;
+
+  journal_map = malloc (size * sizeof (*journal_map));
+  if (! journal_map)
+    {
+      journal_map = old;
+      return 0;
+    }
+  memset (journal_map, 0xff, size * sizeof (*journal_map));
+  journal_map_size = size;
+
+  for (i = 0; i < old_size; i++)
+    if (old[i].journalNr != JOURNAL_MAP_EMPTY)
+      *journal_map_slot (old[i].blockNr) = old[i];
+  free (old);
+
+  return 1;
+}
+
+/* Later transactions override earlier ones, so insert in log order. */
+static int
+journal_map_insert (__u32 blockNr, __u32 journalNr)
+{
+  struct journal_map_entry *e;
+
+  if (2 * (journal_map_used + 1) > journal_map_size
+      && ! journal_map_resize (journal_map_size
+			       ? 2 * journal_map_size : JOURNAL_MAP_MIN_SIZE))
+    return 0;
+
+  e = journal_map_slot (blockNr);
+  if (e->journalNr == JOURNAL_MAP_EMPTY)
+    journal_map_used++;
+  e->blockNr = blockNr;
+  e->journalNr = journalNr;
+#ifdef REISERDEBUG
+  printf ("block %d is in journal %d.\n", blockNr, journalNr);
+#endif
+  return 1;
+}
+
 /* Read a block from ReiserFS file system, taking the journal into
  * account.  If the block nr is in the journal, the block from the
  * journal taken.
@@ -375,82 +457,34 @@ journal_read (int block, int len, char *buffer)
 static int
 block_read (int blockNr, int start, int len, char *buffer)
 {
-  int transactions = INFO->journal_transactions;
-  int desc_block = INFO->journal_first_desc;
-  int journal_mask = INFO->journal_block_count - 1;
   int translatedNr = blockNr;
-  __u32 *journal_table = JOURNAL_START;
 
-  while (transactions-- > 0)
+  if (journal_map_used)
     {
-      int i = 0;
-      int j_len;
+      struct journal_map_entry *e = journal_map_slot (blockNr);
 
-      if (*journal_table != 0xffffffff)
-	{
-	  /* Search for the blockNr in cached journal */
-	  j_len = *journal_table++;
-	  while (i++ < j_len)
-	    {
-	      if (*journal_table++ == blockNr)
-		{
-		  journal_table += j_len - i;
-		  goto found;
-		}
-	    }
-	}
-      else
+      if (e->journalNr != JOURNAL_MAP_EMPTY)
 	{
-	  /* This is the end of cached journal marker.  The remaining
-	   * transactions are still on disk.
-	   */
-	  struct reiserfs_journal_desc   desc;
-	  struct reiserfs_journal_commit commit;
-
-	  if (! journal_read (desc_block, sizeof (desc), (char *) &desc))
-	    return 0;
-
-	  j_len = desc.j_len;
-	  while (i < j_len && i < JOURNAL_TRANS_HALF)
-	    if (desc.j_realblock[i++] == blockNr)
-	      goto found;
-
-	  if (j_len >= JOURNAL_TRANS_HALF)
-	    {
-	      int commit_block = (desc_block + 1 + j_len) & journal_mask;
-
-	      if (! journal_read (commit_block,
-				  sizeof (commit), (char *) &commit))
-		return 0;
-	      while (i < j_len)
-		if (commit.j_realblock[i++ - JOURNAL_TRANS_HALF] == blockNr)
-		  goto found;
-	    }
-	}
-      goto not_found;
-
-    found:
-      translatedNr = INFO->journal_block + ((desc_block + i) & journal_mask);
+	  translatedNr = INFO->journal_block + e->journalNr;
 #ifdef REISERDEBUG
-      printf ("block_read: block %d is mapped to journal block %d.\n",
-	      blockNr, translatedNr - INFO->journal_block);
+	  printf ("block_read: block %d is mapped to journal block %d.\n",
+		  blockNr, e->journalNr);
 #endif
-      /* We must continue the search, as this block may be overwritten
-       * in later transactions.
-       */
-    not_found:
-      desc_block = (desc_block + 2 + j_len) & journal_mask;
+	}
     }
   return devread (translatedNr << INFO->blocksize_shift, start, len, buffer);
 }
 
-/* Init the journal data structure.  We try to cache as much as
- * possible in the JOURNAL_START-JOURNAL_END space, but if it is full
- * we can still read the rest from the disk on demand.
+/* Init the journal data structure.  All valid transactions are
+ * walked once, and the real block numbers they contain are entered
+ * into the journal map, so block_read() needs a single lookup.
  *
  * The first number of valid transactions and the descriptor block of the
  * first valid transaction are held in INFO.  The transactions are all
  * adjacent, but we must take care of the journal wrap around.
+ *
+ * Returns 1 on success, also if there are no valid transactions, 0 if
+ * the journal can't be read and -1 if the map doesn't fit into memory.
  */
 static int
 journal_init (void)
@@ -462,12 +496,15 @@ journal_init (void)
   struct reiserfs_journal_header header;
   struct reiserfs_journal_desc   desc;
   struct reiserfs_journal_commit commit;
-  __u32 *journal_table = JOURNAL_START;
+  int i;
+
+  journal_map_free ();
 
-  journal_read (block_count, sizeof (header), (char *) &header);
+  if (! journal_read (block_count, sizeof (header), (char *) &header))
+    return 0;
   desc_block = header.j_first_unflushed_offset;
   if (desc_block >= block_count)
-    return 0;
+    return 1;
 
   INFO->journal_first_desc = desc_block;
   next_trans_id = header.j_last_flush_trans_id + 1;
@@ -479,7 +516,11 @@ journal_init (void)
 
   while (1)
     {
-      journal_read (desc_block, sizeof (desc), (char *) &desc);
+      if (! journal_read (desc_block, sizeof (desc), (char *) &desc))
+	{
+	  journal_map_free ();
+	  return 0;
+	}
       if (substring (JOURNAL_DESC_MAGIC, desc.j_magic) > 0
 	  || desc.j_trans_id != next_trans_id
 	  || desc.j_mount_id != header.j_mount_id)
@@ -487,7 +528,11 @@ journal_init (void)
 	break;
 
       commit_block = (desc_block + desc.j_len + 1) & (block_count - 1);
-      journal_read (commit_block, sizeof (commit), (char *) &commit);
+      if (! journal_read (commit_block, sizeof (commit), (char *) &commit))
+	{
+	  journal_map_free ();
+	  return 0;
+	}
       if (desc.j_trans_id != commit.j_trans_id
 	  || desc.j_len != commit.j_len)
 	/* no more valid transactions */
@@ -498,43 +543,27 @@ journal_init (void)
 	      desc.j_trans_id, desc.j_mount_id, desc_block);
 #endif
 
-      next_trans_id++;
-      if (journal_table < JOURNAL_END)
+      /* The descriptor holds the real block numbers of the first
+       * blocks, the commit block those of the rest.  The journal
+       * copies follow the descriptor.
+       */
+      for (i = 0; i < desc.j_len; i++)
 	{
-	  if ((journal_table + 1 + desc.j_len) >= JOURNAL_END)
-	    {
-	      /* The table is almost full; mark the end of the cached
-	       * journal.*/
-	      *journal_table = 0xffffffff;
-	      journal_table = JOURNAL_END;
-	    }
-	  else
+	  __u32 blockNr = (i < JOURNAL_TRANS_HALF)
+	    ? desc.j_realblock[i]
+	    : commit.j_realblock[i - JOURNAL_TRANS_HALF];
+
+	  if (! journal_map_insert (blockNr,
+				    (desc_block + 1 + i) & (block_count - 1)))
 	    {
-	      int i;
-	      /* Cache the length and the realblock numbers in the table.
-	       * The block number of descriptor can easily be computed.
-	       * and need not to be stored here.
-	       */
-	      *journal_table++ = desc.j_len;
-	      for (i = 0; i < desc.j_len && i < JOURNAL_TRANS_HALF; i++)
-		{
-		  *journal_table++ = desc.j_realblock[i];
-#ifdef REISERDEBUG
-		  printf ("block %d is in journal %d.\n",
-			  desc.j_realblock[i], desc_block);
-#endif
-		}
-	      for (     ; i < desc.j_len; i++)
-		{
-		  *journal_table++ = commit.j_realblock[i-JOURNAL_TRANS_HALF];
-#ifdef REISERDEBUG
-		  printf ("block %d is in journal %d.\n",
-			  commit.j_realblock[i-JOURNAL_TRANS_HALF],
-			  desc_block);
-#endif
-		}
+	      printf ("reiserfs: out of memory for the journal map.\n");
+	      journal_map_free ();
+	      errnum = ERR_WONT_FIT;
+	      return -1;
 	    }
 	}
+
+      next_trans_id++;
       desc_block = (commit_block + 1) & (block_count - 1);
     }
 #ifdef REISERDEBUG
@@ -544,7 +573,7 @@ journal_init (void)
 
   INFO->journal_transactions
     = next_trans_id - header.j_last_flush_trans_id - 1;
-  return errnum == 0;
+  return 1;
 }
 
 /* check filesystem types and read superblock into memory buffer */
@@ -610,16 +639,20 @@ reiserfs_mount (void)
       || (SECTOR_SIZE << INFO->blocksize_shift) != super.s_blocksize)
     return 0;
 
-  /* Initialize journal code.  If something fails we end with zero
-   * journal_transactions, so we don't access the journal at all.
+  /* Initialize journal code.  Without a valid journal we end with an
+   * empty journal map, so we don't access the journal at all.  If the
+   * journal can't be read or mapped, the blocks outside it may be
+   * stale, so don't mount.
    */
   INFO->journal_transactions = 0;
+  journal_map_free ();
   if (super.s_journal_block != 0 && super.s_journal_dev == 0)
     {
       INFO->journal_block = super.s_journal_block;
       INFO->journal_block_count = super.s_journal_size;
-      if (is_power_of_two (INFO->journal_block_count))
-	journal_init ();
+      if (is_power_of_two (INFO->journal_block_count)
+	  && journal_init () <= 0)
+	return 0;
 
       /* Read in super block again, maybe it is in the journal */
       block_read (superblock >> INFO->blocksize_shift,
@@ -39,28 +39,36 @@ struct xfs_info {
 	int blklog;
 	int inopblog;
 	int agblklog;
-	unsigned int nextents;
-	xfs_daddr_t next;
-	xfs_daddr_t daddr;
-	xfs_dablk_t forw;
-	xfs_dablk_t dablk;
-	xfs_bmbt_rec_32_t *xt;
+	int dirblklog;
+	int crc;		/* version 5 filesystem */
+	int ftype;		/* directory entries carry the file type */
+	int litino;		/* offset of the inode's literal area */
+	int bthdr;		/* size of a long form B-tree block header */
+	int dirhdr;		/* size of a directory data block header */
+	xfs_fileoff_t dablk;	/* next directory block to read */
 	xfs_bmbt_ptr_t ptr0;
 	int btnode_ptr0_off;
+	char *blkbuf;		/* one filesystem block, for B-tree nodes */
+	char *dirblk;		/* one directory block */
+	xad_t *xads;		/* decoded extent list of the current inode */
+	unsigned int nxads;
+	unsigned int maxxads;
+	unsigned int xcur;	/* extent cursor, continues sequential reads */
+	int xads_valid;
 	int i8param;
 	int dirpos;
 	int dirmax;
 	int blkoff;
-	int fpos;
+	int dirend;
 	xfs_ino_t rootino;
 };
 
 static struct xfs_info xfs;
 
-#define dirbuf		((char *)FSYS_BUF)
-#define filebuf		((char *)FSYS_BUF + 4096)
 #define inode		((xfs_dinode_t *)((char *)FSYS_BUF + 8192))
 #define icore		(inode->di_core)
+#define dfork		((char *)inode + xfs.litino)
+#define sfhdr		((xfs_dir2_sf_hdr_t *)dfork)
 
 #define	mask32lo(n)	((__uint32_t)((1ull << (n)) - 1))
 
@@ -173,12 +181,26 @@ fsb2daddr (xfs_fsblock_t fsbno)
 static inline int
 btroot_maxrecs (void)
 {
-	int tmp = icore.di_forkoff ? (icore.di_forkoff << 3) : xfs.isize;
+	int tmp = icore.di_forkoff ? (icore.di_forkoff << 3)
+				   : xfs.isize - xfs.litino;
 
-	return (tmp - sizeof(xfs_bmdr_block_t) - offsetof(xfs_dinode_t, di_u)) /
+	return (tmp - sizeof(xfs_bmdr_block_t)) /
 		(sizeof (xfs_bmbt_key_t) + sizeof (xfs_bmbt_ptr_t));
 }
 
+static __uint64_t
+di_nextents (void)
+{
+	xfs_dinode_v3_t *v3 = (xfs_dinode_v3_t *)
+		((char *)inode + offsetof(xfs_dinode_t, di_u));
+
+	if (icore.di_version == XFS_DINODE_VERSION_3
+	    && (le64 (v3->di_flags2) & XFS_DIFLAG2_NREXT64))
+		return le64 (icore.di_big_nextents);
+
+	return le32 (icore.di_nextents);
+}
+
 static int
 di_read (xfs_ino_t ino)
 {
@@ -194,104 +216,144 @@ di_read (xfs_ino_t ino)
 	offset = ino2offset (ino);
 	daddr = agb2daddr (agno, agbno);
 
-	devread (daddr, offset*xfs.isize, xfs.isize, (char *)inode);
+	xfs.xads_valid = 0;
+	if (!devread (daddr, offset*xfs.isize, xfs.isize, (char *)inode))
+		return 0;
+	if (le16 (icore.di_magic) != XFS_DINODE_MAGIC
+	    || (xfs.crc && icore.di_version != XFS_DINODE_VERSION_3)) {
+		errnum = ERR_FSYS_CORRUPT;
+		return 0;
+	}
 
 	xfs.ptr0 = *(xfs_bmbt_ptr_t *)
-		    (inode->di_u.di_c + sizeof(xfs_bmdr_block_t)
+		    (dfork + sizeof(xfs_bmdr_block_t)
 		    + btroot_maxrecs ()*sizeof(xfs_bmbt_key_t));
 
 	return 1;
 }
 
-static void
-init_extents (void)
+static int
+add_extent (xfs_bmbt_rec_32_t *r)
 {
-	xfs_bmbt_ptr_t ptr0;
-	xfs_btree_lblock_t h;
+	xad_t *xad;
 
-	switch (icore.di_format) {
-	case XFS_DINODE_FMT_EXTENTS:
-		xfs.xt = inode->di_u.di_bmx;
-		xfs.nextents = le32 (icore.di_nextents);
-		break;
-	case XFS_DINODE_FMT_BTREE:
-		ptr0 = xfs.ptr0;
-		for (;;) {
-			xfs.daddr = fsb2daddr (le64(ptr0));
-			devread (xfs.daddr, 0,
-				 sizeof(xfs_btree_lblock_t), (char *)&h);
-			if (!h.bb_level) {
-				xfs.nextents = le16(h.bb_numrecs);
-				xfs.next = fsb2daddr (le64(h.bb_rightsib));
-				xfs.fpos = sizeof(xfs_btree_block_t);
-				return;
-			}
-			devread (xfs.daddr, xfs.btnode_ptr0_off,
-				 sizeof(xfs_bmbt_ptr_t), (char *)&ptr0);
+	if (xfs.nxads == xfs.maxxads) {
+		unsigned int max = xfs.maxxads ? 2 * xfs.maxxads : 16;
+
+		xad = realloc (xfs.xads, max * sizeof(*xad));
+		if (!xad) {
+			errnum = ERR_WONT_FIT;
+			return 0;
 		}
+		xfs.xads = xad;
+		xfs.maxxads = max;
 	}
+	xad = &xfs.xads[xfs.nxads++];
+	xad->offset = xt_offset (r);
+	xad->start = xt_start (r);
+	xad->len = xt_len (r);
+
+	return 1;
 }
 
-static xad_t *
-next_extent (void)
+/*
+ * Decode the whole extent list of the current inode once, so reads
+ * in chunks don't walk the extents (or B-tree leaves) over and over.
+ */
+static int
+load_extents (void)
 {
-	static xad_t xad;
+	xfs_btree_lblock_t *h = (xfs_btree_lblock_t *)xfs.blkbuf;
+	xfs_bmbt_rec_32_t *r;
+	xfs_bmbt_ptr_t ptr0;
+	__uint64_t i, n, total;
+
+	if (xfs.xads_valid)
+		return 1;
+
+	xfs.nxads = 0;
+	xfs.xcur = 0;
+	total = di_nextents ();
 
 	switch (icore.di_format) {
 	case XFS_DINODE_FMT_EXTENTS:
-		if (xfs.nextents == 0)
-			return NULL;
+		for (i = 0; i < total; i++)
+			if (!add_extent ((xfs_bmbt_rec_32_t *)dfork + i))
+				return 0;
 		break;
 	case XFS_DINODE_FMT_BTREE:
-		if (xfs.nextents == 0) {
-			xfs_btree_lblock_t h;
-
-			if (xfs.next == 0)
-				return NULL;
-			xfs.daddr = xfs.next;
-			devread (xfs.daddr, 0, sizeof(xfs_btree_lblock_t), (char *)&h);
-			xfs.nextents = le16(h.bb_numrecs);
-			xfs.next = fsb2daddr (le64(h.bb_rightsib));
-			xfs.fpos = sizeof(xfs_btree_block_t);
+		ptr0 = xfs.ptr0;
+		for (;;) {
+			if (!devread (fsb2daddr (le64(ptr0)), 0, xfs.bsize,
+				      xfs.blkbuf))
+				return 0;
+			if (le32 (h->bb_magic) != (xfs.crc ? XFS_BMAP_CRC_MAGIC
+							  : XFS_BMAP_MAGIC)) {
+				errnum = ERR_FSYS_CORRUPT;
+				return 0;
+			}
+			if (!h->bb_level)
+				break;
+			ptr0 = *(xfs_bmbt_ptr_t *)(xfs.blkbuf
+						   + xfs.btnode_ptr0_off);
+		}
+		/* Walk the leaves, each one read with a single request */
+		for (;;) {
+			n = le16 (h->bb_numrecs);
+			r = (xfs_bmbt_rec_32_t *)(xfs.blkbuf + xfs.bthdr);
+			for (i = 0; i < n && xfs.nxads < total; i++)
+				if (!add_extent (r++))
+					return 0;
+			if (le64 (h->bb_rightsib) == NULLDFSBNO
+			    || xfs.nxads >= total)
+				break;
+			if (!devread (fsb2daddr (le64 (h->bb_rightsib)), 0,
+				      xfs.bsize, xfs.blkbuf))
+				return 0;
 		}
-		/* Yeah, I know that's slow, but I really don't care */
-		devread (xfs.daddr, xfs.fpos, sizeof(xfs_bmbt_rec_t), filebuf);
-		xfs.xt = (xfs_bmbt_rec_32_t *)filebuf;
-		xfs.fpos += sizeof(xfs_bmbt_rec_32_t);
+		break;
 	}
-	xad.offset = xt_offset (xfs.xt);
-	xad.start = xt_start (xfs.xt);
-	xad.len = xt_len (xfs.xt);
-	++xfs.xt;
-	--xfs.nextents;
 
-	return &xad;
+	xfs.xads_valid = 1;
+	return 1;
 }
 
 /*
- * Name lies - the function reads only first 100 bytes
+ * Index of the first extent that ends beyond file block `fblk`.
+ * Sequential and forward reads are served from the cursor.
  */
-static void
-xfs_dabread (void)
+static unsigned int
+seek_extent (xfs_fileoff_t fblk)
 {
+	unsigned int lo, hi, mid;
 	xad_t *xad;
-	xfs_fileoff_t offset;;
-
-	init_extents ();
-	while ((xad = next_extent ())) {
-		offset = xad->offset;
-		if (isinxt (xfs.dablk, offset, xad->len)) {
-			devread (fsb2daddr (xad->start + xfs.dablk - offset),
-				 0, 100, dirbuf);
+
+	for (lo = xfs.xcur; lo < xfs.nxads && lo <= xfs.xcur + 1; lo++) {
+		xad = &xfs.xads[lo];
+		if (lo && fblk < xfs.xads[lo - 1].offset + xfs.xads[lo - 1].len)
 			break;
-		}
+		if (fblk < xad->offset + xad->len)
+			return lo;
+	}
+
+	lo = 0;
+	hi = xfs.nxads;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		xad = &xfs.xads[mid];
+		if (xad->offset + xad->len <= fblk)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+
+	return lo;
 }
 
 static inline xfs_ino_t
 sf_ino (char *sfe, int namelen)
 {
-	void *p = sfe + namelen + 3;
+	void *p = sfe + namelen + 3 + xfs.ftype;
 
 	return (xfs.i8param == 0)
 		? le64(*(xfs_ino_t *)p) : le32(*(__uint32_t *)p);
@@ -301,8 +363,8 @@ static inline xfs_ino_t
 sf_parent_ino (void)
 {
 	return (xfs.i8param == 0)
-		? le64(*(xfs_ino_t *)(&inode->di_u.di_dir2sf.hdr.parent))
-		: le32(*(__uint32_t *)(&inode->di_u.di_dir2sf.hdr.parent));
+		? le64(*(xfs_ino_t *)(&sfhdr->parent))
+		: le32(*(__uint32_t *)(&sfhdr->parent));
 }
 
 static inline int
@@ -311,29 +373,73 @@ roundup8 (int n)
 	return ((n+7)&~7);
 }
 
+/*
+ * Read the next data block of a block, leaf or node directory in
+ * whole. Leaf and free index blocks live above XFS_DIR2_LEAF_OFFSET
+ * and are never looked at; walking the data blocks finds every entry.
+ */
+static int
+next_dirblock (void)
+{
+	xfs_dir2_data_hdr_t *hdr = (xfs_dir2_data_hdr_t *)xfs.dirblk;
+	xfs_dir2_block_tail_t *tail;
+	xfs_fileoff_t end = XFS_DIR2_LEAF_OFFSET >> xfs.blklog;
+	xfs_fileoff_t dirblks = 1 << xfs.dirblklog;
+	unsigned int i;
+	int leaves;
+
+	for (;;) {
+		/* skip holes */
+		i = seek_extent (xfs.dablk);
+		if (i >= xfs.nxads)
+			return 0;
+		if (xfs.xads[i].offset > xfs.dablk)
+			xfs.dablk = (xfs.xads[i].offset + dirblks - 1)
+				    & ~(dirblks - 1);
+		if (xfs.dablk >= end)
+			return 0;
+
+		filepos = xfs.dablk << xfs.blklog;
+		xfs.dablk += dirblks;
+		if (xfs_read (xfs.dirblk, xfs.dirbsize) != xfs.dirbsize)
+			return 0;
+
+		switch (le32 (hdr->magic)) {
+		case XFS_DIR2_BLOCK_MAGIC:
+		case XFS_DIR3_BLOCK_MAGIC:
+			/* entries stop where the embedded leaf starts */
+			tail = (xfs_dir2_block_tail_t *)
+			       (xfs.dirblk + xfs.dirbsize) - 1;
+			leaves = le32 (tail->count);
+			xfs.dirend = (char *)tail - xfs.dirblk
+				     - leaves * sizeof(xfs_dir2_leaf_entry_t);
+			break;
+		case XFS_DIR2_DATA_MAGIC:
+		case XFS_DIR3_DATA_MAGIC:
+			xfs.dirend = xfs.dirbsize;
+			break;
+		default:
+			continue;
+		}
+		xfs.blkoff = xfs.dirhdr;
+		return 1;
+	}
+}
+
 static char *
 next_dentry (xfs_ino_t *ino)
 {
 	int namelen = 1;
-	int toread;
+	int len;
 	static char *usual[2] = {".", ".."};
 	static xfs_dir2_sf_entry_t *sfe;
+	xfs_dir2_data_union_t *dau;
 	char *name = usual[0];
 
-	if (xfs.dirpos >= xfs.dirmax) {
-		if (xfs.forw == 0)
-			return NULL;
-		xfs.dablk = xfs.forw;
-		xfs_dabread ();
-#define h	((xfs_dir2_leaf_hdr_t *)dirbuf)
-		xfs.dirmax = le16 (h->count) - le16 (h->stale);
-		xfs.forw = le32 (h->info.forw);
-#undef h
-		xfs.dirpos = 0;
-	}
-
 	switch (icore.di_format) {
 	case XFS_DINODE_FMT_LOCAL:
+		if (xfs.dirpos >= xfs.dirmax)
+			return NULL;
 		switch (xfs.dirpos) {
 		case -2:
 			*ino = 0;
@@ -343,7 +449,7 @@ next_dentry (xfs_ino_t *ino)
 			++name;
 			++namelen;
 			sfe = (xfs_dir2_sf_entry_t *)
-				(inode->di_u.di_c
+				(dfork
 				 + sizeof(xfs_dir2_sf_hdr_t)
 				 - xfs.i8param);
 			break;
@@ -352,38 +458,41 @@ next_dentry (xfs_ino_t *ino)
 			*ino = sf_ino ((char *)sfe, namelen);
 			name = (char *) sfe->name;
 			sfe = (xfs_dir2_sf_entry_t *)
-				  ((char *)sfe + namelen + 11 - xfs.i8param);
+				  ((char *)sfe + namelen + 11 - xfs.i8param
+				   + xfs.ftype);
 		}
+		++xfs.dirpos;
 		break;
 	case XFS_DINODE_FMT_BTREE:
 	case XFS_DINODE_FMT_EXTENTS:
-#define dau	((xfs_dir2_data_union_t *)dirbuf)
 		for (;;) {
-			if (xfs.blkoff >= xfs.dirbsize) {
-				xfs.blkoff = sizeof(xfs_dir2_data_hdr_t);
-				filepos &= ~(xfs.dirbsize - 1);
-				filepos |= xfs.blkoff;
+			if (xfs.blkoff + 8 > xfs.dirend) {
+				if (!next_dirblock ())
+					return NULL;
+				continue;
 			}
-			xfs_read (dirbuf, 4);
-			xfs.blkoff += 4;
-			if (dau->unused.freetag == XFS_DIR2_DATA_FREE_TAG) {
-				toread = roundup8 (le16(dau->unused.length)) - 4;
-				xfs.blkoff += toread;
-				filepos += toread;
+			dau = (xfs_dir2_data_union_t *)(xfs.dirblk + xfs.blkoff);
+			if (le16 (dau->unused.freetag) == XFS_DIR2_DATA_FREE_TAG) {
+				len = le16 (dau->unused.length);
+			} else {
+				namelen = dau->entry.namelen;
+				len = roundup8 (namelen + 11 + xfs.ftype);
+			}
+			if (len < 8 || (len & 7) || xfs.blkoff + len > xfs.dirend) {
+				/* corrupt block, go on with the next one */
+				xfs.dirend = 0;
 				continue;
 			}
-			break;
+			xfs.blkoff += len;
+			if (le16 (dau->unused.freetag) != XFS_DIR2_DATA_FREE_TAG)
+				break;
 		}
-		xfs_read ((char *)dirbuf + 4, 5);
 		*ino = le64 (dau->entry.inumber);
-		namelen = dau->entry.namelen;
-#undef dau
-		toread = roundup8 (namelen + 11) - 9;
-		xfs_read (dirbuf, toread);
-		name = (char *)dirbuf;
-		xfs.blkoff += toread + 5;
+		name = (char *)dau->entry.name;
+		break;
+	default:
+		return NULL;
 	}
-	++xfs.dirpos;
 	name[namelen] = 0;
 
 	return name;
@@ -392,53 +501,38 @@ next_dentry (xfs_ino_t *ino)
 static char *
 first_dentry (xfs_ino_t *ino)
 {
-	xfs.forw = 0;
 	switch (icore.di_format) {
 	case XFS_DINODE_FMT_LOCAL:
-		xfs.dirmax = inode->di_u.di_dir2sf.hdr.count;
-		xfs.i8param = inode->di_u.di_dir2sf.hdr.i8count ? 0 : 4;
+		xfs.dirmax = sfhdr->count;
+		xfs.i8param = sfhdr->i8count ? 0 : 4;
 		xfs.dirpos = -2;
 		break;
 	case XFS_DINODE_FMT_EXTENTS:
 	case XFS_DINODE_FMT_BTREE:
-		filepos = 0;
-		xfs_read (dirbuf, sizeof(xfs_dir2_data_hdr_t));
-		if (((xfs_dir2_data_hdr_t *)dirbuf)->magic == le32(XFS_DIR2_BLOCK_MAGIC)) {
-#define tail		((xfs_dir2_block_tail_t *)dirbuf)
-			filepos = xfs.dirbsize - sizeof(*tail);
-			xfs_read (dirbuf, sizeof(*tail));
-			xfs.dirmax = le32 (tail->count) - le32 (tail->stale);
-#undef tail
-		} else {
-			xfs.dablk = (1ULL << 35) >> xfs.blklog;
-#define h		((xfs_dir2_leaf_hdr_t *)dirbuf)
-#define n		((xfs_da_intnode_t *)dirbuf)
-			for (;;) {
-				xfs_dabread ();
-				if ((n->hdr.info.magic == le16(XFS_DIR2_LEAFN_MAGIC))
-				    || (n->hdr.info.magic == le16(XFS_DIR2_LEAF1_MAGIC))) {
-					xfs.dirmax = le16 (h->count) - le16 (h->stale);
-					xfs.forw = le32 (h->info.forw);
-					break;
-				}
-				xfs.dablk = le32 (n->btree[0].before);
-			}
-#undef n
-#undef h
-		}
-		xfs.blkoff = sizeof(xfs_dir2_data_hdr_t);
-		filepos = xfs.blkoff;
-		xfs.dirpos = 0;
+		if (!load_extents ())
+			return NULL;
+		xfs.dablk = 0;
+		xfs.blkoff = xfs.dirend = 0;
+		break;
 	}
 	return next_dentry (ino);
 }
 
+static inline int
+xfs_sb_version (const xfs_sb_t *super)
+{
+	return le16(super->sb_versionnum) & XFS_SB_VERSION_NUMBITS;
+}
+
 static bool
 xfs_sb_is_invalid (const xfs_sb_t *super)
 {
 	return (le32(super->sb_magicnum) != XFS_SB_MAGIC)
-	    || ((le16(super->sb_versionnum) & XFS_SB_VERSION_NUMBITS) !=
-	        XFS_SB_VERSION_4)
+	    || ((xfs_sb_version(super) != XFS_SB_VERSION_4)
+	        && (xfs_sb_version(super) != XFS_SB_VERSION_5))
+	    || ((xfs_sb_version(super) == XFS_SB_VERSION_5)
+	        && (le32(super->sb_features_incompat)
+		    & ~XFS_SB_FEAT_INCOMPAT_SUPPORTED))
 	    || (super->sb_inodelog < XFS_SB_INODELOG_MIN)
 	    || (super->sb_inodelog > XFS_SB_INODELOG_MAX)
 	    || (super->sb_blocklog < XFS_SB_BLOCKLOG_MIN)
@@ -449,7 +543,9 @@ xfs_sb_is_invalid (const xfs_sb_t *super)
 	    || (((1ull << super->sb_agblklog) >> 1) >=
 	        le32(super->sb_agblocks))
 	    || ((super->sb_blocklog + super->sb_dirblklog) >=
-	        XFS_SB_DIRBLK_NUMBITS);
+	        XFS_SB_DIRBLK_NUMBITS)
+	    || ((super->sb_blocklog + super->sb_dirblklog) >
+	        XFS_SB_BLOCKLOG_MAX);
 }
 
 int
@@ -481,12 +577,39 @@ xfs_mount (void)
 	xfs.bdlog = super.sb_blocklog - SECTOR_BITS;
 	xfs.isize = 1 << super.sb_inodelog;
 	xfs.dirbsize = 1 << (super.sb_blocklog + super.sb_dirblklog);
+	xfs.dirblklog = super.sb_dirblklog;
 	xfs.inopblog = super.sb_blocklog - super.sb_inodelog;
 
+	/* Version 5 adds CRC headers to inodes and metadata blocks */
+	xfs.crc = xfs_sb_version(&super) == XFS_SB_VERSION_5;
+	if (xfs.crc) {
+		xfs.ftype = !!(le32(super.sb_features_incompat)
+			       & XFS_SB_FEAT_INCOMPAT_FTYPE);
+		xfs.litino = offsetof(xfs_dinode_t, di_u)
+			     + sizeof(xfs_dinode_v3_t);
+		xfs.bthdr = sizeof(xfs_btree_lblock_crc_t);
+		xfs.dirhdr = sizeof(xfs_dir3_data_hdr_t);
+	} else {
+		xfs.ftype = (le16(super.sb_versionnum)
+			     & XFS_SB_VERSION_MOREBITSBIT)
+			    && (le32(super.sb_features2) & XFS_SB_VERSION2_FTYPE);
+		xfs.litino = offsetof(xfs_dinode_t, di_u);
+		xfs.bthdr = sizeof(xfs_btree_block_t);
+		xfs.dirhdr = sizeof(xfs_dir2_data_hdr_t);
+	}
+
 	xfs.btnode_ptr0_off =
-		((xfs.bsize - sizeof(xfs_btree_block_t)) /
+		((xfs.bsize - xfs.bthdr) /
 		(sizeof (xfs_bmbt_key_t) + sizeof (xfs_bmbt_ptr_t)))
-		 * sizeof(xfs_bmbt_key_t) + sizeof(xfs_btree_block_t);
+		 * sizeof(xfs_bmbt_key_t) + xfs.bthdr;
+
+	free (xfs.blkbuf);
+	free (xfs.dirblk);
+	xfs.blkbuf = malloc (xfs.bsize);
+	xfs.dirblk = malloc (xfs.dirbsize);
+	if (!xfs.blkbuf || !xfs.dirblk)
+		return 0;
+	xfs.xads_valid = 0;
 
 	return 1;
 }
@@ -495,48 +618,48 @@ int
 xfs_read (char *buf, int len)
 {
 	xad_t *xad;
-	xfs_fileoff_t endofprev, endofcur, offset;
-	xfs_filblks_t xadlen;
-	int toread, startpos, endpos;
+	xfs_fileoff_t fblk;
+	__uint64_t xstart, xend, startpos;
+	unsigned int i;
+	int toread;
 
 	if (icore.di_format == XFS_DINODE_FMT_LOCAL) {
-		memmove (buf, inode->di_u.di_c + filepos, len);
+		memmove (buf, dfork + filepos, len);
 		filepos += len;
 		return len;
 	}
 
+	if (!load_extents ())
+		return 0;
+
 	startpos = filepos;
-	endpos = filepos + len;
-	endofprev = (xfs_fileoff_t)-1;
-	init_extents ();
-	while (len > 0 && (xad = next_extent ())) {
-		offset = xad->offset;
-		xadlen = xad->len;
-		if (isinxt (filepos >> xfs.blklog, offset, xadlen)) {
-			endofcur = (offset + xadlen) << xfs.blklog;
-			toread = (endofcur >= endpos)
-				  ? len : (endofcur - filepos);
+	i = seek_extent (filepos >> xfs.blklog);
+	while (len > 0 && i < xfs.nxads) {
+		xad = &xfs.xads[i];
+		xstart = xad->offset << xfs.blklog;
+		xend = (xad->offset + xad->len) << xfs.blklog;
+		if (filepos < xstart) {
+			/* hole */
+			toread = (xstart - filepos >= len)
+				  ? len : (xstart - filepos);
+			memset (buf, 0, toread);
+		} else {
+			toread = (xend - filepos >= len)
+				  ? len : (xend - filepos);
+			fblk = (filepos - xstart) >> xfs.blklog;
 
 			disk_read_func = disk_read_hook;
-			devread (fsb2daddr (xad->start),
-				 filepos - (offset << xfs.blklog), toread, buf);
+			devread (fsb2daddr (xad->start + fblk),
+				 filepos & (xfs.bsize - 1), toread, buf);
 			disk_read_func = NULL;
-
-			buf += toread;
-			len -= toread;
-			filepos += toread;
-		} else if (offset > endofprev) {
-			toread = ((offset << xfs.blklog) >= endpos)
-				  ? len : ((offset - endofprev) << xfs.blklog);
-			len -= toread;
-			filepos += toread;
-			for (; toread; toread--) {
-				*buf++ = 0;
-			}
-			continue;
 		}
-		endofprev = offset + xadlen;
+		buf += toread;
+		len -= toread;
+		filepos += toread;
+		if (filepos >= xend)
+			i++;
 	}
+	xfs.xcur = i;
 
 	return filepos - startpos;
 }
@@ -547,14 +670,15 @@ xfs_dir (char *dirname)
 	xfs_ino_t ino, parent_ino, new_ino;
 	xfs_fsize_t di_size;
 	int di_mode;
-	int cmp, n, link_count;
+	int cmp, n, link_count, hdr;
 	char linkbuf[xfs.bsize];
 	char *rest, *name, ch;
 
 	parent_ino = ino = xfs.rootino;
 	link_count = 0;
 	for (;;) {
-		di_read (ino);
+		if (!di_read (ino))
+			return 0;
 		di_size = le64 (icore.di_size);
 		di_mode = le16 (icore.di_mode);
 
@@ -563,10 +687,22 @@ xfs_dir (char *dirname)
 				errnum = ERR_SYMLINK_LOOP;
 				return 0;
 			}
-			if (di_size < xfs.bsize - 1) {
+			/* Only the target, no header, is in the inode */
+			hdr = (xfs.crc && icore.di_format != XFS_DINODE_FMT_LOCAL)
+				? sizeof (xfs_dsymlink_hdr_t) : 0;
+			if (di_size < xfs.bsize - 1 - hdr) {
 				filepos = 0;
-				filemax = di_size;
+				filemax = di_size + hdr;
 				n = xfs_read (linkbuf, filemax);
+				if (hdr) {
+					if (n < hdr || le32 (((xfs_dsymlink_hdr_t *)
+						linkbuf)->sl_magic) != XFS_SYMLINK_MAGIC) {
+						errnum = ERR_FSYS_CORRUPT;
+						return 0;
+					}
+					n -= hdr;
+					memmove (linkbuf, linkbuf + hdr, n);
+				}
 			} else {
 				errnum = ERR_FILELENGTH;
 				return 0;
@@ -599,8 +735,8 @@ xfs_dir (char *dirname)
 		for (rest = dirname; (ch = *rest) && !isspace (ch) && ch != '/'; rest++);
 		*rest = 0;
 
-		name = first_dentry (&new_ino);
-		for (;;) {
+		for (name = first_dentry (&new_ino); name;
+		     name = next_dentry (&new_ino)) {
 			cmp = (!*dirname) ? -1 : substring (dirname, name);
 #ifndef STAGE1_5
 			if (print_possibilities && ch != '/' && cmp <= 0) {
@@ -616,15 +752,14 @@ xfs_dir (char *dirname)
 				*(dirname = rest) = ch;
 				break;
 			}
-			name = next_dentry (&new_ino);
-			if (name == NULL) {
-				if (print_possibilities < 0)
-					return 1;
+		}
+		if (name == NULL) {
+			if (print_possibilities < 0)
+				return 1;
 
-				errnum = ERR_FILE_NOT_FOUND;
-				*rest = ch;
-				return 0;
-			}
+			errnum = ERR_FILE_NOT_FOUND;
+			*rest = ch;
+			return 0;
 		}
 	}
 }
@@ -0,0 +1,202 @@
+/*
+ * This file is part of FILO.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Block I/O statistics
+ *
+ * Counters are kept per drive, at two levels: what the filesystems ask
+ * for (devread()) and what is actually requested from the drivers,
+ * after the sector cache. Request sizes and latencies go into log2
+ * histograms, so a slow medium (high latency per request) can be told
+ * apart from a filesystem that issues many small reads.
+ */
+
+#include <libpayload.h>
+#include <config.h>
+#include <fs.h>
+#include <timer.h>
+#include <iostat.h>
+
+#define IOSTAT_MAX_DEVS		8
+#define IOSTAT_SIZE_BUCKETS	10	/* 1 .. 256+ sectors */
+#define IOSTAT_LAT_BUCKETS	24	/* 1 us .. 8 s+ */
+
+struct iostat_dev {
+	int type;			/* 0 if unused */
+	int drive;
+
+	unsigned long reads;		/* devread() calls */
+	u64 read_bytes;
+	unsigned long cache_hits;
+	unsigned long cache_misses;
+
+	unsigned long requests;		/* driver requests */
+	u64 req_sectors;
+	unsigned long errors;
+	u64 busy;			/* ticks spent in the driver */
+
+	unsigned long size_hist[IOSTAT_SIZE_BUCKETS];
+	unsigned long lat_hist[IOSTAT_LAT_BUCKETS];
+};
+
+static struct iostat_dev devs[IOSTAT_MAX_DEVS];
+
+static struct iostat_dev *iostat_dev(int type, int drive)
+{
+	int i;
+
+	for (i = 0; i < IOSTAT_MAX_DEVS; i++) {
+		if (!devs[i].type) {
+			devs[i].type = type;
+			devs[i].drive = drive;
+		}
+		if (devs[i].type == type && devs[i].drive == drive)
+			return &devs[i];
+	}
+	return NULL;
+}
+
+static int log2_bucket(u64 val, int buckets)
+{
+	int i = 0;
+
+	while (val > 1 && i < buckets - 1) {
+		val >>= 1;
+		i++;
+	}
+	return i;
+}
+
+static u64 ticks_to_us(u64 ticks)
+{
+	return ticks / MAX(timer_hz() / 1000000, 1);
+}
+
+void iostat_read(int type, int drive, unsigned long bytes)
+{
+	struct iostat_dev *const d = iostat_dev(type, drive);
+
+	if (!d)
+		return;
+	d->reads++;
+	d->read_bytes += bytes;
+}
+
+void iostat_cache(int type, int drive, int hit)
+{
+	struct iostat_dev *const d = iostat_dev(type, drive);
+
+	if (!d)
+		return;
+	if (hit)
+		d->cache_hits++;
+	else
+		d->cache_misses++;
+}
+
+void iostat_request(int type, int drive, u64 start, unsigned long sectors,
+		int ok)
+{
+	const u64 ticks = currticks() - start;
+	struct iostat_dev *const d = iostat_dev(type, drive);
+
+	if (!d)
+		return;
+
+	d->requests++;
+	d->busy += ticks;
+	d->lat_hist[log2_bucket(ticks_to_us(ticks), IOSTAT_LAT_BUCKETS)]++;
+	if (!ok) {
+		d->errors++;
+		return;
+	}
+	d->req_sectors += sectors;
+	d->size_hist[log2_bucket(sectors, IOSTAT_SIZE_BUCKETS)]++;
+}
+
+static const char *dev_type_name(int type)
+{
+	switch (type) {
+	case DISK_IDE:
+		return "hd";
+	case DISK_USB:
+		return "ud";
+	case DISK_FLASH:
+		return "flash";
+	default:
+		return "mem";
+	}
+}
+
+static void print_hist(const char *title, const unsigned long *hist,
+		int buckets)
+{
+	unsigned long lo;
+	int i;
+
+	printf("  %s:\n", title);
+	for (i = 0; i < buckets; i++) {
+		if (!hist[i])
+			continue;
+		lo = i ? 1UL << i : 0;
+		if (i == buckets - 1)
+			printf("    %8lu+       %lu\n", lo, hist[i]);
+		else
+			printf("    %8lu-%-8lu %lu\n", lo, (2UL << i) - 1,
+					hist[i]);
+	}
+}
+
+void iostat_show(void)
+{
+	const struct iostat_dev *d;
+	int i, any = 0;
+
+	for (i = 0; i < IOSTAT_MAX_DEVS; i++) {
+		d = &devs[i];
+		if (!d->type)
+			continue;
+		any = 1;
+
+		printf("%s", dev_type_name(d->type));
+		if (d->type != DISK_MEM)
+			printf("%c", 'a' + d->drive);
+		printf(": %lu reads, %llu KiB\n", d->reads, d->read_bytes >> 10);
+		if (d->cache_hits || d->cache_misses)
+			printf("  sector cache: %lu hits, %lu misses\n",
+					d->cache_hits, d->cache_misses);
+		if (!d->requests)
+			continue;
+
+		printf("  driver: %lu requests, %llu KiB, %lu errors, "
+				"%llu ms busy\n", d->requests,
+				d->req_sectors >> 1, d->errors,
+				ticks_to_us(d->busy) / 1000);
+		if (d->busy)
+			printf("  throughput: %llu KiB/s\n",
+					(d->req_sectors >> 1) * 1000000 /
+					MAX(ticks_to_us(d->busy), 1));
+		print_hist("request size (sectors)", d->size_hist,
+				IOSTAT_SIZE_BUCKETS);
+		print_hist("request latency (us)", d->lat_hist,
+				IOSTAT_LAT_BUCKETS);
+	}
+
+	if (!any)
+		printf("No block I/O so far.\n");
+}
+
+void iostat_reset(void)
+{
+	memset(devs, 0, sizeof(devs));
+}
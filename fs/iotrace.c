@@ -0,0 +1,201 @@
+/*
+ * This file is part of FILO.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Block I/O trace
+ *
+ * Every sector cache lookup, driver request, filesystem read and mount,
+ * and every boot stage change is recorded in a fixed-size ring, the
+ * oldest records are overwritten. Each record carries the tag of the
+ * filesystem that was active and the innermost boot stage, so reads
+ * can be attributed to whoever caused them.
+ *
+ * "iotrace" prints the ring on the console (and thus on the serial
+ * port), util/iotrace2json turns a capture of that into a Chrome trace
+ * that Perfetto or chrome://tracing can show.
+ */
+
+#include <libpayload.h>
+#include <config.h>
+#include <fs.h>
+#include <timer.h>
+#include <boottime.h>
+#include <iotrace.h>
+
+#define IOTRACE_MAX_TAGS	16
+#define IOTRACE_MAX_NESTING	8
+#define IOTRACE_NO_STAGE	0xff
+
+enum iotrace_event {
+	EV_CACHE = 'C',		/* sector cache lookup */
+	EV_REQUEST = 'R',	/* driver request */
+	EV_READ = 'F',		/* filesystem read */
+	EV_MOUNT = 'M',		/* mount attempt */
+	EV_STAGE_BEGIN = 'B',
+	EV_STAGE_END = 'E',
+};
+
+#define IOTRACE_OK		0x01	/* request or mount succeeded */
+#define IOTRACE_HIT		0x02	/* cache hit */
+
+struct iotrace_rec {
+	u64 start;		/* currticks() */
+	u64 where;		/* sector, file position or stage */
+	u32 ticks;		/* duration, saturated */
+	u32 len;		/* sectors or bytes */
+	u8 event;
+	u8 type;		/* DISK_* */
+	u8 drive;
+	u8 flags;
+	u8 tag;			/* index into tags[] + 1, 0 if none */
+	u8 stage;		/* innermost boot stage */
+	u16 reserved;
+} __attribute__ ((packed));
+
+static struct iotrace_rec ring[CONFIG_IO_TRACE_ENTRIES];
+static unsigned long ring_next;		/* total records so far */
+
+static const char *tags[IOTRACE_MAX_TAGS];
+static u8 cur_tag;
+
+static u8 stage_stack[IOTRACE_MAX_NESTING];
+static int stage_depth;
+
+static struct iotrace_rec *iotrace_add(int event, u64 start)
+{
+	struct iotrace_rec *const r = &ring[ring_next++ % CONFIG_IO_TRACE_ENTRIES];
+	const u64 ticks = currticks() - start;
+
+	memset(r, 0, sizeof(*r));
+	r->start = start;
+	r->ticks = ticks > 0xffffffff ? 0xffffffff : ticks;
+	r->event = event;
+	r->tag = cur_tag;
+	r->stage = stage_depth ? stage_stack[stage_depth - 1] : IOTRACE_NO_STAGE;
+	return r;
+}
+
+void iotrace_tag(const char *tag)
+{
+	int i;
+
+	cur_tag = 0;
+	if (!tag)
+		return;
+
+	for (i = 0; i < IOTRACE_MAX_TAGS; i++) {
+		if (!tags[i])
+			tags[i] = tag;
+		if (tags[i] == tag) {
+			cur_tag = i + 1;
+			return;
+		}
+	}
+}
+
+void iotrace_stage(int stage, int begin)
+{
+	struct iotrace_rec *r;
+
+	if (begin) {
+		r = iotrace_add(EV_STAGE_BEGIN, currticks());
+		if (stage_depth < IOTRACE_MAX_NESTING)
+			stage_stack[stage_depth++] = stage;
+	} else {
+		/* stages may end out of order, drop the newest instance */
+		int i;
+
+		for (i = stage_depth - 1; i >= 0; i--) {
+			if (stage_stack[i] != stage)
+				continue;
+			memmove(&stage_stack[i], &stage_stack[i + 1],
+					stage_depth - i - 1);
+			stage_depth--;
+			break;
+		}
+		r = iotrace_add(EV_STAGE_END, currticks());
+	}
+	r->where = stage;
+}
+
+void iotrace_cache(int type, int drive, unsigned long sector, int hit)
+{
+	struct iotrace_rec *const r = iotrace_add(EV_CACHE, currticks());
+
+	r->type = type;
+	r->drive = drive;
+	r->where = sector;
+	r->len = 1;
+	r->flags = hit ? IOTRACE_HIT : 0;
+}
+
+void iotrace_request(int type, int drive, u64 start, unsigned long sector,
+		unsigned long count, int ok)
+{
+	struct iotrace_rec *const r = iotrace_add(EV_REQUEST, start);
+
+	r->type = type;
+	r->drive = drive;
+	r->where = sector;
+	r->len = count;
+	r->flags = ok ? IOTRACE_OK : 0;
+}
+
+void iotrace_read(u64 start, u64 pos, unsigned long len, int ret)
+{
+	struct iotrace_rec *const r = iotrace_add(EV_READ, start);
+
+	r->where = pos;
+	r->len = len;
+	r->flags = ret > 0 || !len ? IOTRACE_OK : 0;
+}
+
+void iotrace_mount(u64 start, int ok)
+{
+	struct iotrace_rec *const r = iotrace_add(EV_MOUNT, start);
+
+	r->flags = ok ? IOTRACE_OK : 0;
+}
+
+/*
+ * Every line starts with "iotrace: ", so the records can be picked out
+ * of a serial log with other output in between.
+ */
+void iotrace_dump(void)
+{
+	const unsigned long count = MIN(ring_next, CONFIG_IO_TRACE_ENTRIES);
+	const struct iotrace_rec *r;
+	unsigned long i;
+
+	printf("iotrace: begin 1 %llu %lu %lu\n", timer_hz(), count,
+			ring_next - count);
+	for (i = 0; i < IOTRACE_MAX_TAGS && tags[i]; i++)
+		printf("iotrace: tag %lu %s\n", i + 1, tags[i]);
+#if IS_ENABLED(CONFIG_BOOT_TIMESTAMPS)
+	for (i = 0; i < STAGE_COUNT; i++)
+		printf("iotrace: stage %lu %s\n", i, boottime_stage_name(i));
+#endif
+
+	for (i = ring_next - count; i < ring_next; i++) {
+		r = &ring[i % CONFIG_IO_TRACE_ENTRIES];
+		printf("iotrace: %c %llx %x %x %x %llx %x %x %x %x\n",
+				r->event, r->start, r->ticks, r->type, r->drive,
+				r->where, r->len, r->flags, r->tag, r->stage);
+	}
+	printf("iotrace: end\n");
+}
+
+void iotrace_reset(void)
+{
+	ring_next = 0;
+}
@@ -124,6 +124,15 @@ struct iso_primary_descriptor {
 	u_int8_t	_unused5[653];
 } __attribute__ ((packed));
 
+/* L-type (little endian) path table record */
+struct iso_path_table_record {
+	u_int8_t	name_len;
+	u_int8_t	ext_attr_length;
+	u_int32_t	extent;
+	u_int16_t	parent;
+	u_int8_t	name[1];
+} __attribute__ ((packed));
+
 struct rock_ridge {
 	u_int16_t	signature;
 	u_int8_t	len;
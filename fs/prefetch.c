@@ -0,0 +1,301 @@
+/*
+ * This file is part of FILO.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <libpayload.h>
+#include <config.h>
+#include <fs.h>
+#include <lib.h>
+#include <timer.h>
+#include <physmem.h>
+#include <task.h>
+#include <prefetch.h>
+#include <boottime.h>
+#include "filesys.h"
+
+#define DEBUG_THIS CONFIG_DEBUG_VFS
+#include <debug.h>
+
+/*
+ * Prefetching
+ * ^^^^^^^^^^^
+ *
+ * While the boot menu counts down, the drives are idle. The image and
+ * initrds of the default entry are loaded in that time by a task, a
+ * few milliseconds each time the countdown loop polls it, so keys are
+ * still seen right away. The file stays open from one slice to the
+ * next, so the drive isn't probed, the file system isn't mounted and
+ * the path isn't looked up again each time. If anything else used the
+ * file system in between (file_generation changed), it's opened again
+ * and reading goes on where the last slice stopped. None of this shows
+ * up in the boot timeline, it isn't part of the boot.
+ *
+ * The files are loaded to staging areas from physmem_alloc_kept(), that
+ * are kept across boot attempts and get out of the way of any fixed
+ * range a loader reserves. When boot() opens the files, file_open()
+ * serves them from there, so the loaders copy them into place without
+ * any drive access.
+ */
+
+#define PREFETCH_MAX_FILES	8
+#define PREFETCH_CHUNK		(64 << 10)
+#define PREFETCH_SLICE_MS	10
+#define PREFETCH_ADDR_MAX	(1ULL << 32)
+
+enum prefetch_state {
+	PREFETCH_QUEUED,
+	PREFETCH_LOADING,
+	PREFETCH_DONE,
+	PREFETCH_FAILED,
+};
+
+struct prefetch_file {
+	char *name;
+	enum prefetch_state state;
+	uint64_t addr;		/* staging area */
+	unsigned long size;
+	unsigned long done;	/* bytes loaded */
+};
+
+static struct prefetch_file files[PREFETCH_MAX_FILES];
+static int nfiles;
+static int current;		/* file that is loaded next */
+
+static struct task prefetch_task;
+static int prefetch(struct task *t);
+
+static struct prefetch_file *opened;
+
+/* File that is open for loading, while file_generation is unchanged */
+static struct prefetch_file *loading;
+static unsigned int loading_generation;
+
+static void queue_file(const char *name, size_t len)
+{
+	struct prefetch_file *const f = &files[nfiles];
+
+	if (!len || nfiles == PREFETCH_MAX_FILES)
+		return;
+
+	f->name = malloc(len + 1);
+	if (!f->name)
+		return;
+	memcpy(f->name, name, len);
+	f->name[len] = '\0';
+	f->state = PREFETCH_QUEUED;
+	f->addr = 0;
+	f->size = 0;
+	f->done = 0;
+	nfiles++;
+	debug("prefetch: queued %s\n", f->name);
+}
+
+void prefetch_start(const char *line)
+{
+	const char *p, *val;
+	char *list;
+	size_t len;
+	int i, count;
+
+	prefetch_drop();
+
+	/* The image, up to the first blank */
+	len = strcspn(line, " ");
+	queue_file(line, len);
+
+	/* and the initrds, split up as the Linux loader does */
+	for (p = line + len; *p; p += len) {
+		p += strspn(p, " ");
+		len = strcspn(p, " ");
+		if (len < 7 || memcmp(p, "initrd=", 7))
+			continue;
+
+		list = malloc(len - 7 + 1);
+		if (!list)
+			continue;
+		memcpy(list, p + 7, len - 7);
+		list[len - 7] = '\0';
+		count = file_list_split(list);
+		for (i = 0, val = list; i < count; i++, val += strlen(val) + 1)
+			queue_file(val, strlen(val));
+		free(list);
+	}
+
+	task_start(&prefetch_task, "prefetch", prefetch, TASK_IO);
+}
+
+static void stop_loading(void)
+{
+	if (loading && file_generation == loading_generation)
+		file_close();
+	loading = NULL;
+}
+
+static void fail(struct prefetch_file *const f)
+{
+	stop_loading();
+	if (f->addr) {
+		physmem_release(f->addr, f->size);
+		f->addr = 0;
+	}
+	f->state = PREFETCH_FAILED;
+	current++;
+}
+
+/* A staging area was moved out of a loader's way */
+static void moved(const uint64_t from, const uint64_t to)
+{
+	int i;
+
+	for (i = 0; i < nfiles; i++) {
+		if (files[i].addr == from) {
+			files[i].addr = to;
+			break;
+		}
+	}
+}
+
+/* Open `f` and set it up for loading on from where it was left */
+static int open_file(struct prefetch_file *const f)
+{
+	if (loading == f && file_generation == loading_generation)
+		return 1;
+
+	stop_loading();
+	if (!file_open(f->name))
+		return 0;
+
+	if (f->state == PREFETCH_QUEUED) {
+		f->size = file_size();
+		if (!f->size ||
+				f->size > (unsigned long)CONFIG_PREFETCH_MAX << 20) {
+			debug("prefetch: not loading %s, %lu bytes\n",
+					f->name, f->size);
+			file_close();
+			return 0;
+		}
+		f->addr = physmem_alloc_kept(f->size, PREFETCH_ADDR_MAX, moved);
+		if (!f->addr) {
+			file_close();
+			return 0;
+		}
+		f->state = PREFETCH_LOADING;
+	}
+
+	file_seek(f->done);
+	loading = f;
+	loading_generation = file_generation;
+	return 1;
+}
+
+/* Load `f` on from where it was left, until `deadline` */
+static void load_slice(struct prefetch_file *const f, const u64 deadline)
+{
+	char *buf;
+	int ret;
+
+	boottime_hold(1);
+	if (!open_file(f)) {
+		fail(f);
+		goto out;
+	}
+
+	buf = phys_to_virt(f->addr);
+	while (f->done < f->size) {
+		ret = file_read(buf + f->done,
+				MIN(f->size - f->done, PREFETCH_CHUNK));
+		if (ret <= 0) {
+			fail(f);
+			goto out;
+		}
+		f->done += ret;
+		if (deadline && currticks() >= deadline)
+			break;
+	}
+
+	if (f->done == f->size) {
+		debug("prefetch: loaded %s\n", f->name);
+		stop_loading();
+		f->state = PREFETCH_DONE;
+		current++;
+	}
+out:
+	boottime_hold(0);
+}
+
+static int prefetch(struct task *t)
+{
+	const u64 slice = TICKS_PER_SEC * PREFETCH_SLICE_MS / 1000;
+
+	TASK_BEGIN(t);
+	while (current < nfiles) {
+		load_slice(&files[current], currticks() + MAX(slice, 1));
+		TASK_YIELD(t);
+	}
+	TASK_END(t);
+}
+
+void prefetch_boot(const char *file)
+{
+	if (!nfiles || strcmp(file, files[0].name)) {
+		prefetch_drop();
+		return;
+	}
+
+	task_stop(&prefetch_task);
+	while (current < nfiles)
+		load_slice(&files[current], 0);
+}
+
+void prefetch_drop(void)
+{
+	int i;
+
+	task_stop(&prefetch_task);
+	stop_loading();
+	for (i = 0; i < nfiles; i++) {
+		if (files[i].addr)
+			physmem_release(files[i].addr, files[i].size);
+		free(files[i].name);
+	}
+	memset(files, 0, sizeof(files));
+	nfiles = 0;
+	current = 0;
+	opened = NULL;
+}
+
+int prefetch_open(const char *filename)
+{
+	int i;
+
+	for (i = 0; i < nfiles; i++) {
+		if (files[i].state == PREFETCH_DONE &&
+				!strcmp(files[i].name, filename)) {
+			opened = &files[i];
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int prefetch_dir(char *filename)
+{
+	filemax = opened->size;
+	return 1;
+}
+
+int prefetch_read(char *buf, int len)
+{
+	memcpy(buf, (char *)phys_to_virt(opened->addr) + filepos, len);
+	filepos += len;
+	return len;
+}
@@ -0,0 +1,541 @@
+/*
+ * This file is part of FILO.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Boot readahead
+ *
+ * Every sector that misses the sector cache is noted, merged into
+ * ranges. Those are mostly filesystem metadata and other small reads,
+ * scattered over the drive; bulk file data bypasses the cache anyway.
+ *
+ * "readahead" prints the ranges as a list, which is to be stored as
+ * CONFIG_READAHEAD_LIST. On the next start, the ranges of the list are
+ * read up front, sorted and with small gaps read along, in a few large
+ * requests. read_sector() then takes them from memory. On rotating and
+ * optical drives, that replaces lots of seeks with a few streaming
+ * reads.
+ *
+ * FILO can't write the list itself. "readahead --at-jump" prints it
+ * right before the OS is started, so that it covers a whole boot.
+ *
+ * For each drive, the list starts with an "id" line, a hash of the
+ * first sectors and of those where an ISO 9660 volume descriptor
+ * would be. Ranges of drives whose id doesn't match anymore, e.g.
+ * another medium in a removable drive, are not read ahead. The id is
+ * checked again whenever the drive is opened, as the medium may have
+ * been changed since, and what was read ahead of it is dropped if it
+ * doesn't match.
+ *
+ * The data is only meant for the first boot. It's dropped after the
+ * first boot attempt, and after a read error.
+ */
+
+#include <libpayload.h>
+#include <config.h>
+#include <fs.h>
+#include <lib.h>
+#include <readahead.h>
+
+#define DEBUG_THIS CONFIG_DEBUG_BLOCKDEV
+#include <debug.h>
+
+#define READAHEAD_MAX_NOTES	1024
+#define READAHEAD_MAX_LIST	(64 << 10)	/* bytes of the list file */
+#define READAHEAD_GAP		64	/* sectors that are read along */
+#define READAHEAD_MAX_DRIVES	8
+#define READAHEAD_ID_SECTORS	8	/* hashed at 0 and 64 */
+
+struct ra_range {
+	int type;
+	int drive;
+	unsigned long start;
+	unsigned long count;
+	unsigned char *data;	/* only for ranges read ahead */
+};
+
+/* Cache misses of this run, sorted and merged */
+static struct ra_range notes[READAHEAD_MAX_NOTES];
+static int nnotes;
+static int notes_full;
+
+/* What was read ahead, sorted */
+static struct ra_range *ranges;
+static int nranges;
+static unsigned long hits;
+
+/* Drive ids from the list */
+static struct ra_id {
+	int type;
+	int drive;
+	u32 id;
+} ids[READAHEAD_MAX_DRIVES];
+static int nids;
+
+static int show_at_jump;
+static int noting_off;
+
+static int compare_ranges(const struct ra_range *a, const struct ra_range *b)
+{
+	if (a->type != b->type)
+		return a->type < b->type ? -1 : 1;
+	if (a->drive != b->drive)
+		return a->drive < b->drive ? -1 : 1;
+	if (a->start != b->start)
+		return a->start < b->start ? -1 : 1;
+	return 0;
+}
+
+static int compare_ranges_q(const void *a, const void *b)
+{
+	return compare_ranges(a, b);
+}
+
+void readahead_note(int type, int drive, unsigned long sector)
+{
+	const struct ra_range key = { type, drive, sector, 1, NULL };
+	struct ra_range *r;
+	int lo = 0, hi = nnotes;
+
+	if (noting_off)
+		return;
+
+	/* find the first range that doesn't start before the sector */
+	while (lo < hi) {
+		const int mid = (lo + hi) / 2;
+
+		if (compare_ranges(&notes[mid], &key) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/* grow the one in front? */
+	if (lo > 0) {
+		r = &notes[lo - 1];
+		if (r->type == type && r->drive == drive &&
+				r->start + r->count >= sector) {
+			if (r->start + r->count == sector)
+				r->count++;
+			/* and merge with the one behind */
+			if (lo < nnotes && notes[lo].type == type &&
+					notes[lo].drive == drive &&
+					r->start + r->count == notes[lo].start) {
+				r->count += notes[lo].count;
+				memmove(&notes[lo], &notes[lo + 1],
+						(nnotes - lo - 1) * sizeof(*notes));
+				nnotes--;
+			}
+			return;
+		}
+	}
+	/* or the one behind? */
+	if (lo < nnotes) {
+		r = &notes[lo];
+		if (r->type == type && r->drive == drive) {
+			if (r->start == sector)
+				return;
+			if (r->start == sector + 1) {
+				r->start--;
+				r->count++;
+				return;
+			}
+		}
+	}
+
+	if (nnotes == READAHEAD_MAX_NOTES) {
+		notes_full = 1;
+		return;
+	}
+	memmove(&notes[lo + 1], &notes[lo], (nnotes - lo) * sizeof(*notes));
+	notes[lo] = key;
+	nnotes++;
+}
+
+int readahead_lookup(int type, int drive, unsigned long sector, void *buf)
+{
+	const struct ra_range key = { type, drive, sector, 1, NULL };
+	const struct ra_range *r;
+	int lo = 0, hi = nranges;
+
+	/* find the last range that starts at or before the sector */
+	while (lo < hi) {
+		const int mid = (lo + hi) / 2;
+
+		if (compare_ranges(&ranges[mid], &key) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!lo)
+		return 0;
+
+	r = &ranges[lo - 1];
+	if (r->type != type || r->drive != drive ||
+			sector >= r->start + r->count)
+		return 0;
+
+	memcpy(buf, r->data + ((sector - r->start) << DEV_SECTOR_BITS),
+			DEV_SECTOR_SIZE);
+	hits++;
+	return 1;
+}
+
+static const char *drive_prefix(int type)
+{
+	switch (type) {
+	case DISK_IDE:
+		return "hd";
+	case DISK_USB:
+		return "ud";
+	default:
+		/* flash and memory aren't worth it */
+		return NULL;
+	}
+}
+
+/* Tell media apart by their partition tables or volume descriptors */
+static u32 open_drive_id(void)
+{
+	static const unsigned long at[] = { 0, 64 };
+	const unsigned long len = READAHEAD_ID_SECTORS << DEV_SECTOR_BITS;
+	unsigned char *buf;
+	u32 id = 2166136261U;	/* FNV-1a */
+	unsigned long i, j;
+
+	buf = malloc(len);
+	if (!buf)
+		return 0;
+	for (i = 0; i < sizeof(at) / sizeof(at[0]); i++) {
+		if (devread_blocks(at[i], READAHEAD_ID_SECTORS, buf) != 1)
+			continue;
+		for (j = 0; j < len; j++)
+			id = (id ^ buf[j]) * 16777619U;
+	}
+	free(buf);
+	return id;
+}
+
+static u32 drive_id(const char *name)
+{
+	int reopen;
+
+	if (!devopen(name, &reopen))
+		return 0;
+	return open_drive_id();
+}
+
+static char *skip_blanks(char *line)
+{
+	while (*line == ' ' || *line == '\t')
+		line++;
+	return line;
+}
+
+/* Parse a drive name like "hda" */
+static int parse_drive(char **linep, int *type, int *drive)
+{
+	char *line = *linep;
+
+	if (!memcmp(line, "hd", 2))
+		*type = DISK_IDE;
+	else if (!memcmp(line, "ud", 2))
+		*type = DISK_USB;
+	else
+		return 0;
+	line += 2;
+	if (*line < 'a' || *line > 'z')
+		return 0;
+	*drive = *line++ - 'a';
+	if (*line != ' ' && *line != '\t')
+		return 0;	/* no partitions, positions are absolute */
+
+	*linep = line;
+	return 1;
+}
+
+/* Parse "id <drive> <id>", e.g. "id hda 4f1c0e52" */
+static void parse_id(char *line)
+{
+	struct ra_id *const id = &ids[nids];
+
+	line = skip_blanks(line + 2);
+	if (nids == READAHEAD_MAX_DRIVES ||
+			!parse_drive(&line, &id->type, &id->drive))
+		return;
+	id->id = simple_strtoull(skip_blanks(line), &line, 16);
+	nids++;
+}
+
+/* Parse "<drive> <start> <count>", e.g. "hda 800 10" */
+static int parse_line(char *line, struct ra_range *r)
+{
+	line = skip_blanks(line);
+	if (!*line || *line == '#')
+		return 0;
+
+	if (!memcmp(line, "id", 2) && (line[2] == ' ' || line[2] == '\t')) {
+		parse_id(line);
+		return 0;
+	}
+	if (!parse_drive(&line, &r->type, &r->drive))
+		return 0;
+
+	r->start = simple_strtoull(skip_blanks(line), &line, 16);
+	r->count = simple_strtoull(skip_blanks(line), &line, 16);
+	r->data = NULL;
+	return r->count > 0;
+}
+
+/* Read the list, merge close ranges, and round them to 2048 bytes */
+static struct ra_range *load_list(int *count)
+{
+	struct ra_range *list = NULL, *p, r;
+	char *buf, *line, *next;
+	unsigned long size;
+	int n = 0;
+
+	nids = 0;
+	if (!file_open_optional(CONFIG_READAHEAD_LIST))
+		return NULL;
+	size = file_size();
+	if (size > READAHEAD_MAX_LIST) {
+		printf("Readahead list too big\n");
+		file_close();
+		return NULL;
+	}
+	buf = malloc(size + 1);
+	if (!buf || file_read(buf, size) != (int)size) {
+		printf("Can't read readahead list\n");
+		free(buf);
+		file_close();
+		return NULL;
+	}
+	file_close();
+	buf[size] = '\0';
+
+	for (line = buf; line; line = next) {
+		next = strpbrk(line, "\r\n");
+		if (next)
+			*next++ = '\0';
+		if (!parse_line(line, &r))
+			continue;
+
+		r.count += r.start & 3;
+		r.start &= ~3UL;
+		r.count = ALIGN_UP(r.count, 4);
+
+		p = realloc(list, (n + 1) * sizeof(*list));
+		if (!p)
+			break;
+		list = p;
+		list[n++] = r;
+	}
+	free(buf);
+
+	qsort(list, n, sizeof(*list), compare_ranges_q);
+	*count = n;
+	return list;
+}
+
+static const struct ra_id *find_id(int type, int drive)
+{
+	int i;
+
+	for (i = 0; i < nids; i++) {
+		if (ids[i].type == type && ids[i].drive == drive)
+			return &ids[i];
+	}
+	return NULL;
+}
+
+/* Is `name` still the drive the list was recorded on? */
+static int drive_matches(int type, int drive, const char *name)
+{
+	const struct ra_id *const id = find_id(type, drive);
+
+	if (!id || drive_id(name) != id->id) {
+		debug("readahead list isn't for %s\n", name);
+		return 0;
+	}
+	return 1;
+}
+
+/* Drop what was read ahead of `drive` of type `type`, or all if -1 */
+static void drop_ranges(int type, int drive)
+{
+	int i, n = 0;
+
+	for (i = 0; i < nranges; i++) {
+		if (type == -1 ||
+				(ranges[i].type == type && ranges[i].drive == drive))
+			free(ranges[i].data);
+		else
+			ranges[n++] = ranges[i];
+	}
+	nranges = n;
+	if (!nranges) {
+		free(ranges);
+		ranges = NULL;
+	}
+}
+
+void readahead_opened(int type, int drive)
+{
+	const struct ra_id *const id = find_id(type, drive);
+	int i;
+
+	for (i = 0; i < nranges; i++) {
+		if (ranges[i].type == type && ranges[i].drive == drive)
+			break;
+	}
+	if (i == nranges || !id)
+		return;
+
+	if (open_drive_id() != id->id) {
+		debug("medium changed, dropping what was read ahead\n");
+		drop_ranges(type, drive);
+	}
+}
+
+void readahead_drop(void)
+{
+	debug("dropping %d ranges read ahead\n", nranges);
+	drop_ranges(-1, -1);
+}
+
+void readahead_load(void)
+{
+	struct ra_range *list, *r, *end, read;
+	unsigned long total = 0;
+	char name[8];
+	int n = 0, reopen, type = -1, drive = -1, matches = 0;
+
+	if (!CONFIG_READAHEAD_LIST[0])
+		return;
+
+	list = load_list(&n);
+	if (!list)
+		return;
+
+	ranges = calloc(n, sizeof(*ranges));
+	if (!ranges) {
+		free(list);
+		return;
+	}
+
+	for (r = list, end = list + n; r < end; ) {
+		/* One request for everything with gaps up to READAHEAD_GAP */
+		read = *r;
+		for (r++; r < end && r->type == read.type &&
+				r->drive == read.drive &&
+				r->start <= read.start + read.count +
+				READAHEAD_GAP; r++) {
+			read.count = MAX(read.count,
+					r->start + r->count - read.start);
+		}
+
+		snprintf(name, sizeof(name), "%s%c", drive_prefix(read.type),
+				'a' + read.drive);
+		if (read.type != type || read.drive != drive) {
+			type = read.type;
+			drive = read.drive;
+			matches = drive_matches(type, drive, name);
+		}
+		if (!matches)
+			continue;
+
+		total += read.count << DEV_SECTOR_BITS;
+		if (total > (CONFIG_READAHEAD_SIZE << 10))
+			break;
+		read.data = malloc(read.count << DEV_SECTOR_BITS);
+		if (!read.data)
+			break;
+		if (!devopen(name, &reopen) ||
+				devread_blocks(read.start, read.count,
+					read.data) != 1) {
+			debug("can't read ahead %s %lu+%lu\n", name,
+					read.start, read.count);
+			free(read.data);
+			continue;
+		}
+		ranges[nranges++] = read;
+	}
+	free(list);
+	devclose();
+
+	debug("read ahead %d ranges\n", nranges);
+}
+
+static void print_notes(void)
+{
+	struct ra_id drives[READAHEAD_MAX_DRIVES];
+	const struct ra_range *r;
+	char name[8];
+	int i, n = 0;
+
+	/* Reading the ids mustn't add to the notes */
+	noting_off = 1;
+	for (r = notes; r < notes + nnotes && n < READAHEAD_MAX_DRIVES; r++) {
+		if (!drive_prefix(r->type) || (n &&
+				drives[n - 1].type == r->type &&
+				drives[n - 1].drive == r->drive))
+			continue;
+		drives[n].type = r->type;
+		drives[n].drive = r->drive;
+		n++;
+	}
+	for (i = 0; i < n; i++) {
+		snprintf(name, sizeof(name), "%s%c",
+				drive_prefix(drives[i].type),
+				'a' + drives[i].drive);
+		drives[i].id = drive_id(name);
+	}
+	devclose();
+	noting_off = 0;
+
+	printf("# FILO readahead list\n");
+	for (i = 0; i < n; i++)
+		printf("id %s%c %08x\n", drive_prefix(drives[i].type),
+				'a' + drives[i].drive, drives[i].id);
+	for (r = notes; r < notes + nnotes; r++) {
+		if (drive_prefix(r->type))
+			printf("%s%c %lx %lx\n", drive_prefix(r->type),
+					'a' + r->drive, r->start, r->count);
+	}
+	if (notes_full)
+		printf("# list is incomplete, too many ranges\n");
+}
+
+void readahead_show(void)
+{
+	const struct ra_range *r;
+	unsigned long sectors = 0;
+
+	print_notes();
+	for (r = ranges; r < ranges + nranges; r++)
+		sectors += r->count;
+	printf("# %d ranges with %lu KiB were read ahead, "
+			"%lu sectors were taken from there\n",
+			nranges, sectors >> 1, hits);
+}
+
+void readahead_show_at_jump(void)
+{
+	show_at_jump = 1;
+}
+
+void readahead_jump(void)
+{
+	if (show_at_jump)
+		print_notes();
+}
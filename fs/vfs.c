@@ -24,12 +24,16 @@
 #include <fs.h>
 #include "filesys.h"
 #include <dirent.h>
+#include <digest.h>
+#include <boottime.h>
+#include <iotrace.h>
 
 #define DEBUG_THIS CONFIG_DEBUG_VFS
 #include <debug.h>
 
 u64 filepos;
 u64 filemax;
+unsigned int file_generation;
 grub_error_t errnum;
 void (*disk_read_hook) (int, int, int);
 void (*disk_read_func) (int, int, int);
@@ -44,41 +48,43 @@ struct fsys_entry {
 	int (*dir_func) (char *dirname);
 	void (*close_func) (void);
 	int (*embed_func) (int *start_sector, int needed_sectors);
+	int map_data;	/* file data is devread() straight into the caller's
+			   buffer, with disk_read_func set */
 };
 
 struct fsys_entry fsys_table[] = {
 # ifdef CONFIG_FSYS_CBFS
-	{"CBFS ROM Image", cbfs_mount, cbfs_read, cbfs_dir, 0, 0},
+	{"CBFS ROM Image", cbfs_mount, cbfs_read, cbfs_dir, 0, 0, 0},
 # endif
 # ifdef CONFIG_FSYS_FAT
-	{"FAT filesystem", fat_mount, fat_read, fat_dir, 0, 0},
+	{"FAT filesystem", fat_mount, fat_read, fat_dir, 0, 0, 1},
 # endif
 # ifdef CONFIG_FSYS_EXT2FS
-	{"EXT2 filesystem", ext2fs_mount, ext2fs_read, ext2fs_dir, 0, 0},
+	{"EXT2 filesystem", ext2fs_mount, ext2fs_read, ext2fs_dir, 0, 0, 1},
 # endif
 # ifdef CONFIG_FSYS_MINIX
-	{"MINIX filesystem", minix_mount, minix_read, minix_dir, 0, 0},
+	{"MINIX filesystem", minix_mount, minix_read, minix_dir, 0, 0, 1},
 # endif
 # ifdef CONFIG_FSYS_REISERFS
-	{"REISERFS filesystem", reiserfs_mount, reiserfs_read, reiserfs_dir, 0, reiserfs_embed},
+	{"REISERFS filesystem", reiserfs_mount, reiserfs_read, reiserfs_dir, 0, reiserfs_embed, 0},
 # endif
 # ifdef CONFIG_FSYS_JFS
-	{"JFS filesystem", jfs_mount, jfs_read, jfs_dir, 0, jfs_embed},
+	{"JFS filesystem", jfs_mount, jfs_read, jfs_dir, 0, jfs_embed, 1},
 # endif
 # ifdef CONFIG_FSYS_XFS
-	{"XFS filesystem", xfs_mount, xfs_read, xfs_dir, 0, 0},
+	{"XFS filesystem", xfs_mount, xfs_read, xfs_dir, 0, 0, 1},
 # endif
 # ifdef CONFIG_FSYS_ISO9660
-	{"ISO9660 filesystem", iso9660_mount, iso9660_read, iso9660_dir, 0, 0},
+	{"ISO9660 filesystem", iso9660_mount, iso9660_read, iso9660_dir, 0, 0, 1},
 # endif
 # ifdef CONFIG_FSYS_CRAMFS
-	{"CRAM filesystem", cramfs_mount, cramfs_read, cramfs_dir, 0, 0},
+	{"CRAM filesystem", cramfs_mount, cramfs_read, cramfs_dir, 0, 0, 0},
 # endif
 # ifdef CONFIG_FSYS_SQUASHFS
-	{"SQUASH filesystem", squashfs_mount, squashfs_read, squashfs_dir, 0, 0},
+	{"SQUASH filesystem", squashfs_mount, squashfs_read, squashfs_dir, 0, 0, 0},
 # endif
 # ifdef CONFIG_ARTEC_BOOT
-	{"Artecboot Virtual Filesystem", aboot_mount, aboot_read, aboot_dir, 0, 0},
+	{"Artecboot Virtual Filesystem", aboot_mount, aboot_read, aboot_dir, 0, 0, 0},
 # endif
 };
 
@@ -106,7 +112,13 @@ static int nullfs_dir(char *name)
 
 static int nullfs_read(char *buf, int len)
 {
-	if (devread(filepos >> 9, filepos & 0x1ff, len, buf)) {
+	int ret;
+
+	disk_read_func = disk_read_hook;
+	ret = devread(filepos >> 9, filepos & 0x1ff, len, buf);
+	disk_read_func = NULL;
+
+	if (ret) {
 		filepos += len;
 		return len;
 	} else {
@@ -114,7 +126,15 @@ static int nullfs_read(char *buf, int len)
 	}
 }
 
-static struct fsys_entry nullfs = { "nullfs", 0, nullfs_read, nullfs_dir, 0, 0 };
+static struct fsys_entry nullfs = { "nullfs", 0, nullfs_read, nullfs_dir, 0, 0, 1 };
+
+#if IS_ENABLED(CONFIG_FASTPATH)
+static struct fsys_entry fastpath_fs = { "fast path", 0, fastpath_read, fastpath_dir, 0, 0, 1 };
+#endif
+
+#if IS_ENABLED(CONFIG_PREFETCH)
+static struct fsys_entry prefetch_fs = { "prefetched", 0, prefetch_read, prefetch_dir, 0, 0, 0 };
+#endif
 
 static struct fsys_entry *fsys;
 
@@ -122,20 +142,47 @@ int mount_fs(void)
 {
 	int i;
 
+	boottime_start(STAGE_MOUNT);
 	for (i = 0; i < sizeof(fsys_table) / sizeof(fsys_table[0]); i++) {
-		if (!fsys_table[i].mount_func())
+		const u64 start = iotrace_start();
+		int ok;
+
+		iotrace_tag(fsys_table[i].name);
+		ok = fsys_table[i].mount_func();
+		iotrace_mount(start, ok);
+		if (!ok)
 			continue;
 
 		fsys = &fsys_table[i];
 		debug("Mounted %s\n", fsys->name);
+		boottime_end(STAGE_MOUNT);
 		return 1;
 	}
 	fsys = 0;
+	iotrace_tag(NULL);
+	boottime_end(STAGE_MOUNT);
 
 	printf("Unknown filesystem type.\n");
 	return 0;
 }
 
+/* Size of the file stream buffer, the most file_stream_peek() can see */
+#define FILE_STREAM_BUFLEN (32 << 10)
+
+static struct {
+	char *buf;
+	u64 start;		/* file offset of buf[0] */
+	unsigned long len;	/* valid bytes in buf */
+} fstream;
+
+static void file_stream_reset(void)
+{
+	fstream.len = 0;
+}
+
+/* Set by file_open_optional() */
+static int open_quiet;
+
 int file_open(const char *filename)
 {
 	char *dev = 0;
@@ -144,6 +191,17 @@ int file_open(const char *filename)
 	int retval = 0;
 	int reopen;
 
+	file_generation++;
+
+#if IS_ENABLED(CONFIG_PREFETCH)
+	/* Loaded to memory during the countdown already */
+	if (prefetch_open(filename)) {
+		fsys = &prefetch_fs;
+		path = filename;
+		goto lookup;
+	}
+#endif
+
 	path = strchr(filename, ':');
 	if (path) {
 		len = path - filename;
@@ -174,7 +232,14 @@ int file_open(const char *filename)
 	}
 
 	if (path) {
-		if (!fsys || fsys == &nullfs) {
+		/* Mount, unless the file is in the fast path record.
+		   nullfs and the fast path have nothing mounted. */
+#if IS_ENABLED(CONFIG_FASTPATH)
+		if (fastpath_open(path))
+			fsys = &fastpath_fs;
+		else
+#endif
+		if (!fsys || !fsys->mount_func) {
 			if (!mount_fs())
 				goto out;
 		}
@@ -187,13 +252,27 @@ int file_open(const char *filename)
 		fsys = &nullfs;
 	}
 
+#if IS_ENABLED(CONFIG_PREFETCH)
+lookup:
+#endif
+#if IS_ENABLED(CONFIG_DECOMPRESS_IMAGES)
+	if (compressed_file)
+		decompress_close();
+#endif
 	filepos = 0;
 	errnum = 0;
-	if (!fsys->dir_func((char *) path)) {
-		printf("File not found '%s'.\n", filename);
+	file_stream_reset();
+	boottime_start(STAGE_LOOKUP);
+	iotrace_tag(fsys->name);
+	fastpath_watch(1);
+	retval = fsys->dir_func((char *) path);
+	fastpath_watch(0);
+	boottime_end(STAGE_LOOKUP);
+	if (!retval) {
+		if (!open_quiet)
+			printf("File not found '%s'.\n", filename);
 		goto out;
 	}
-	retval = 1;
 
 out:
 	if (dev)
@@ -202,7 +281,203 @@ out:
 	return retval;
 }
 
-int file_read(void *buf, unsigned long len)
+int file_open_optional(const char *filename)
+{
+	int ret;
+
+	open_quiet = 1;
+	ret = file_open(filename);
+	open_quiet = 0;
+	if (!ret && errnum == ERR_FILE_NOT_FOUND)
+		errnum = 0;
+	return ret;
+}
+
+int file_list_split(char *list)
+{
+	int count = 1, at = 0;
+
+	for (; *list; list++) {
+		if (*list == '@') {
+			at = 1;
+		} else if (*list == ',') {
+			if (!at) {
+				*list = '\0';
+				count++;
+			}
+			at = 0;
+		}
+	}
+	return count;
+}
+
+#if IS_ENABLED(CONFIG_VERIFY_DIGESTS)
+/* Data is hashed in chunks of this size right after it was read,
+   while it's still in the cache. */
+#define DIGEST_CHUNK (64 << 10)
+
+static struct {
+	struct digest digest;
+	int active;
+	int failed;
+	u64 pos;			/* everything below is hashed */
+	u64 zero_start, zero_end;	/* hashed as zeroes */
+	/* While the file is hashed again, see file_digest_rewind() */
+	struct digest check;
+	u64 check_pos;			/* 0 if not */
+} fdigest;
+
+/* The file is hashed again up to check_pos, it must match */
+static void file_digest_check(void)
+{
+	struct digest a = fdigest.check, b = fdigest.digest;
+	uint8_t da[DIGEST_MAX_SIZE], db[DIGEST_MAX_SIZE];
+	const size_t size = digest_final(&a, da);
+
+	if (digest_final(&b, db) != size || memcmp(da, db, size)) {
+		printf("File changed while it was read\n");
+		fdigest.failed = 1;
+	}
+	fdigest.check_pos = 0;
+}
+
+static void file_digest_data(const char *buf, unsigned long len)
+{
+	static const char zeroes[64];
+	unsigned long n;
+
+	while (len) {
+		if (fdigest.pos >= fdigest.zero_start &&
+				fdigest.pos < fdigest.zero_end) {
+			n = MIN(len, MIN(fdigest.zero_end - fdigest.pos,
+						sizeof(zeroes)));
+		} else {
+			n = len;
+			if (fdigest.pos < fdigest.zero_start)
+				n = MIN(n, fdigest.zero_start - fdigest.pos);
+		}
+		if (fdigest.check_pos)
+			n = MIN(n, fdigest.check_pos - fdigest.pos);
+
+		if (fdigest.pos >= fdigest.zero_start &&
+				fdigest.pos < fdigest.zero_end)
+			digest_update(&fdigest.digest, zeroes, n);
+		else
+			digest_update(&fdigest.digest, buf, n);
+		fdigest.pos += n;
+		buf += n;
+		len -= n;
+
+		if (fdigest.check_pos && fdigest.pos == fdigest.check_pos)
+			file_digest_check();
+	}
+}
+
+/* Hash the parts of the file up to `pos` that nobody has read. */
+static int file_digest_catch_up(u64 pos)
+{
+	static char bounce[4096];
+	const u64 saved_pos = filepos;
+	int n;
+
+	while (fdigest.pos < pos) {
+		filepos = fdigest.pos;
+		n = fsys->read_func(bounce, MIN(pos - fdigest.pos, sizeof(bounce)));
+		if (n <= 0) {
+			fdigest.failed = 1;
+			break;
+		}
+		file_digest_data(bounce, n);
+	}
+	filepos = saved_pos;
+	return !fdigest.failed;
+}
+
+/*
+ * A read goes back to `pos`, below what is hashed. What it lands
+ * wasn't hashed, a copy that was read before was. So hash the file
+ * again from the start, with the data of this and later reads, and
+ * check that the digest comes out the same where it was before.
+ */
+static int file_digest_rewind(u64 pos)
+{
+	if (!fdigest.check_pos) {
+		fdigest.check = fdigest.digest;
+		fdigest.check_pos = fdigest.pos;
+	}
+	digest_init(&fdigest.digest, fdigest.digest.algo);
+	fdigest.pos = 0;
+	return file_digest_catch_up(pos);
+}
+
+void file_digest_start(enum digest_algo algo,
+		unsigned long zero_start, unsigned long zero_len)
+{
+	digest_init(&fdigest.digest, algo);
+	fdigest.active = 1;
+	fdigest.failed = 0;
+	fdigest.pos = 0;
+	fdigest.check_pos = 0;
+	fdigest.zero_start = zero_start;
+	fdigest.zero_end = zero_start + zero_len;
+#if IS_ENABLED(CONFIG_DECOMPRESS_IMAGES)
+	/* The header was read and parsed by decompress_open(), hash
+	   that copy */
+	if (compressed_file) {
+		unsigned long len;
+		const unsigned char *const head = decompress_head(&len);
+
+		file_digest_data((const char *)head, len);
+	}
+#endif
+}
+
+size_t file_digest_finish(uint8_t *out)
+{
+	size_t size = 0;
+
+#if IS_ENABLED(CONFIG_DECOMPRESS_IMAGES)
+	/* The digest covers the file as it is stored */
+	if (compressed_file)
+		decompress_swap();
+#endif
+	if (fdigest.active && file_digest_catch_up(filemax))
+		size = digest_final(&fdigest.digest, out);
+	fdigest.active = 0;
+#if IS_ENABLED(CONFIG_DECOMPRESS_IMAGES)
+	if (compressed_file)
+		decompress_swap();
+#endif
+	return size;
+}
+
+static int file_read_digest(char *buf, unsigned long len)
+{
+	unsigned long chunk;
+	int ret, total = 0;
+
+	if (filepos < fdigest.pos && !file_digest_rewind(filepos))
+		return 0;
+	if (filepos > fdigest.pos && !file_digest_catch_up(filepos))
+		return 0;
+
+	while (len) {
+		chunk = MIN(len, DIGEST_CHUNK);
+		ret = fsys->read_func(buf, chunk);
+		if (ret <= 0)
+			break;
+		file_digest_data(buf, ret);
+		buf += ret;
+		len -= ret;
+		total += ret;
+		if (ret < chunk)
+			break;
+	}
+	return total;
+}
+#endif
+
+static unsigned long file_read_clamp(unsigned long len)
 {
 	if (filepos < 0 || filepos > filemax)
 		filepos = filemax;
@@ -213,7 +488,199 @@ int file_read(void *buf, unsigned long len)
 	errnum = 0;
 
 	debug("reading %lu bytes, offset 0x%x\n", len, filepos);
-	return fsys->read_func(buf, len);
+	return len;
+}
+
+/* Read the file as it is stored, even if it's compressed */
+int file_read_raw(char *buf, unsigned long len)
+{
+	const u64 start = iotrace_start();
+	u64 pos;
+	int ret;
+
+	len = file_read_clamp(len);
+	pos = filepos;
+	iotrace_tag(fsys->name);
+#if IS_ENABLED(CONFIG_VERIFY_DIGESTS)
+	if (fdigest.active)
+		ret = file_read_digest(buf, len);
+	else
+#endif
+		ret = fsys->read_func(buf, len);
+	iotrace_read(start, pos, len, ret);
+	return ret;
+}
+
+int file_read(void *buf, unsigned long len)
+{
+#if IS_ENABLED(CONFIG_DECOMPRESS_IMAGES)
+	if (compressed_file)
+		return decompress_read(buf, file_read_clamp(len));
+#endif
+	return file_read_raw(buf, len);
+}
+
+int file_decompress(void)
+{
+#if IS_ENABLED(CONFIG_DECOMPRESS_IMAGES)
+	/* The size of a raw device says nothing about the data on it */
+	if (!fsys || using_devsize)
+		return 0;
+	if (decompress_open()) {
+		file_stream_reset();
+		return 1;
+	}
+#endif
+	return 0;
+}
+
+/* Return the number of buffered bytes at the file position */
+static unsigned long file_stream_avail(void)
+{
+	const u64 end = MIN(fstream.start + fstream.len, filemax);
+
+	if (filepos < fstream.start || filepos >= end)
+		return 0;
+	return end - filepos;
+}
+
+/*
+ * Make sure that at least `want` bytes (up to FILE_STREAM_BUFLEN) are
+ * buffered at the file position, unless the file ends earlier. Returns
+ * the number of buffered bytes.
+ */
+static unsigned long file_stream_fill(unsigned long want)
+{
+	const u64 pos = filepos;
+	unsigned long avail = file_stream_avail();
+	int ret;
+
+	if (avail >= MIN(want, FILE_STREAM_BUFLEN))
+		return avail;
+
+	if (!fstream.buf) {
+		fstream.buf = malloc(FILE_STREAM_BUFLEN);
+		if (!fstream.buf)
+			return 0;
+	}
+
+	/* Move what's left to the front and top up the rest */
+	if (avail)
+		memmove(fstream.buf, fstream.buf + (pos - fstream.start), avail);
+	fstream.start = pos;
+	fstream.len = avail;
+
+	filepos = pos + avail;
+	ret = file_read(fstream.buf + avail, FILE_STREAM_BUFLEN - avail);
+	if (ret > 0)
+		fstream.len += ret;
+	filepos = pos;
+
+	return file_stream_avail();
+}
+
+int file_stream_peek(void *buf, unsigned long len)
+{
+	len = MIN(len, file_stream_fill(len));
+	if (len)
+		memcpy(buf, fstream.buf + (filepos - fstream.start), len);
+	return len;
+}
+
+int file_stream_read(void *buf, unsigned long len)
+{
+	char *dest = buf;
+	unsigned long n;
+	int ret, total = 0;
+
+	while (len) {
+		n = file_stream_avail();
+		if (!n && len >= FILE_STREAM_BUFLEN) {
+			ret = file_read(dest, len);
+			if (ret > 0)
+				total += ret;
+			break;
+		}
+		if (!n)
+			n = file_stream_fill(len);
+		if (!n)
+			break;
+
+		n = MIN(n, len);
+		memcpy(dest, fstream.buf + (filepos - fstream.start), n);
+		filepos += n;
+		dest += n;
+		len -= n;
+		total += n;
+	}
+	return total;
+}
+
+unsigned long file_stream_skip(unsigned long len)
+{
+	if (filepos > filemax)
+		filepos = filemax;
+	if (len > filemax - filepos)
+		len = filemax - filepos;
+	filepos += len;
+	return len;
+}
+
+static struct {
+	char *buf;
+	unsigned long size;
+	void (*fn)(unsigned long file_offset, unsigned long sector,
+			unsigned long byte_offset, unsigned long byte_len);
+	int failed;
+} fmap;
+
+static void file_map_extent(unsigned long sector, unsigned long byte_offset,
+		unsigned long byte_len, void *buf)
+{
+	const char *const dest = buf;
+
+	/* Data that goes through a driver's own buffer can't be mapped */
+	if (dest < fmap.buf || dest + byte_len > fmap.buf + fmap.size) {
+		fmap.failed = 1;
+		return;
+	}
+	fmap.fn(dest - fmap.buf, sector, byte_offset, byte_len);
+}
+
+/* Only there for the drivers to flag their data reads */
+static void file_map_hook(int sector, int byte_offset, int byte_len)
+{
+}
+
+int file_map(void *buf, void (*fn)(unsigned long file_offset,
+		unsigned long sector, unsigned long byte_offset,
+		unsigned long byte_len))
+{
+	int ret;
+
+	if (!fsys || !fsys->map_data || filemax > 0x7fffffff)
+		return 0;
+#if IS_ENABLED(CONFIG_DECOMPRESS_IMAGES)
+	if (compressed_file)
+		return 0;
+#endif
+
+	fmap.buf = buf;
+	fmap.size = filemax;
+	fmap.fn = fn;
+	fmap.failed = 0;
+
+	devread_map_func = file_map_extent;
+	disk_read_hook = file_map_hook;
+	filepos = 0;
+	errnum = 0;
+	ret = fsys->read_func(buf, filemax);
+	devread_map_func = NULL;
+	disk_read_hook = NULL;
+	filepos = 0;
+
+	debug("mapped %d bytes, failed=%d\n", ret, fmap.failed);
+	return ret == (int)filemax && !fmap.failed && !errnum;
 }
 
 unsigned long file_seek(unsigned long offset)
@@ -238,6 +705,14 @@ void file_set_size(unsigned long size)
 
 void file_close(void)
 {
+#if IS_ENABLED(CONFIG_VERIFY_DIGESTS)
+	fdigest.active = 0;
+#endif
+#if IS_ENABLED(CONFIG_DECOMPRESS_IMAGES)
+	if (compressed_file)
+		decompress_close();
+#endif
+	file_stream_reset();
 	devclose();
 }
 
@@ -249,6 +724,8 @@ int dir(const char *dirname)
 	int retval = 0;
 	int reopen;
 
+	file_generation++;
+
 	path = strchr(dirname, ':');
 	if (path) {
 		len = path - dirname;
@@ -279,7 +756,8 @@ int dir(const char *dirname)
 	}
 
 	if (path) {
-		if (!fsys || fsys == &nullfs) {
+		/* nullfs and the fast path have nothing mounted */
+		if (!fsys || !fsys->mount_func) {
 			if (!mount_fs())
 				goto out;
 		}
@@ -77,7 +77,26 @@ typedef	__uint64_t	xfs_filblks_t;	/* number of blocks in a file */
 
 #define	XFS_SB_MAGIC		0x58465342	/* 'XFSB'*/
 #define	XFS_SB_VERSION_4	4		/* 6.2+ - bitmask version */
+#define	XFS_SB_VERSION_5	5		/* CRC enabled filesystem */
 #define	XFS_SB_VERSION_NUMBITS	0x000f
+#define	XFS_SB_VERSION_MOREBITSBIT	0x8000
+#define	XFS_SB_VERSION2_FTYPE	0x00000200	/* inode type in dir */
+
+/* Incompatible features of version 5 superblocks */
+#define	XFS_SB_FEAT_INCOMPAT_FTYPE	(1 << 0)	/* filetype in dirent */
+#define	XFS_SB_FEAT_INCOMPAT_SPINODES	(1 << 1)	/* sparse inode chunks */
+#define	XFS_SB_FEAT_INCOMPAT_META_UUID	(1 << 2)	/* metadata UUID */
+#define	XFS_SB_FEAT_INCOMPAT_BIGTIME	(1 << 3)	/* large timestamps */
+#define	XFS_SB_FEAT_INCOMPAT_NEEDSREPAIR (1 << 4)	/* needs xfs_repair */
+#define	XFS_SB_FEAT_INCOMPAT_NREXT64	(1 << 5)	/* 64-bit extent counts */
+#define	XFS_SB_FEAT_INCOMPAT_EXCHRANGE	(1 << 6)	/* exchangerange */
+#define	XFS_SB_FEAT_INCOMPAT_PARENT	(1 << 7)	/* parent pointers */
+/* Everything we can read. NEEDSREPAIR is deliberately left out. */
+#define	XFS_SB_FEAT_INCOMPAT_SUPPORTED	\
+	(XFS_SB_FEAT_INCOMPAT_FTYPE | XFS_SB_FEAT_INCOMPAT_SPINODES | \
+	 XFS_SB_FEAT_INCOMPAT_META_UUID | XFS_SB_FEAT_INCOMPAT_BIGTIME | \
+	 XFS_SB_FEAT_INCOMPAT_NREXT64 | XFS_SB_FEAT_INCOMPAT_EXCHRANGE | \
+	 XFS_SB_FEAT_INCOMPAT_PARENT)
 
 typedef struct xfs_sb
 {
@@ -131,8 +150,22 @@ typedef struct xfs_sb
 	__uint32_t	sb_unit;	/* stripe or raid unit */
 	__uint32_t	sb_width;	/* stripe or raid width */
 	__uint8_t	sb_dirblklog;	/* log2 of dir block size (fsbs) */
-	__uint8_t       sb_dummy[7];    /* padding */
-} xfs_sb_t;
+	__uint8_t	sb_logsectlog;	/* log2 of the log sector size */
+	__uint16_t	sb_logsectsize;	/* sector size for the log, bytes */
+	__uint32_t	sb_logsunit;	/* stripe unit size for the log */
+	__uint32_t	sb_features2;	/* additional feature bits */
+	__uint32_t	sb_bad_features2; /* copy of sb_features2 */
+	/* version 5 superblock fields start here */
+	__uint32_t	sb_features_compat;
+	__uint32_t	sb_features_ro_compat;
+	__uint32_t	sb_features_incompat;
+	__uint32_t	sb_features_log_incompat;
+	__uint32_t	sb_crc;		/* superblock crc */
+	xfs_extlen_t	sb_spino_align;	/* sparse inode chunk alignment */
+	xfs_ino_t	sb_pquotino;	/* project quota inode */
+	__uint64_t	sb_lsn;		/* last write sequence */
+	uuid_t		sb_meta_uuid;	/* metadata file system unique id */
+} __attribute__ ((packed)) xfs_sb_t;
 
 /* Bound taken from xfs.c in GRUB2. It doesn't exist in the spec */
 #define	XFS_SB_DIRBLK_NUMBITS	27
@@ -161,6 +194,28 @@ typedef struct xfs_btree_lblock
 	xfs_dfsbno_t	bb_rightsib;	/* right sibling block or NULLDFSBNO */
 } xfs_btree_lblock_t;
 
+/*
+ * Long form header of CRC enabled (version 5) filesystems.
+ */
+typedef struct xfs_btree_lblock_crc
+{
+	__uint32_t	bb_magic;	/* magic number for block type */
+	__uint16_t	bb_level;	/* 0 is a leaf */
+	__uint16_t	bb_numrecs;	/* current # of data records */
+	xfs_dfsbno_t	bb_leftsib;	/* left sibling block or NULLDFSBNO */
+	xfs_dfsbno_t	bb_rightsib;	/* right sibling block or NULLDFSBNO */
+	xfs_dfsbno_t	bb_blkno;	/* this block */
+	__uint64_t	bb_lsn;		/* last write sequence */
+	uuid_t		bb_uuid;	/* file system unique id */
+	__uint64_t	bb_owner;	/* owning inode */
+	__uint32_t	bb_crc;		/* block crc */
+	__uint32_t	bb_pad;		/* padding for alignment */
+} __attribute__ ((packed)) xfs_btree_lblock_crc_t;
+
+#define	XFS_BMAP_MAGIC		0x424d4150	/* 'BMAP' */
+#define	XFS_BMAP_CRC_MAGIC	0x424d4133	/* 'BMA3' */
+#define	NULLDFSBNO		((xfs_dfsbno_t)-1)
+
 /*
  * Combined header and structure, used by common code.
  */
@@ -374,6 +429,59 @@ typedef union {
 	xfs_dir2_data_unused_t	unused;
 } xfs_dir2_data_union_t;
 
+/*
+ * Version 3 (CRC enabled) directory blocks share a common header.
+ */
+#define	XFS_DIR2_DATA_MAGIC	0x58443244	/* XD2D: multiblock dirs */
+#define	XFS_DIR3_BLOCK_MAGIC	0x58444233	/* XDB3: single block dirs */
+#define	XFS_DIR3_DATA_MAGIC	0x58444433	/* XDD3: multiblock dirs */
+#define	XFS_DIR3_FREE_MAGIC	0x58444633	/* XDF3: free index blocks */
+
+typedef struct xfs_dir3_blk_hdr {
+	__uint32_t		magic;		/* magic number */
+	__uint32_t		crc;		/* CRC of block */
+	__uint64_t		blkno;		/* first block of the buffer */
+	__uint64_t		lsn;		/* sequence number of last write */
+	uuid_t			uuid;		/* filesystem we belong to */
+	__uint64_t		owner;		/* inode that owns the block */
+} __attribute__ ((packed)) xfs_dir3_blk_hdr_t;
+
+typedef struct xfs_dir3_data_hdr {
+	xfs_dir3_blk_hdr_t	hdr;
+	xfs_dir2_data_free_t	best_free[XFS_DIR2_DATA_FD_COUNT];
+	__uint32_t		pad;		/* 64 bit alignment */
+} __attribute__ ((packed)) xfs_dir3_data_hdr_t;
+
+/*
+ * Symlink blocks of version 5 filesystems start with a header
+ */
+#define	XFS_SYMLINK_MAGIC	0x58534c4d	/* XSLM */
+
+typedef struct xfs_dsymlink_hdr {
+	__uint32_t		sl_magic;	/* magic number */
+	__uint32_t		sl_offset;	/* offset of the data in the target */
+	__uint32_t		sl_bytes;	/* bytes of data in this block */
+	__uint32_t		sl_crc;		/* CRC of block */
+	uuid_t			sl_uuid;	/* filesystem we belong to */
+	__uint64_t		sl_owner;	/* inode that owns the block */
+	__uint64_t		sl_blkno;	/* first block of the buffer */
+	__uint64_t		sl_lsn;		/* sequence number of last write */
+} __attribute__ ((packed)) xfs_dsymlink_hdr_t;
+
+typedef struct xfs_dir3_free_hdr {
+	xfs_dir3_blk_hdr_t	hdr;
+	__uint32_t		firstdb;	/* db of first entry */
+	__uint32_t		nvalid;		/* count of valid entries */
+	__uint32_t		nused;		/* count of used entries */
+	__uint32_t		pad;		/* 64 bit alignment */
+} __attribute__ ((packed)) xfs_dir3_free_hdr_t;
+
+/*
+ * Data blocks live below this byte offset of the directory, leaf and
+ * free index blocks above it.
+ */
+#define	XFS_DIR2_LEAF_OFFSET	(1ULL << 35)
+
 /* those are from xfs_dir2_leaf.h */
 /*
  * Directory version 2, leaf block structures.
@@ -388,6 +496,36 @@ typedef struct xfs_dir2_leaf_hdr {
 	__uint16_t		stale;		/* count of stale entries */
 } xfs_dir2_leaf_hdr_t;
 
+/*
+ * Leaf block entry.
+ */
+typedef struct xfs_dir2_leaf_entry {
+	xfs_dahash_t		hashval;	/* hash value of name */
+	__uint32_t		address;	/* address of data entry */
+} xfs_dir2_leaf_entry_t;
+
+/*
+ * Version 3 (CRC enabled) leaf block header.
+ */
+#define	XFS_DIR3_LEAF1_MAGIC	0x3df1	/* magic number: v3 dirlf single blks */
+#define	XFS_DIR3_LEAFN_MAGIC	0x3dff	/* magic number: v3 dirlf multi blks */
+
+typedef struct xfs_da3_blkinfo {
+	xfs_da_blkinfo_t	hdr;		/* forw, back, magic, pad */
+	__uint32_t		crc;		/* CRC of block */
+	__uint64_t		blkno;		/* first block of the buffer */
+	__uint64_t		lsn;		/* sequence number of last write */
+	uuid_t			uuid;		/* filesystem we belong to */
+	__uint64_t		owner;		/* inode that owns the block */
+} __attribute__ ((packed)) xfs_da3_blkinfo_t;
+
+typedef struct xfs_dir3_leaf_hdr {
+	xfs_da3_blkinfo_t	info;		/* header for da routines */
+	__uint16_t		count;		/* count of entries */
+	__uint16_t		stale;		/* count of stale entries */
+	__uint32_t		pad;		/* 64 bit alignment */
+} __attribute__ ((packed)) xfs_dir3_leaf_hdr_t;
+
 /* those are from xfs_dir2_block.h */
 /*
  * xfs_dir2_block.h
@@ -471,6 +609,7 @@ typedef struct xfs_dir2_sf {
 
 #define	XFS_DINODE_VERSION_1	1
 #define	XFS_DINODE_VERSION_2	2
+#define	XFS_DINODE_VERSION_3	3
 #define	XFS_DINODE_MAGIC	0x494e	/* 'IN' */
 
 /*
@@ -499,7 +638,11 @@ typedef struct xfs_dinode_core
 	__uint32_t	di_gid;		/* owner's group id */
 	__uint32_t	di_nlink;	/* number of links to file */
 	__uint16_t	di_projid;	/* owner's project id */
-	__uint8_t	di_pad[10];	/* unused, zeroed space */
+	__uint16_t	di_projid_hi;	/* higher part of project id */
+	union {
+		__uint64_t	di_big_nextents; /* NREXT64 data extents */
+		__uint8_t	di_pad[8];	/* unused, zeroed space */
+	};
 	xfs_timestamp_t	di_atime;	/* time last accessed */
 	xfs_timestamp_t	di_mtime;	/* time last modified */
 	xfs_timestamp_t	di_ctime;	/* time created/inode modified */
@@ -528,6 +671,25 @@ typedef struct xfs_dinode
 	} di_u;
 } xfs_dinode_t;
 
+/*
+ * Version 3 inodes continue after di_next_unlinked, the literal
+ * area (di_u above) follows these fields.
+ */
+typedef struct xfs_dinode_v3
+{
+	__uint32_t	di_crc;		/* CRC of the inode */
+	__uint64_t	di_changecount;	/* number of attribute changes */
+	__uint64_t	di_lsn;		/* flush sequence */
+	__uint64_t	di_flags2;	/* more random flags */
+	__uint32_t	di_cowextsize;	/* basic cow extent size for file */
+	__uint8_t	di_pad2[12];	/* more padding for future expansion */
+	xfs_timestamp_t	di_crtime;	/* time created */
+	xfs_ino_t	di_ino;		/* inode number */
+	uuid_t		di_uuid;	/* UUID of the filesystem */
+} __attribute__ ((packed)) xfs_dinode_v3_t;
+
+#define	XFS_DIFLAG2_NREXT64	(1 << 4)	/* 64-bit extent counts */
+
 /*
  * Values for di_format
  */
@@ -0,0 +1,68 @@
+/*
+ * This file is part of FILO.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef BOOTTIME_H
+#define BOOTTIME_H
+
+#include <config.h>
+
+enum boot_stage {
+	STAGE_INIT,
+	STAGE_DRIVE_PROBE,
+	STAGE_USB,
+	STAGE_MENU_SEARCH,
+	STAGE_MOUNT,
+	STAGE_LOOKUP,
+	STAGE_KERNEL_READ,
+	STAGE_INITRD_READ,
+	STAGE_MODULES,
+	STAGE_JUMP,
+	STAGE_COUNT
+};
+
+/*
+ * IDs of FILO's entries in the coreboot timestamp table. Each stage
+ * gets two, BOOTTIME_TS_BASE + 2 * stage when it starts and the next
+ * one when it ends.
+ */
+#define BOOTTIME_TS_BASE	1500
+
+#if IS_ENABLED(CONFIG_BOOT_TIMESTAMPS)
+/*
+ * Mark the start and the end of a stage. Stages can be entered any
+ * number of times, each time is recorded.
+ */
+void boottime_start(enum boot_stage stage);
+void boottime_end(enum boot_stage stage);
+
+/* While held, no stages are recorded, e.g. for background work */
+void boottime_hold(int hold);
+
+/*
+ * Record the jump to the OS. On x86 the timeline is also added to the
+ * coreboot timestamp table, where the OS can pick it up.
+ */
+void boottime_jump(void);
+
+/* Print the timeline and the time spent per stage */
+void boottime_show(void);
+
+const char *boottime_stage_name(enum boot_stage stage);
+#else
+#define boottime_start(x) do {} while (0) /* nop */
+#define boottime_end(x) do {} while (0) /* nop */
+#define boottime_hold(x) do {} while (0) /* nop */
+#define boottime_jump() do {} while (0) /* nop */
+#endif
+
+#endif /* BOOTTIME_H */
@@ -18,6 +18,7 @@
 struct csl_file_operations {
 	int (*open)(const char *filename);
 	int (*read)(void *buf, unsigned long len);
+	unsigned long (*skip)(unsigned long len);
 	unsigned long (*size)(void);
 	void (*close)(void);
 };
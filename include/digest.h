@@ -0,0 +1,125 @@
+/*
+ * This file is part of FILO.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <config.h>
+
+enum digest_algo {
+	DIGEST_NONE = 0,
+	DIGEST_CRC32C,
+	DIGEST_SHA256,
+};
+
+#define DIGEST_MAX_SIZE 32
+
+struct digest {
+	enum digest_algo algo;
+	union {
+		uint32_t crc;
+		struct {
+			uint32_t h[8];
+			uint64_t len;
+			uint8_t buf[64];
+		} sha256;
+	} u;
+};
+
+size_t digest_size(enum digest_algo algo);
+void digest_init(struct digest *d, enum digest_algo algo);
+void digest_update(struct digest *d, const void *data, size_t len);
+
+/*
+ * Write the digest to `out` (DIGEST_MAX_SIZE bytes are enough) and
+ * return its size. CRC32C is stored big-endian, so the bytes read
+ * like the usual hex notation of the CRC value.
+ */
+size_t digest_final(struct digest *d, uint8_t *out);
+
+#if IS_ENABLED(CONFIG_VERIFY_DIGESTS)
+/*
+ * Hash the open file while file_read() lands its data. Everything
+ * from offset 0 up to the end of the file is hashed, with the
+ * `zero_len` bytes at `zero_start` counted as zeroes. Parts of the
+ * file that were skipped over are read on the fly. When a read goes
+ * back, the file is hashed again from the start and has to give the
+ * same digest up to where it was, so everything that is loaded is
+ * hashed as it lands. Implemented in fs/vfs.c.
+ */
+void file_digest_start(enum digest_algo algo,
+		unsigned long zero_start, unsigned long zero_len);
+
+/*
+ * Hash the rest of the open file and write the digest to `out`.
+ * Returns the digest size, 0 if the file could not be read.
+ */
+size_t file_digest_finish(uint8_t *out);
+
+/*
+ * Read the manifest of expected digests (CONFIG_DIGEST_MANIFEST).
+ * Must be called while no file is open, boot() does it before it
+ * opens the image.
+ */
+void verify_load_manifest(void);
+
+/*
+ * Start verifying the file `filename`, which has just been opened.
+ * If the manifest lists it, the file is hashed while it is read.
+ */
+void verify_begin(const char *filename);
+
+/*
+ * Expect `digest` for the open file, unless the manifest already
+ * provides one. Used for digests embedded in the image itself, the
+ * digest bytes at file offset `offset` are hashed as zeroes. These
+ * give integrity only, with CONFIG_DIGEST_REQUIRED they are ignored.
+ */
+void verify_expect(enum digest_algo algo, const uint8_t *digest,
+		unsigned long offset);
+
+/*
+ * Finish hashing the open file and compare the result. Returns 0
+ * if the digest matches or none was expected (and none is required),
+ * -1 otherwise.
+ */
+int verify_end(void);
+
+/*
+ * Verify the file `filename` that was loaded to `buf` without going
+ * through file_read(). Returns like verify_end().
+ */
+int verify_buffer(const char *filename, const void *buf, size_t len);
+
+/*
+ * Queue `buf` for verify_hash_queued(), if the manifest lists the file
+ * `filename`. verify_hash_queued() hashes all queued buffers at once,
+ * each on its own CPU. verify_buffer() then only compares the digests.
+ * The queue is emptied when the manifest is read again.
+ */
+void verify_queue(const char *filename, const void *buf, size_t len);
+void verify_hash_queued(void);
+#else
+#define verify_load_manifest() do {} while (0) /* nop */
+#define verify_begin(x) do {} while (0) /* nop */
+#define verify_expect(x,y,z) do {} while (0) /* nop */
+#define verify_end() 0 /* nop */
+#define verify_buffer(x,y,z) 0 /* nop */
+#define verify_queue(x,y,z) do {} while (0) /* nop */
+#define verify_hash_queued() do {} while (0) /* nop */
+#endif
+
+#endif /* DIGEST_H */
@@ -73,6 +73,14 @@ typedef struct Elf_Nhdr
 #define EIN_PROGRAM_CHECKSUM	0x00000003
 /* ip style checksum of the memory image. */
 
+/* FILO image notes. The name for all of these is FILO */
+#define ELF_NOTE_FILO		"FILO"
+
+#define FIN_IMAGE_SHA256	0x00000001
+/* SHA-256 of the whole file, with the digest itself counted as zeroes. */
+#define FIN_IMAGE_CRC32C	0x00000002
+/* CRC32C of the whole file, with the digest itself counted as zeroes. */
+
 /* Linux image notes for booting... The name for all of these is Linux */
 
 #define LIN_COMMAND_LINE	0x00000001
@@ -0,0 +1,38 @@
+/*
+ * This file is part of FILO.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef FASTPATH_H
+#define FASTPATH_H
+
+#include <config.h>
+
+#if IS_ENABLED(CONFIG_FASTPATH)
+/*
+ * Read the fast path record (CONFIG_FASTPATH_RECORD). Must be called
+ * while no file is open, init() does it once.
+ */
+void fastpath_load(void);
+
+/*
+ * Look up `filename` (with its device) the normal way and print its
+ * fast path record on the console. Returns 1 on success.
+ */
+int fastpath_record(const char *filename);
+
+/* List the files of the loaded record and whether they are valid */
+void fastpath_show(void);
+#else
+#define fastpath_load() do {} while (0) /* nop */
+#endif
+
+#endif /* FASTPATH_H */
@@ -39,6 +39,8 @@ int ide_read_blocks(const int drive, const sector_t sector, const int size, void
 #ifdef CONFIG_USB_DISK
 int usb_probe(int drive);
 int usb_read(const int drive, const sector_t sector, const int size, void *buffer);
+/* Poll the USB stack from a task, so devices show up while FILO waits */
+void usb_start_polling(void);
 #endif
 
 #ifdef CONFIG_FLASH_DISK
@@ -52,20 +54,82 @@ void NAND_close(void);
 #define DISK_USB 3
 #define DISK_FLASH 4
 
+/* Start the CONFIG_SATA_SPINUP_DELAY, the first probe of a drive waits for it */
+void devspinup(void);
 int devopen(const char *name, int *reopen);
 void devclose(void);
 int devread(unsigned long sector, unsigned long byte_offset,
 	unsigned long byte_len, void *buf);
+void *devmap(unsigned long sector, unsigned long byte_offset,
+	unsigned long byte_len);
+/* Read from the open drive at an absolute sector, ignoring the partition */
+int devread_raw(unsigned long sector, unsigned long byte_offset,
+	unsigned long byte_len, void *buf);
+/* Read whole sectors from the open drive, bypassing the sector cache */
+int devread_blocks(unsigned long sector, unsigned long count, void *buf);
+/* Return the name of the open device, and its type and drive number */
+const char *dev_get_name(int *type, int *drive);
 void dev_set_partition(unsigned long start, unsigned long size);
 void dev_get_partition(unsigned long *start, unsigned long *size);
 
 int file_open(const char *filename);
+/* Like file_open(), but a missing file is no error: nothing is printed
+ * and errnum is cleared */
+int file_open_optional(const char *filename);
+/*
+ * Split a comma separated list of files in place and return the number
+ * of files. A comma after "@offset" belongs to the name, as in
+ * "hda1@0x1000,0x2000".
+ */
+int file_list_split(char *list);
 int file_read(void *buf, unsigned long len);
 unsigned long file_seek(unsigned long offset);
 unsigned long file_size(void);
 void file_set_size(unsigned long size);
 void file_close(void);
 
+/* Changes whenever a file or a device is opened or closed. Code that
+ * keeps a file open across calls can tell from it if it still is. */
+extern unsigned int file_generation;
+
+/*
+ * If the open file is gzip or LZ4 compressed, make file_read() and
+ * friends return its decompressed contents from now on. The data is
+ * decompressed on the fly, straight into the caller's buffer. Returns
+ * 1 if the file is compressed.
+ */
+int file_decompress(void);
+
+/*
+ * Buffered reading of the open file, for consumers of small records.
+ * The stream position is the file position, so these can be mixed with
+ * file_read() and file_seek(). Large reads bypass the buffer.
+ */
+int file_stream_peek(void *buf, unsigned long len);
+int file_stream_read(void *buf, unsigned long len);
+unsigned long file_stream_skip(unsigned long len);
+
+/*
+ * Find out where the data of the open file lies on the drive, instead
+ * of reading it. `fn` is called for each extent with its offset in the
+ * file and its absolute position on the drive. Holes and data that
+ * the filesystem keeps in its metadata are written to `buf` right
+ * away, so `buf` must have room for the whole file. Returns 1 if the
+ * whole file could be mapped, 0 otherwise.
+ */
+int file_map(void *buf, void (*fn)(unsigned long file_offset,
+		unsigned long sector, unsigned long byte_offset,
+		unsigned long byte_len));
+
+/* While set, devread() passes file data reads to this function */
+extern void (*devread_map_func)(unsigned long sector,
+		unsigned long byte_offset, unsigned long byte_len, void *buf);
+
+/* While set, devread() shows everything it read to this function */
+extern void (*devread_watch_func)(unsigned long sector,
+		unsigned long byte_offset, unsigned long byte_len,
+		const void *buf);
+
 #define PARTITION_UNKNOWN	0xbad6a7
 
 #ifdef CONFIG_ELTORITO
@@ -293,6 +293,7 @@ int substring (const char *s1, const char *s2);
 int nul_terminate (char *str);
 int safe_parse_maxint (char **str_ptr, int *myint_ptr);
 void grub_putstr (const char *str);
+void grub_putnstr (const char *buf, int len);
 
 /* List the contents of the directory that was opened with GRUB_OPEN,
    printing all completions. */
@@ -307,5 +308,7 @@ int to_argc_argv(char *args, char ***argvp);
 
 /* FILO specific stuff */
 void copy_path_to_filo_bootline(char *arg, char *path, int use_rootdev, int append);
+/* Queue the kernel and initrd of a menu entry, see prefetch.h */
+void prefetch_menu_entry(char *entry);
 
 #endif /* ! GRUB_SHARED_HEADER */
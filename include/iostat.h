@@ -0,0 +1,43 @@
+/*
+ * This file is part of FILO.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef IOSTAT_H
+#define IOSTAT_H
+
+#include <config.h>
+#include <timer.h>
+
+#if IS_ENABLED(CONFIG_IO_STATS)
+/* A devread() of `bytes` from drive `drive` of type `type` (DISK_*) */
+void iostat_read(int type, int drive, unsigned long bytes);
+
+/* A sector was looked up in the sector cache */
+void iostat_cache(int type, int drive, int hit);
+
+/*
+ * A request of `sectors` to the driver, which started at currticks()
+ * value `start` and just returned. `ok` is 0 if it failed.
+ */
+void iostat_request(int type, int drive, u64 start, unsigned long sectors,
+		int ok);
+
+void iostat_show(void);
+void iostat_reset(void);
+#else
+#define iostat_read(x,y,z) do {} while (0) /* nop */
+#define iostat_cache(x,y,z) do {} while (0) /* nop */
+static inline void iostat_request(int type, int drive, u64 start,
+		unsigned long sectors, int ok) { }
+#endif
+
+#endif /* IOSTAT_H */
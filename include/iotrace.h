@@ -0,0 +1,66 @@
+/*
+ * This file is part of FILO.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef IOTRACE_H
+#define IOTRACE_H
+
+#include <config.h>
+#include <timer.h>
+
+#if IS_ENABLED(CONFIG_IO_TRACE)
+/*
+ * Name the filesystem (or anything else) that issues the following
+ * reads. `tag` must be a static string, NULL clears it.
+ */
+void iotrace_tag(const char *tag);
+
+/* A boot stage (enum boot_stage) was entered or left */
+void iotrace_stage(int stage, int begin);
+
+/* The absolute `sector` was looked up in the sector cache */
+void iotrace_cache(int type, int drive, unsigned long sector, int hit);
+
+/*
+ * A driver request of `count` sectors at the absolute `sector`, which
+ * started at currticks() value `start` and just returned.
+ */
+void iotrace_request(int type, int drive, u64 start, unsigned long sector,
+		unsigned long count, int ok);
+
+/*
+ * A filesystem read of `len` bytes at file position `pos`, started
+ * at `start`. `ret` is what the filesystem returned.
+ */
+void iotrace_read(u64 start, u64 pos, unsigned long len, int ret);
+
+/* A mount attempt of the tagged filesystem, started at `start` */
+void iotrace_mount(u64 start, int ok);
+
+#define iotrace_start() currticks()
+
+/* Print the ring on the console, for util/iotrace2json */
+void iotrace_dump(void);
+void iotrace_reset(void);
+#else
+#define iotrace_tag(x) do {} while (0) /* nop */
+#define iotrace_stage(x,y) do {} while (0) /* nop */
+#define iotrace_cache(w,x,y,z) do {} while (0) /* nop */
+static inline u64 iotrace_start(void) { return 0; }
+static inline void iotrace_request(int type, int drive, u64 start,
+		unsigned long sector, unsigned long count, int ok) { }
+static inline void iotrace_read(u64 start, u64 pos, unsigned long len,
+		int ret) { }
+static inline void iotrace_mount(u64 start, int ok) { }
+#endif
+
+#endif /* IOTRACE_H */
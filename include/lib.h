@@ -32,8 +32,12 @@ struct sys_info;
 
 #if IS_ENABLED(CONFIG_CSL_BOOT)
 int csl_load(const char *filename, const char *cmdline);
+int csl_probe(const void *buf, size_t len);
+int csl_load_opened(const char *filename, const char *cmdline);
 #else
 #define csl_load(x,y) LOADER_NOT_SUPPORT /* nop */
+#define csl_probe(x,y) 0 /* nop */
+#define csl_load_opened(x,y) LOADER_NOT_SUPPORT /* nop */
 #endif
 
 #endif /* LIB_H */
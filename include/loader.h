@@ -29,29 +29,54 @@ struct boot_module {
 	size_t size;
 };
 
+/*
+ * boot() opens an image once and reads up to this many bytes from its
+ * start into a probe buffer. Each loader's *_probe() function checks
+ * the buffer for its magic, and the matching *_load_opened() function
+ * continues from the already open file, rewound to its start. It
+ * closes the file in any case. The *_load() functions open the file themselves.
+ */
+#define LOADER_PROBE_SIZE 4096
+
 #ifdef CONFIG_ELF_BOOT
 int elf_boot(const char *filename, const char *cmdline);
+int elf_probe(const void *buf, size_t len);
+int elf_boot_opened(const char *filename, const char *cmdline);
 #else
 #define elf_boot(x,y) LOADER_NOT_SUPPORT /* nop */
+#define elf_probe(x,y) 0 /* nop */
+#define elf_boot_opened(x,y) LOADER_NOT_SUPPORT /* nop */
 #endif
 int elf_load(uintptr_t *entry, bool elfboot);
 
 #ifdef CONFIG_LINUX_LOADER
 int linux_load(const char *filename, const char *cmdline);
+int linux_probe(const void *buf, size_t len);
+int linux_load_opened(const char *filename, const char *cmdline);
 #else
 #define linux_load(x,y) LOADER_NOT_SUPPORT /* nop */
+#define linux_probe(x,y) 0 /* nop */
+#define linux_load_opened(x,y) LOADER_NOT_SUPPORT /* nop */
 #endif
 
 #ifdef CONFIG_WINCE_LOADER
 int wince_load(const char *filename, const char *cmdline);
+int wince_probe(const void *buf, size_t len);
+int wince_load_opened(const char *filename, const char *cmdline);
 #else
 #define wince_load(x,y) LOADER_NOT_SUPPORT /* nop */
+#define wince_probe(x,y) 0 /* nop */
+#define wince_load_opened(x,y) LOADER_NOT_SUPPORT /* nop */
 #endif
 
 #ifdef CONFIG_ARTEC_BOOT
 int artecboot_load(const char *filename, const char *cmdline);
+int artecboot_probe(const void *buf, size_t len);
+int artecboot_load_opened(const char *filename, const char *cmdline);
 #else
 #define artecboot_load(x,y) LOADER_NOT_SUPPORT /* nop */
+#define artecboot_probe(x,y) 0 /* nop */
+#define artecboot_load_opened(x,y) LOADER_NOT_SUPPORT /* nop */
 #endif
 
 /*
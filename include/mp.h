@@ -0,0 +1,57 @@
+/*
+ * This file is part of FILO.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef MP_H
+#define MP_H
+
+#include <config.h>
+#include <stddef.h>
+
+#if IS_ENABLED(CONFIG_MP_WORKERS)
+/*
+ * Call fn(arg, i) for every i in [0, count), spread over all CPUs, and
+ * return when all calls are done. The application processors are
+ * started on first use.
+ *
+ * fn() may run on any CPU, at the same time as other calls: it must
+ * not print, allocate memory or use drives, and only touch memory that
+ * belongs to its item. The APs run without paging, so data in a PAE
+ * window (see pae.c) is out of their reach; while paging is on, all
+ * items run on the calling CPU.
+ */
+void mp_parallel_for(unsigned long count,
+		void (*fn)(void *arg, unsigned long i), void *arg);
+
+/* memset() large ranges with all CPUs */
+void mp_memset(void *dest, int c, size_t len);
+
+/* Number of CPUs that take part, 1 until the APs were started */
+int mp_cpus(void);
+
+/* Park the APs waiting for a SIPI, right before jumping to the OS */
+void mp_stop(void);
+#else
+static inline void mp_parallel_for(unsigned long count,
+		void (*fn)(void *arg, unsigned long i), void *arg)
+{
+	unsigned long i;
+
+	for (i = 0; i < count; i++)
+		fn(arg, i);
+}
+#define mp_memset(d,c,l) memset(d, c, l)
+#define mp_cpus() 1 /* nop */
+#define mp_stop() do {} while (0) /* nop */
+#endif
+
+#endif /* MP_H */
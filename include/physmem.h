@@ -0,0 +1,67 @@
+/*
+ * This file is part of FILO.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef PHYSMEM_H
+#define PHYSMEM_H
+
+#include <stdint.h>
+
+/*
+ * Start over with all RAM of the memory map, except FILO itself and
+ * kept ranges. boot() calls this before every boot attempt.
+ */
+void physmem_init(void);
+
+/*
+ * Allocate `size` bytes within [min, max), aligned to `align` which
+ * must be a power of 2 (e.g. 4 KiB, or 2 MiB and 1 GiB for placement
+ * that suits huge pages). The highest fitting address is used, and
+ * nothing is placed in the first MiB.
+ *
+ * Returns the physical address, 0 if there is no room.
+ */
+uint64_t physmem_alloc(uint64_t size, uint64_t align,
+		uint64_t min, uint64_t max);
+
+/*
+ * Reserve the fixed range [base, base + size), e.g. for a segment that
+ * must be loaded there. Kept ranges in the way are moved elsewhere.
+ * Returns 0 on success, -1 if any part of the range is not free.
+ */
+int physmem_reserve(uint64_t base, uint64_t size);
+
+/*
+ * Like physmem_reserve(), but parts of the range that are already in
+ * use are fine, as long as they are RAM and not FILO. For loaders that
+ * may write the same memory more than once.
+ */
+int physmem_claim(uint64_t base, uint64_t size);
+
+/* Return a range to the allocator. */
+void physmem_free(uint64_t base, uint64_t size);
+
+/*
+ * Allocate `size` bytes below `max` (at most 4 GiB, so they can be
+ * accessed directly) and keep them across physmem_init(), until they
+ * are returned with physmem_release(). If a loader reserves or claims
+ * a fixed range that overlaps them later, the contents are moved and
+ * moved() is called with the old and the new address.
+ *
+ * Returns the physical address, 0 if there is no room or there are
+ * too many kept ranges.
+ */
+uint64_t physmem_alloc_kept(uint64_t size, uint64_t max,
+		void (*moved)(uint64_t from, uint64_t to));
+void physmem_release(uint64_t base, uint64_t size);
+
+#endif /* PHYSMEM_H */
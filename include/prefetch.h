@@ -0,0 +1,42 @@
+/*
+ * This file is part of FILO.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <config.h>
+
+#if IS_ENABLED(CONFIG_PREFETCH)
+/*
+ * Queue the files of a FILO boot line ("hda1:/vmlinuz initrd=... root=...")
+ * for loading: the image and all initrds. Anything that was queued
+ * before is dropped. They are loaded by a task, whenever the loops
+ * that wait for a key call task_poll().
+ */
+void prefetch_start(const char *line);
+
+/*
+ * boot() is about to load `file`. If it was queued, load the rest of
+ * the queued files now, otherwise drop them.
+ */
+void prefetch_boot(const char *file);
+
+/* Drop all queued and loaded files, and free their memory */
+void prefetch_drop(void);
+#else
+#define prefetch_start(x) do {} while (0) /* nop */
+#define prefetch_boot(x) do {} while (0) /* nop */
+#define prefetch_drop() do {} while (0) /* nop */
+#endif
+
+#endif /* PREFETCH_H */
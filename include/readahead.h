@@ -0,0 +1,60 @@
+/*
+ * This file is part of FILO.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <config.h>
+
+#if IS_ENABLED(CONFIG_READAHEAD)
+/* The sector cache missed `sector` of drive `drive` of type `type` */
+void readahead_note(int type, int drive, unsigned long sector);
+
+/*
+ * Copy `sector` to `buf` if it was read ahead. Returns 1 if it was,
+ * 0 if it has to be read from the drive.
+ */
+int readahead_lookup(int type, int drive, unsigned long sector, void *buf);
+
+/*
+ * Read the list of sector ranges (CONFIG_READAHEAD_LIST) and read all
+ * of them ahead. Must be called while no file is open, init() does it
+ * once.
+ */
+void readahead_load(void);
+
+/*
+ * The drive `drive` of type `type` was just opened. If its medium isn't
+ * the one the list was recorded on anymore, drop what was read ahead.
+ */
+void readahead_opened(int type, int drive);
+
+/* Drop everything that was read ahead, after a boot attempt or error */
+void readahead_drop(void);
+
+/* Print the ranges missed so far, in the format of the list */
+void readahead_show(void);
+
+/* Print the list once more right before the OS is started */
+void readahead_show_at_jump(void);
+void readahead_jump(void);
+#else
+#define readahead_note(x,y,z) do {} while (0) /* nop */
+#define readahead_lookup(w,x,y,z) 0 /* nop */
+#define readahead_load() do {} while (0) /* nop */
+#define readahead_opened(x,y) do {} while (0) /* nop */
+#define readahead_drop() do {} while (0) /* nop */
+#define readahead_jump() do {} while (0) /* nop */
+#endif
+
+#endif /* READAHEAD_H */
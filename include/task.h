@@ -0,0 +1,103 @@
+/*
+ * This file is part of FILO.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef TASK_H
+#define TASK_H
+
+#include <libpayload.h>
+
+/*
+ * A task is a function that is called by the run loop again and again
+ * until it is done. The TASK_* macros let it pick up where it left off
+ * (like protothreads): it runs up to a TASK_YIELD() or TASK_SLEEP(),
+ * returns, and continues there on the next call. Local variables are
+ * lost in between, so state has to be kept elsewhere.
+ *
+ *	static int blink(struct task *t)
+ *	{
+ *		TASK_BEGIN(t);
+ *		for (;;) {
+ *			led_toggle();
+ *			TASK_SLEEP(t, 500);
+ *		}
+ *		TASK_END(t);
+ *	}
+ *
+ * Don't use switch statements across the macros.
+ */
+
+struct task {
+	const char *name;
+	int (*run)(struct task *t);
+	int flags;
+	unsigned int line;	/* where to continue */
+	u64 wake;		/* don't run before this tick */
+	struct task *next;
+};
+
+/* Task flags */
+#define TASK_IO		0x01	/* uses drives or files, see task_poll() */
+#define TASK_ACTIVE	0x10
+#define TASK_RUNNING	0x20
+
+/* Return values of run() */
+#define TASK_WAITING	0
+#define TASK_DONE	1
+
+#define TASK_BEGIN(t)	switch ((t)->line) { case 0:
+#define TASK_END(t)	} (t)->line = 0; return TASK_DONE
+
+/* Let the other tasks run */
+#define TASK_YIELD(t) \
+	do { (t)->line = __LINE__; return TASK_WAITING; \
+	case __LINE__:; } while (0)
+
+/* Continue in `ms` milliseconds at the earliest */
+#define TASK_SLEEP(t, ms) \
+	do { task_set_wake(t, ms); TASK_YIELD(t); } while (0)
+
+/* Wait until `cond` is true, checking it whenever the task would run */
+#define TASK_WAIT_UNTIL(t, cond) \
+	do { (t)->line = __LINE__; case __LINE__: \
+	if (!(cond)) return TASK_WAITING; } while (0)
+
+/* Add `t` to the run loop, it runs the next time the loop comes by */
+void task_start(struct task *t, const char *name,
+		int (*run)(struct task *t), int flags);
+
+/* Take `t` out of the run loop, whether it's done or not */
+void task_stop(struct task *t);
+
+static inline int task_active(const struct task *t)
+{
+	return t->flags & TASK_ACTIVE;
+}
+
+void task_set_wake(struct task *t, unsigned int ms);
+
+/*
+ * Run every task that is due once. For loops that wait for a key, with
+ * no file open: only there tasks with TASK_IO run.
+ */
+void task_poll(void);
+
+/*
+ * Wait `ms` milliseconds, and let the tasks without TASK_IO run in the
+ * meantime. For drivers that wait for hardware.
+ */
+void task_delay(unsigned int ms);
+
+/* Run the tasks without TASK_IO until `t` is done */
+void task_wait(struct task *t);
+
+#endif /* TASK_H */
@@ -0,0 +1,235 @@
+/*
+ * This file is part of FILO.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <libpayload.h>
+#include <config.h>
+#include <timer.h>
+#include <boottime.h>
+#include <iotrace.h>
+
+#define DEBUG_THIS CONFIG_DEBUG_LOADER
+#include <debug.h>
+
+/*
+ * Boot Stage Timeline
+ * ^^^^^^^^^^^^^^^^^^^
+ *
+ * Every time a stage is entered, an entry with its start and end time
+ * (in currticks(), i.e. TSC cycles on x86) is added to the timeline.
+ * Once the timeline is full, only the per-stage totals are updated.
+ * The last entries are kept for loading and starting the OS, so the
+ * stages that repeat a lot (mounts, lookups) can't crowd them out, and
+ * the very last one for the jump.
+ *
+ * Right before the jump to the OS, the entries are appended to the
+ * coreboot timestamp table. Both use the TSC on x86, so `cbmem -t`
+ * shows FILO's stages in line with coreboot's.
+ *
+ * Work done ahead of time in the background (prefetching) holds the
+ * timeline, so its mounts and lookups don't show up as boot stages.
+ */
+
+#define BOOTTIME_MAX_ENTRIES	64
+#define BOOTTIME_LOAD_ENTRIES	8	/* at the end, see above */
+
+static const char *const stage_names[STAGE_COUNT] = {
+	[STAGE_INIT]		= "init",
+	[STAGE_DRIVE_PROBE]	= "drive probe",
+	[STAGE_USB]		= "USB enumeration",
+	[STAGE_MENU_SEARCH]	= "menu.lst search",
+	[STAGE_MOUNT]		= "mount",
+	[STAGE_LOOKUP]		= "path lookup",
+	[STAGE_KERNEL_READ]	= "kernel read",
+	[STAGE_INITRD_READ]	= "initrd read",
+	[STAGE_MODULES]		= "module load",
+	[STAGE_JUMP]		= "jump",
+};
+
+struct boottime_entry {
+	enum boot_stage stage;
+	u64 start;
+	u64 end;
+};
+
+static struct boottime_entry timeline[BOOTTIME_MAX_ENTRIES];
+static int timeline_count;
+static int timeline_exported;
+static int held;
+
+static struct {
+	u64 start;		/* of the running instance, 0 if none */
+	int entry;		/* its timeline entry, -1 if it didn't fit */
+	u64 total;
+	unsigned int count;
+} stages[STAGE_COUNT];
+
+/* How far the timeline may fill up with entries of `stage` */
+static int timeline_limit(enum boot_stage stage)
+{
+	if (stage == STAGE_JUMP)
+		return BOOTTIME_MAX_ENTRIES;
+	if (stage >= STAGE_KERNEL_READ)
+		return BOOTTIME_MAX_ENTRIES - 1;
+	return BOOTTIME_MAX_ENTRIES - BOOTTIME_LOAD_ENTRIES;
+}
+
+void boottime_hold(int hold)
+{
+	held = hold;
+}
+
+void boottime_start(enum boot_stage stage)
+{
+	const u64 now = currticks();
+
+	if (held)
+		return;
+
+	iotrace_stage(stage, 1);
+	stages[stage].start = now;
+	stages[stage].entry = -1;
+	if (timeline_count < timeline_limit(stage)) {
+		timeline[timeline_count].stage = stage;
+		timeline[timeline_count].start = now;
+		timeline[timeline_count].end = now;
+		stages[stage].entry = timeline_count++;
+	}
+}
+
+void boottime_end(enum boot_stage stage)
+{
+	const u64 now = currticks();
+
+	if (held || !stages[stage].start)
+		return;
+
+	iotrace_stage(stage, 0);
+	stages[stage].total += now - stages[stage].start;
+	stages[stage].count++;
+	if (stages[stage].entry >= 0)
+		timeline[stages[stage].entry].end = now;
+	stages[stage].start = 0;
+}
+
+#if IS_ENABLED(CONFIG_TARGET_I386)
+/* Layout of coreboot's timestamp table in CBMEM. Older versions have a
+   32-bit max_entries, which reads the same on little endian. */
+struct cb_timestamp_entry {
+	u32 entry_id;
+	s64 entry_stamp;
+} __attribute__ ((packed));
+
+struct cb_timestamp_table {
+	u64 base_time;
+	u16 max_entries;
+	u16 tick_freq_mhz;
+	u32 num_entries;
+	struct cb_timestamp_entry entries[0];
+} __attribute__ ((packed));
+
+static void cb_timestamp_add(struct cb_timestamp_table *ts, u32 id, u64 stamp)
+{
+	struct cb_timestamp_entry *tse;
+
+	if (ts->num_entries >= ts->max_entries)
+		return;
+
+	tse = &ts->entries[ts->num_entries++];
+	tse->entry_id = id;
+	tse->entry_stamp = stamp - ts->base_time;
+}
+
+static void boottime_export(void)
+{
+	struct cb_timestamp_table *const ts = lib_sysinfo.tstamp_table;
+	int i;
+
+	if (!ts || timeline_exported)
+		return;
+
+	for (i = 0; i < timeline_count; i++) {
+		const struct boottime_entry *const e = &timeline[i];
+		const u32 id = BOOTTIME_TS_BASE + 2 * e->stage;
+
+		cb_timestamp_add(ts, id, e->start);
+		if (e->stage != STAGE_JUMP)
+			cb_timestamp_add(ts, id + 1, e->end);
+	}
+	timeline_exported = 1;
+	debug("added %d stages to the coreboot timestamp table\n", i);
+}
+#else
+#define boottime_export() do {} while (0) /* nop */
+#endif
+
+void boottime_jump(void)
+{
+	boottime_start(STAGE_JUMP);
+	boottime_end(STAGE_JUMP);
+	boottime_export();
+}
+
+const char *boottime_stage_name(enum boot_stage stage)
+{
+	return stage_names[stage];
+}
+
+static void print_ms(u64 ticks)
+{
+	const u64 us = ticks / MAX(timer_hz() / 1000000, 1);
+
+	printf("%6llu.%03llu", us / 1000, us % 1000);
+}
+
+void boottime_show(void)
+{
+	const u64 base = timeline_count ? timeline[0].start : 0;
+	int i;
+
+	if (!timeline_count) {
+		printf("No boot stages recorded.\n");
+		return;
+	}
+
+	printf("FILO started ");
+	print_ms(base);
+	printf(" ms after reset\n\n");
+
+	printf("  start (ms)   time (ms)  stage\n");
+	for (i = 0; i < timeline_count; i++) {
+		const struct boottime_entry *const e = &timeline[i];
+
+		printf(" ");
+		print_ms(e->start - base);
+		printf("  ");
+		print_ms(e->end - e->start);
+		printf("  %s%s\n", stage_names[e->stage],
+				stages[e->stage].start && stages[e->stage].entry == i
+				? " (running)" : "");
+	}
+
+	printf("\n  total (ms)  count  stage\n");
+	for (i = 0; i < STAGE_COUNT; i++) {
+		if (!stages[i].count)
+			continue;
+		printf(" ");
+		print_ms(stages[i].total);
+		printf("  %5u  %s\n", stages[i].count, stage_names[i]);
+	}
+	for (i = 0; i < STAGE_COUNT; i++) {
+		if (stages[i].count && timeline_count >= timeline_limit(i)) {
+			printf("The timeline is full, later stages are only in the totals.\n");
+			break;
+		}
+	}
+}
@@ -0,0 +1,586 @@
+/*
+ * This file is part of FILO.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <libpayload.h>
+#include <config.h>
+#include <fs.h>
+#include <digest.h>
+#include <mp.h>
+#if IS_ENABLED(CONFIG_TARGET_I386)
+#include <arch/cpuid.h>
+#endif
+
+#define DEBUG_THIS CONFIG_DEBUG_LOADER
+#include <debug.h>
+
+/*
+ * Digest engine
+ * ^^^^^^^^^^^^^
+ *
+ * Images are hashed while they are loaded (see file_digest_start() in
+ * fs/vfs.c), so the data is still in the cache when it's hashed, and
+ * what is hashed is what was loaded. SHA-256 is for real integrity checks, CRC32C for
+ * cheap corruption checks. The latter uses the SSE4.2 crc32
+ * instruction when the CPU has it.
+ */
+
+/* CRC32C (Castagnoli), reflected polynomial */
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t crc32c_table[256];
+static int crc32c_hw = -1;
+
+static void crc32c_init_table(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+		crc32c_table[i] = crc;
+	}
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	while (len--)
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#if IS_ENABLED(CONFIG_TARGET_I386)
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len)
+{
+	while (len && ((uintptr_t)p & 3)) {
+		asm("crc32b %1, %0" : "+r" (crc) : "rm" (*p));
+		p++;
+		len--;
+	}
+	while (len >= 4) {
+		asm("crc32l %1, %0" : "+r" (crc) : "rm" (*(const uint32_t *)p));
+		p += 4;
+		len -= 4;
+	}
+	while (len--) {
+		asm("crc32b %1, %0" : "+r" (crc) : "rm" (*p));
+		p++;
+	}
+	return crc;
+}
+
+static int cpu_has_sse42(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	cpuid(0, eax, ebx, ecx, edx);
+	if (eax < 1)
+		return 0;
+	cpuid(1, eax, ebx, ecx, edx);
+	return !!(ecx & (1 << 20));
+}
+#endif
+
+static uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+	if (crc32c_hw < 0) {
+#if IS_ENABLED(CONFIG_TARGET_I386)
+		crc32c_hw = cpu_has_sse42();
+#else
+		crc32c_hw = 0;
+#endif
+		if (!crc32c_hw)
+			crc32c_init_table();
+		debug("crc32c: %s\n", crc32c_hw ? "SSE4.2" : "table");
+	}
+#if IS_ENABLED(CONFIG_TARGET_I386)
+	if (crc32c_hw)
+		return crc32c_sse42(crc, data, len);
+#endif
+	return crc32c_sw(crc, data, len);
+}
+
+/* SHA-256, FIPS 180-4 */
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t *h, const uint8_t *p)
+{
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, k, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++, p += 4)
+		w[i] = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+			(uint32_t)p[2] << 8 | p[3];
+	for (; i < 64; i++)
+		w[i] = w[i - 16] + w[i - 7]
+			+ (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3))
+			+ (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+	a = h[0]; b = h[1]; c = h[2]; d = h[3];
+	e = h[4]; f = h[5]; g = h[6]; k = h[7];
+	for (i = 0; i < 64; i++) {
+		t1 = k + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25))
+			+ ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22))
+			+ ((a & b) ^ (a & c) ^ (b & c));
+		k = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+	h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+static void sha256_update(struct digest *const d, const uint8_t *p, size_t len)
+{
+	size_t fill = d->u.sha256.len & 63;
+	size_t n;
+
+	d->u.sha256.len += len;
+	if (fill) {
+		n = MIN(len, 64 - fill);
+		memcpy(d->u.sha256.buf + fill, p, n);
+		p += n;
+		len -= n;
+		if (fill + n < 64)
+			return;
+		sha256_block(d->u.sha256.h, d->u.sha256.buf);
+	}
+	for (; len >= 64; p += 64, len -= 64)
+		sha256_block(d->u.sha256.h, p);
+	memcpy(d->u.sha256.buf, p, len);
+}
+
+static void sha256_final(struct digest *const d, uint8_t *const out)
+{
+	const uint64_t bits = d->u.sha256.len << 3;
+	size_t fill = d->u.sha256.len & 63;
+	int i;
+
+	d->u.sha256.buf[fill++] = 0x80;
+	if (fill > 56) {
+		memset(d->u.sha256.buf + fill, 0, 64 - fill);
+		sha256_block(d->u.sha256.h, d->u.sha256.buf);
+		fill = 0;
+	}
+	memset(d->u.sha256.buf + fill, 0, 56 - fill);
+	for (i = 0; i < 8; i++)
+		d->u.sha256.buf[56 + i] = bits >> (56 - 8 * i);
+	sha256_block(d->u.sha256.h, d->u.sha256.buf);
+
+	for (i = 0; i < 32; i++)
+		out[i] = d->u.sha256.h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+size_t digest_size(const enum digest_algo algo)
+{
+	switch (algo) {
+	case DIGEST_CRC32C:
+		return 4;
+	case DIGEST_SHA256:
+		return 32;
+	default:
+		return 0;
+	}
+}
+
+void digest_init(struct digest *const d, const enum digest_algo algo)
+{
+	static const uint32_t sha256_init[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memset(d, 0, sizeof(*d));
+	d->algo = algo;
+	switch (algo) {
+	case DIGEST_CRC32C:
+		d->u.crc = 0xffffffff;
+		break;
+	case DIGEST_SHA256:
+		memcpy(d->u.sha256.h, sha256_init, sizeof(sha256_init));
+		break;
+	default:
+		break;
+	}
+}
+
+void digest_update(struct digest *const d, const void *const data, const size_t len)
+{
+	switch (d->algo) {
+	case DIGEST_CRC32C:
+		d->u.crc = crc32c(d->u.crc, data, len);
+		break;
+	case DIGEST_SHA256:
+		sha256_update(d, data, len);
+		break;
+	default:
+		break;
+	}
+}
+
+size_t digest_final(struct digest *const d, uint8_t *const out)
+{
+	const uint32_t crc = ~d->u.crc;
+
+	switch (d->algo) {
+	case DIGEST_CRC32C:
+		out[0] = crc >> 24;
+		out[1] = crc >> 16;
+		out[2] = crc >> 8;
+		out[3] = crc;
+		break;
+	case DIGEST_SHA256:
+		sha256_final(d, out);
+		break;
+	default:
+		break;
+	}
+	return digest_size(d->algo);
+}
+
+#if IS_ENABLED(CONFIG_VERIFY_DIGESTS)
+
+/*
+ * Manifest of expected digests
+ * ^^^^^^^^^^^^^^^^^^^^^^^^^^^^
+ *
+ * The manifest uses the sha256sum format, one "<hex digest>  <name>"
+ * per line. 64 hex digits select SHA-256, 8 select CRC32C. Names are
+ * matched against the file names as given to FILO. A name without a
+ * device matches the path on any device.
+ */
+
+#define MANIFEST_MAX_SIZE (64 << 10)
+
+struct manifest_entry {
+	char *name;
+	enum digest_algo algo;
+	uint8_t digest[DIGEST_MAX_SIZE];
+};
+
+static struct manifest_entry *manifest;
+static int manifest_entries;
+
+static struct {
+	enum digest_algo algo;
+	uint8_t digest[DIGEST_MAX_SIZE];
+	char *name;
+} expected;
+
+/*
+ * Buffers that are hashed ahead of verify_buffer(), all at once, with
+ * one CPU per buffer (see verify_queue()). SHA-256 and CRC32C of one
+ * stream can't be split up, but separate files can be hashed side by
+ * side.
+ */
+#define VERIFY_QUEUE_MAX 16
+
+static struct {
+	const void *buf;
+	size_t len;
+	const struct manifest_entry *entry;
+	uint8_t digest[DIGEST_MAX_SIZE];
+	size_t size;
+} queue[VERIFY_QUEUE_MAX];
+static int queued;
+
+static void free_manifest(void)
+{
+	int i;
+
+	for (i = 0; i < manifest_entries; i++)
+		free(manifest[i].name);
+	free(manifest);
+	manifest = NULL;
+	manifest_entries = 0;
+}
+
+static int parse_hex(const char *hex, uint8_t *const out, const size_t len)
+{
+	size_t i;
+	int j, v;
+
+	for (i = 0; i < len; i++) {
+		out[i] = 0;
+		for (j = 0; j < 2; j++, hex++) {
+			if (*hex >= '0' && *hex <= '9')
+				v = *hex - '0';
+			else if (*hex >= 'a' && *hex <= 'f')
+				v = *hex - 'a' + 10;
+			else if (*hex >= 'A' && *hex <= 'F')
+				v = *hex - 'A' + 10;
+			else
+				return 0;
+			out[i] = out[i] << 4 | v;
+		}
+	}
+	return 1;
+}
+
+static int parse_manifest_line(char *line, const int lineno)
+{
+	struct manifest_entry *entry, *new;
+	char *hex, *name, *end;
+	size_t hexlen;
+
+	while (isspace(*line))
+		line++;
+	if (!*line || *line == '#')
+		return 0;
+
+	hex = line;
+	while (*line && !isspace(*line))
+		line++;
+	hexlen = line - hex;
+	while (isspace(*line))
+		line++;
+	if (*line == '*')	/* sha256sum's binary mode marker */
+		line++;
+	name = line;
+	end = name + strlen(name);
+	while (end > name && isspace(end[-1]))
+		*--end = '\0';
+
+	new = realloc(manifest, (manifest_entries + 1) * sizeof(*manifest));
+	if (!new)
+		return -1;
+	manifest = new;
+	entry = &manifest[manifest_entries];
+
+	if (hexlen == 2 * digest_size(DIGEST_SHA256))
+		entry->algo = DIGEST_SHA256;
+	else if (hexlen == 2 * digest_size(DIGEST_CRC32C))
+		entry->algo = DIGEST_CRC32C;
+	else
+		entry->algo = DIGEST_NONE;
+	if (entry->algo == DIGEST_NONE || !*name ||
+			!parse_hex(hex, entry->digest, hexlen / 2)) {
+		printf("Bad digest manifest line %d\n", lineno);
+		return 0;
+	}
+
+	entry->name = strdup(name);
+	if (!entry->name)
+		return -1;
+	manifest_entries++;
+	return 0;
+}
+
+void verify_load_manifest(void)
+{
+	char *buf, *line, *next;
+	unsigned long size;
+	int lineno;
+
+	free_manifest();
+	queued = 0;
+	if (!CONFIG_DIGEST_MANIFEST[0])
+		return;
+
+	if (!file_open_optional(CONFIG_DIGEST_MANIFEST))
+		return;
+	size = file_size();
+	if (size > MANIFEST_MAX_SIZE) {
+		printf("Digest manifest too big\n");
+		file_close();
+		return;
+	}
+	buf = malloc(size + 1);
+	if (!buf || file_read(buf, size) != (int)size) {
+		printf("Can't read digest manifest\n");
+		free(buf);
+		file_close();
+		return;
+	}
+	file_close();
+	buf[size] = '\0';
+
+	for (line = buf, lineno = 1; line; line = next, lineno++) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		if (parse_manifest_line(line, lineno) < 0) {
+			printf("Out of memory reading digest manifest\n");
+			free_manifest();
+			break;
+		}
+	}
+	free(buf);
+
+	debug("%d digests in manifest\n", manifest_entries);
+}
+
+static const struct manifest_entry *lookup_manifest(const char *const filename)
+{
+	const char *const path = strchr(filename, ':');
+	int i;
+
+	for (i = 0; i < manifest_entries; i++) {
+		if (!strcmp(manifest[i].name, filename))
+			return &manifest[i];
+		if (path && !strchr(manifest[i].name, ':') &&
+				!strcmp(manifest[i].name, path + 1))
+			return &manifest[i];
+	}
+	return NULL;
+}
+
+void verify_begin(const char *const filename)
+{
+	const struct manifest_entry *const entry = lookup_manifest(filename);
+
+	free(expected.name);
+	expected.name = strdup(filename);
+	expected.algo = DIGEST_NONE;
+	if (!entry)
+		return;
+
+	expected.algo = entry->algo;
+	memcpy(expected.digest, entry->digest, sizeof(expected.digest));
+	file_digest_start(expected.algo, 0, 0);
+}
+
+void verify_expect(const enum digest_algo algo, const uint8_t *const digest,
+		const unsigned long offset)
+{
+	/* A digest the image carries of itself only catches corruption,
+	   anyone who changes the image can change it as well. It doesn't
+	   count when digests are required.  */
+	if (IS_ENABLED(CONFIG_DIGEST_REQUIRED) ||
+			expected.algo != DIGEST_NONE)
+		return;
+
+	expected.algo = algo;
+	memcpy(expected.digest, digest, digest_size(algo));
+	file_digest_start(algo, offset, digest_size(algo));
+}
+
+/* Compare the computed `digest` with the expected one */
+static int verify_digest(const char *const name,
+		const uint8_t *const digest, const size_t size)
+{
+	if (!size) {
+		printf("Can't hash %s\n", name);
+		return -1;
+	}
+	if (memcmp(digest, expected.digest, size)) {
+		printf("Digest mismatch for %s\n", name);
+		return -1;
+	}
+	debug("%s verified\n", name);
+	return 0;
+}
+
+/* Nothing to compare against, fine unless digests are required */
+static int verify_none(const char *const name)
+{
+	if (IS_ENABLED(CONFIG_DIGEST_REQUIRED)) {
+		printf("No digest for %s, refusing to load it\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+int verify_end(void)
+{
+	const char *const name = expected.name ? expected.name : "image";
+	uint8_t digest[DIGEST_MAX_SIZE];
+
+	if (expected.algo == DIGEST_NONE)
+		return verify_none(name);
+	expected.algo = DIGEST_NONE;
+
+	return verify_digest(name, digest, file_digest_finish(digest));
+}
+
+void verify_queue(const char *const filename,
+		const void *const buf, const size_t len)
+{
+	const struct manifest_entry *const entry = lookup_manifest(filename);
+
+	if (!entry || queued == VERIFY_QUEUE_MAX)
+		return;
+
+	queue[queued].buf = buf;
+	queue[queued].len = len;
+	queue[queued].entry = entry;
+	queue[queued].size = 0;
+	queued++;
+}
+
+/* May run on any CPU, see mp_parallel_for() */
+static void hash_queued(void *arg, unsigned long i)
+{
+	struct digest d;
+
+	digest_init(&d, queue[i].entry->algo);
+	digest_update(&d, queue[i].buf, queue[i].len);
+	queue[i].size = digest_final(&d, queue[i].digest);
+}
+
+void verify_hash_queued(void)
+{
+	/* Set up CRC32C before the other CPUs use it */
+	crc32c(0, NULL, 0);
+	mp_parallel_for(queued, hash_queued, NULL);
+}
+
+int verify_buffer(const char *const filename,
+		const void *const buf, const size_t len)
+{
+	const struct manifest_entry *const entry = lookup_manifest(filename);
+	uint8_t digest[DIGEST_MAX_SIZE];
+	struct digest d;
+	int i;
+
+	if (!entry)
+		return verify_none(filename);
+
+	memcpy(expected.digest, entry->digest, sizeof(expected.digest));
+	for (i = 0; i < queued; i++) {
+		if (queue[i].buf == buf && queue[i].len == len &&
+				queue[i].entry == entry && queue[i].size) {
+			memcpy(digest, queue[i].digest, sizeof(digest));
+			queue[i] = queue[--queued];
+			return verify_digest(filename, digest,
+					digest_size(entry->algo));
+		}
+	}
+
+	digest_init(&d, entry->algo);
+	digest_update(&d, buf, len);
+	return verify_digest(filename, digest, digest_final(&d, digest));
+}
+
+#endif /* CONFIG_VERIFY_DIGESTS */
@@ -30,6 +30,13 @@
 #include <arch/elf.h>
 #include <elf_boot.h>
 #include <fs.h>
+#include <digest.h>
+#include <physmem.h>
+#include <boottime.h>
+#include <mp.h>
+#if IS_ENABLED(CONFIG_TARGET_I386)
+#include <arch/cpuid.h>
+#endif
 #define DEBUG_THIS CONFIG_DEBUG_ELFBOOT
 #include <debug.h>
 
@@ -43,8 +50,6 @@ static int check_mem_ranges(Elf_phdr *phdr, int phnum)
 	int i, j;
 	unsigned long start, end;
 	unsigned long prog_start, prog_end;
-	struct memrange *mem;
-	struct sysinfo_t *info = &lib_sysinfo;
 
 	prog_start = virt_to_phys(&_start);
 	prog_end = virt_to_phys(&_end);
@@ -58,12 +63,7 @@ static int check_mem_ranges(Elf_phdr *phdr, int phnum)
 			goto conflict;
 		if (start < prog_end && end > prog_end)
 			goto conflict;
-		for (j = 0; j < info->n_memranges; j++) {
-			mem = &info->memrange[j];
-			if (mem->base <= start && mem->base + mem->size >= end)
-				break;
-		}
-		if (j >= info->n_memranges)
+		if (physmem_reserve(start, phdr[i].p_memsz))
 			goto badseg;
 	}
 	return 1;
@@ -73,6 +73,12 @@ conflict:
 
 badseg:
 	printf("Segment %d [%#lx-%#lx] doesn't fit into memory\n", i, start, end - 1);
+
+	/* Give back what was reserved so far */
+	for (j = 0; j < i; j++) {
+		if (phdr[j].p_type == PT_LOAD)
+			physmem_free(phdr[j].p_paddr, phdr[j].p_memsz);
+	}
 	return 0;
 }
 
@@ -125,6 +131,17 @@ static unsigned long process_image_notes(
 						+ (unsigned long)desc - (unsigned long)buf;
 				}
 			}
+			if (nhdr->n_namesz == sizeof(ELF_NOTE_FILO) &&
+			    memcmp(name, ELF_NOTE_FILO, sizeof(ELF_NOTE_FILO)) == 0) {
+				/* Where in the file, hashed as zeroes */
+				const unsigned long offset = phdr[i].p_offset
+					+ (unsigned long)desc - (unsigned long)buf;
+
+				if (nhdr->n_type == FIN_IMAGE_SHA256 && nhdr->n_descsz == 32)
+					verify_expect(DIGEST_SHA256, desc, offset);
+				if (nhdr->n_type == FIN_IMAGE_CRC32C && nhdr->n_descsz == 4)
+					verify_expect(DIGEST_CRC32C, desc, offset);
+			}
 		}
 	}
 out:
@@ -133,9 +150,120 @@ out:
 	return retval;
 }
 
-static int load_segments(Elf_phdr *phdr, int phnum, unsigned long checksum_offset)
+/* With an image checksum, segments are read in chunks of this size and
+   each chunk is summed right after it landed, while it's still cached. */
+#define SUM_CHUNK	(128 << 10)
+
+/* BSS of at least this size is cleared bypassing the cache */
+#define BSS_NT_MIN	(256 << 10)
+
+/* BSS of at least this size is cleared by all CPUs, in chunks */
+#define BSS_MP_MIN	(4 << 20)
+#define BSS_MP_CHUNK	(1 << 20)
+
+struct image_sum {
+	unsigned short sum;
+	unsigned long offset;	/* in the checksummed image */
+};
+
+static void image_sum_add(struct image_sum *is, const void *data, unsigned long len)
+{
+	is->sum = ipchksum_add(is->offset, is->sum, ipchksum(data, len));
+	is->offset += len;
+}
+
+#if IS_ENABLED(CONFIG_TARGET_I386)
+static int cpu_has_sse2(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	cpuid(0, eax, ebx, ecx, edx);
+	if (eax < 1)
+		return 0;
+	cpuid(1, eax, ebx, ecx, edx);
+	return !!(edx & (1 << 26));
+}
+
+static int sse2 = -1;
+#endif
+
+/* May run on any CPU, see clear_bss() */
+static void clear_bss_range(char *dest, unsigned long len)
+{
+#if IS_ENABLED(CONFIG_TARGET_I386)
+	if (sse2 && len >= BSS_NT_MIN) {
+		const unsigned long head = -(uintptr_t)dest & 15;
+
+		memset(dest, 0, head);
+		dest += head;
+		len -= head;
+		for (; len >= 16; dest += 16, len -= 16) {
+			asm volatile (
+				"movnti %1, 0(%0)\n\t"
+				"movnti %1, 4(%0)\n\t"
+				"movnti %1, 8(%0)\n\t"
+				"movnti %1, 12(%0)"
+				:
+				: "r" (dest), "r" (0)
+				: "memory");
+		}
+		asm volatile ("sfence" ::: "memory");
+	}
+#endif
+	memset(dest, 0, len);
+}
+
+struct bss_job {
+	char *dest;
+	unsigned long len;
+};
+
+static void clear_bss_chunk(void *arg, unsigned long i)
+{
+	const struct bss_job *const job = arg;
+	const unsigned long offset = i * BSS_MP_CHUNK;
+
+	clear_bss_range(job->dest + offset, MIN(job->len - offset, BSS_MP_CHUNK));
+}
+
+static void clear_bss(char *dest, unsigned long len)
+{
+	struct bss_job job = { dest, len };
+
+#if IS_ENABLED(CONFIG_TARGET_I386)
+	if (sse2 < 0)
+		sse2 = cpu_has_sse2();
+#endif
+	if (len < BSS_MP_MIN) {
+		clear_bss_range(dest, len);
+		return;
+	}
+	mp_parallel_for((len + BSS_MP_CHUNK - 1) / BSS_MP_CHUNK,
+			clear_bss_chunk, &job);
+}
+
+/* Zero what of the checksum at `checksum_offset` lies in [pos, pos + len) */
+static void clear_checksum(char *data, unsigned long pos, unsigned long len,
+		unsigned long checksum_offset)
+{
+	unsigned long i;
+
+	for (i = checksum_offset; i < checksum_offset + 2; i++) {
+		if (i >= pos && i < pos + len)
+			data[i - pos] = 0;
+	}
+}
+
+/*
+ * Load the segments and clear their BSS. If `is` is given, the segments
+ * are added to the image checksum as they are read. BSS is all zeroes,
+ * which doesn't change the sum, so it's only accounted for.
+ */
+static int load_segments(Elf_phdr *phdr, int phnum,
+		unsigned long checksum_offset, struct image_sum *is)
 {
-	unsigned long bytes;
+	unsigned long bytes, done, len;
+	char *dest;
 	int i;
 
 	bytes = 0;
@@ -149,24 +277,32 @@ static int load_segments(Elf_phdr *phdr, int phnum, unsigned long checksum_offse
 		      i, phdr[i].p_paddr, phdr[i].p_filesz, phdr[i].p_memsz);
 		file_seek(phdr[i].p_offset);
 		debug("loading... ");
-		if (file_read(phys_to_virt(phdr[i].p_paddr), phdr[i].p_filesz)
-				!= (int)phdr[i].p_filesz) {
-			printf("Can't read program segment %d\n", i);
-			return 0;
+		dest = phys_to_virt(phdr[i].p_paddr);
+		for (done = 0; done < phdr[i].p_filesz; done += len) {
+			len = phdr[i].p_filesz - done;
+			if (is && len > SUM_CHUNK)
+				len = SUM_CHUNK;
+			if (file_read(dest + done, len) != (int)len) {
+				printf("Can't read program segment %d\n", i);
+				return 0;
+			}
+			if (is) {
+				clear_checksum(dest + done, phdr[i].p_offset + done,
+						len, checksum_offset);
+				image_sum_add(is, dest + done, len);
+			}
 		}
 		bytes += phdr[i].p_filesz;
 		debug("clearing... ");
-		memset(phys_to_virt(phdr[i].p_paddr + phdr[i].p_filesz), 0,
-		       phdr[i].p_memsz - phdr[i].p_filesz);
-		if (phdr[i].p_offset <= checksum_offset &&
-		    phdr[i].p_offset + phdr[i].p_filesz >= checksum_offset + 2) {
-			debug("clearing checksum... ");
-			memset(phys_to_virt(phdr[i].p_paddr + checksum_offset
-						- phdr[i].p_offset), 0, 2);
-		}
+		clear_bss(dest + phdr[i].p_filesz,
+			  phdr[i].p_memsz - phdr[i].p_filesz);
+		if (is)
+			is->offset += phdr[i].p_memsz - phdr[i].p_filesz;
 		debug("ok\n");
 
 	}
+	if (verify_end())
+		return 0;
 #if defined(DEBUG) && (DEBUG == 1)
 	u64 time = (timer_raw_value() - start_time) / (timer_hz() * 1000);
 	debug("Loaded %lu bytes in %lldms (%luKB/s)\n",
@@ -175,33 +311,20 @@ static int load_segments(Elf_phdr *phdr, int phnum, unsigned long checksum_offse
 	return 1;
 }
 
-static int verify_image(Elf_ehdr *ehdr, Elf_phdr *phdr, int phnum, unsigned short image_sum)
+/* Start the image checksum with the headers, segments follow */
+static void image_sum_headers(struct image_sum *is,
+		Elf_ehdr *ehdr, Elf_phdr *phdr, int phnum)
 {
-	unsigned short sum, part_sum;
-	unsigned long offset;
-	int i;
-
-	sum = 0;
-	offset = 0;
-
-	part_sum = ipchksum(ehdr, sizeof *ehdr);
-	sum = ipchksum_add(offset, sum, part_sum);
-	offset += sizeof *ehdr;
-
-	part_sum = ipchksum(phdr, phnum * sizeof(*phdr));
-	sum = ipchksum_add(offset, sum, part_sum);
-	offset += phnum * sizeof(*phdr);
-
-	for (i = 0; i < phnum; i++) {
-		if (phdr[i].p_type != PT_LOAD)
-			continue;
-		part_sum = ipchksum(phys_to_virt(phdr[i].p_paddr), phdr[i].p_memsz);
-		sum = ipchksum_add(offset, sum, part_sum);
-		offset += phdr[i].p_memsz;
-	}
+	is->sum = 0;
+	is->offset = 0;
+	image_sum_add(is, ehdr, sizeof *ehdr);
+	image_sum_add(is, phdr, phnum * sizeof(*phdr));
+}
 
-	if (sum != image_sum) {
-		printf("Verify FAILED (image:%#04x vs computed:%#04x)\n", image_sum, sum);
+static int verify_image(const struct image_sum *is, unsigned short image_sum)
+{
+	if (is->sum != image_sum) {
+		printf("Verify FAILED (image:%#04x vs computed:%#04x)\n", image_sum, is->sum);
 		return 0;
 	}
 	return 1;
@@ -303,7 +426,9 @@ int elf_load(uintptr_t *const entry, const bool elfboot)
 	unsigned long phdr_size;
 	unsigned long checksum_offset = 0;
 	unsigned short checksum = 0;
+	struct image_sum sum;
 	int retval = -1;
+	int ret;
 
 	image_name = image_version = 0;
 
@@ -350,11 +475,18 @@ int elf_load(uintptr_t *const entry, const bool elfboot)
 		printf(" version %s", image_version);
 	printf("...\n");
 
-	if (!load_segments(phdr, ehdr.e_phnum, checksum_offset))
+	if (checksum_offset)
+		image_sum_headers(&sum, &ehdr, phdr, ehdr.e_phnum);
+
+	boottime_start(STAGE_KERNEL_READ);
+	ret = load_segments(phdr, ehdr.e_phnum, checksum_offset,
+			checksum_offset ? &sum : NULL);
+	boottime_end(STAGE_KERNEL_READ);
+	if (!ret)
 		goto out;
 
 	if (checksum_offset) {
-		if (!verify_image(&ehdr, phdr, ehdr.e_phnum, checksum))
+		if (!verify_image(&sum, checksum))
 			goto out;
 	}
 
@@ -372,20 +504,36 @@ out:
 }
 
 #ifdef CONFIG_ELF_BOOT
-int elf_boot(const char *filename, const char *cmdline)
+int elf_probe(const void *buf, size_t len)
 {
-	uintptr_t entry;
-	int ret;
+	const unsigned char *ident = buf;
+
+	return len >= EI_NIDENT
+		&& ident[EI_MAG0] == ELFMAG0
+		&& ident[EI_MAG1] == ELFMAG1
+		&& ident[EI_MAG2] == ELFMAG2
+		&& ident[EI_MAG3] == ELFMAG3;
+}
 
+int elf_boot(const char *filename, const char *cmdline)
+{
 	if (!file_open(filename))
 		return -1;
 
+	return elf_boot_opened(filename, cmdline);
+}
+
+int elf_boot_opened(const char *filename, const char *cmdline)
+{
+	uintptr_t entry;
+	int ret;
+
+	verify_begin(filename);
 	ret = elf_load(&entry, true);
+	file_close();
 	if (ret)
 		return ret;
 
-	file_close();
-
 	Elf_Bhdr *const boot_notes = build_boot_notes(cmdline);
 
 	if (prepare_for_jump()) {
@@ -20,10 +20,17 @@
 #include <config.h>
 #include <version.h>
 #include <loader.h>
+#include <digest.h>
+#include <physmem.h>
 #include <fs.h>
 #include <sys_info.h>
 #include <sound.h>
 #include <timer.h>
+#include <boottime.h>
+#include <fastpath.h>
+#include <readahead.h>
+#include <prefetch.h>
+#include <task.h>
 #include <debug.h>
 
 PAYLOAD_INFO(name, PROGRAM_NAME " " PROGRAM_VERSION);
@@ -61,6 +68,8 @@ void filo_reset_handler(void)
 
 static void init(void)
 {
+    boottime_start(STAGE_INIT);
+
     /* Gather system information, and implicitly sets up timers */
     lib_get_sysinfo();
 
@@ -69,6 +78,7 @@ static void init(void)
 
     printf("coreboot: %s\n", get_cb_version());
     printf("%s version %s\n", program_name, program_version);
+    devspinup();
     collect_sys_info(&sys_info);
     relocate();
 
@@ -78,12 +88,17 @@ static void init(void)
 
 #if IS_ENABLED(CONFIG_LIBPAYLOAD_STORAGE) && IS_ENABLED(CONFIG_LP_STORAGE)
     /* libpayload storage drivers */
+    boottime_start(STAGE_DRIVE_PROBE);
     storage_initialize();
+    boottime_end(STAGE_DRIVE_PROBE);
 #endif
 #if IS_ENABLED(CONFIG_USB_DISK)
 #if IS_ENABLED(CONFIG_LP_USB)
     /* libpayload USB stack is there */
+    boottime_start(STAGE_USB);
     usb_initialize();
+    usb_start_polling();
+    boottime_end(STAGE_USB);
 #else
     printf("No USB stack in libpayload.\n");
 #endif
@@ -94,13 +109,51 @@ static void init(void)
 #if IS_ENABLED(CONFIG_SUPPORT_SOUND)
     sound_init();
 #endif
-    delay(CONFIG_SATA_SPINUP_DELAY);
+    fastpath_load();
+    readahead_load();
+
+    boottime_end(STAGE_INIT);
+}
+
+static unsigned char probe[LOADER_PROBE_SIZE];
+
+static int open_image(const char *file)
+{
+    if (!file_open(file))
+	return 0;
+    /* Loaders see the contents of compressed images */
+    file_decompress();
+    return 1;
 }
 
+/* The loaders in the order they get to probe an image. Disabled ones
+ * are left out, their nop macros have no address. */
+static const struct {
+    int (*probe)(const void *buf, size_t len);
+    int (*load)(const char *filename, const char *cmdline);
+} loaders[] = {
+#ifdef CONFIG_ARTEC_BOOT
+    { artecboot_probe, artecboot_load_opened },
+#endif
+#ifdef CONFIG_ELF_BOOT
+    { elf_probe, elf_boot_opened },
+#endif
+#ifdef CONFIG_LINUX_LOADER
+    { linux_probe, linux_load_opened },
+#endif
+#ifdef CONFIG_WINCE_LOADER
+    { wince_probe, wince_load_opened },
+#endif
+#if IS_ENABLED(CONFIG_CSL_BOOT)
+    { csl_probe, csl_load_opened },
+#endif
+};
+
 int boot(const char *line)
 {
     char *file, *param;
-    int ret;
+    int len, ret, opened;
+    unsigned int i;
 
     /* Split filename and parameter */
     file = strdup(line);
@@ -110,42 +163,61 @@ int boot(const char *line)
 	param++;
     }
 
+    /* Start with all memory free, but FILO */
+    physmem_init();
+
+    /* Finish loading the image if it was prefetched */
+    prefetch_boot(file);
+
+    /* Read the expected digests while no file is open */
+    verify_load_manifest();
+
+    /* Open the image only once, and let the first few KiB of it
+     * decide which loader is responsible.
+     */
+    if (!open_image(file)) {
+	printf("Can't open %s\n", file);
+	ret = -1;
+	goto out;
+    }
+    len = file_read(probe, LOADER_PROBE_SIZE);
+    file_seek(0);
+    if (len < 0)
+	len = 0;
+    opened = 1;
+
     /* If the boot command is successful, the loader
-     * function will not return.
+     * function will not return. The loader closes the
+     * file in any case.
      *
      * If the loader is not supported, or it recognized
      * that it does not match for the given file type, it
-     * will return LOADER_NOT_SUPPORT.
+     * will return LOADER_NOT_SUPPORT, and the next loader
+     * whose magic matches gets the file, opened again.
      *
      * All other cases are an unknown error for now.
      */
+    ret = LOADER_NOT_SUPPORT;
+    for (i = 0; i < ARRAY_SIZE(loaders) && ret == LOADER_NOT_SUPPORT; i++) {
+	if (!loaders[i].probe(probe, len) || !(opened || open_image(file)))
+	    continue;
+	ret = loaders[i].load(file, param);
+	opened = 0;
+    }
 
-    ret = artecboot_load(file, param);
-    if (ret != LOADER_NOT_SUPPORT)
-	    goto out;
-
-    ret = elf_boot(file, param);
-    if (ret != LOADER_NOT_SUPPORT)
-	    goto out;
-
-    ret = linux_load(file, param);
-    if (ret != LOADER_NOT_SUPPORT)
-	    goto out;
-
-    ret = wince_load(file, param);
-    if (ret != LOADER_NOT_SUPPORT)
-	    goto out;
-
-    ret = csl_load(file, param);
-    if (ret != LOADER_NOT_SUPPORT)
-	    goto out;
+    if (opened)
+	file_close();
 
-    printf("Unsupported image format\n");
+    if (ret == LOADER_NOT_SUPPORT)
+	printf("Unsupported image format\n");
 
 out:
     free(file);
 
     clear_boot_modules();
+    prefetch_drop();
+    /* Read ahead for the first boot only */
+    readahead_drop();
 
     return ret;
 }
@@ -159,7 +231,9 @@ int main(void)
 
     /* Initialize */
     init();
+    boottime_start(STAGE_MENU_SEARCH);
     grub_menulst();
+    boottime_end(STAGE_MENU_SEARCH);
     grub_main();
     return 0;
 }
@@ -181,10 +255,12 @@ static inline int autoboot_delay(void)
     key = 0;
 
     printf("Press <Enter> for default boot, or <Esc> for boot prompt... ");
+    prefetch_start(CONFIG_AUTOBOOT_FILE);
     for (sec = CONFIG_AUTOBOOT_DELAY; sec>0 && key==0; sec--) {
 	printf("%d", sec);
 	timeout = currticks() + TICKS_PER_SEC;
 	while (currticks() < timeout) {
+	    task_poll();
 	    if (havechar()) {
 		key = getchar();
 		if (key==ENTER || key==ESCAPE)
@@ -27,7 +27,14 @@
 #include <flashlock.h>
 #include <loader.h>
 #include <grub/shared.h>
+#include <lib.h>
 #include <timer.h>
+#include <boottime.h>
+#include <iostat.h>
+#include <iotrace.h>
+#include <fastpath.h>
+#include <readahead.h>
+#include <prefetch.h>
 #ifdef CONFIG_USE_MD5_PASSWORDS
 #include <grub/md5.h>
 #endif
@@ -223,6 +230,23 @@ static struct builtin builtin_boot = {
 	"Boot the OS/chain-loader which has been loaded."
 };
 
+#if IS_ENABLED(CONFIG_BOOT_TIMESTAMPS)
+/* boottime */
+static int boottime_func(char *arg, int flags)
+{
+	boottime_show();
+	return 0;
+}
+
+static struct builtin builtin_boottime = {
+	"boottime",
+	boottime_func,
+	BUILTIN_CMDLINE | BUILTIN_HELP_LIST,
+	"boottime",
+	"Show how long the stages of booting took so far."
+};
+#endif
+
 /* color */
 /* Set new colors used for the menu interface. Support two methods to
  *    specify a color name: a direct integer representation and a symbolic
@@ -512,6 +536,41 @@ static struct builtin builtin_dumppm = {
 #endif
 #endif
 
+#if IS_ENABLED(CONFIG_FASTPATH)
+/* fastpath */
+static int fastpath_func(char *arg, int flags)
+{
+	char *next_arg;
+	int ret = 0;
+
+	if (!*arg) {
+		fastpath_show();
+		return 0;
+	}
+
+	printf("# FILO fast path record\n");
+	do {
+		next_arg = skip_to(0, arg);
+		nul_terminate(arg);
+		if (!fastpath_record(arg))
+			ret = 1;
+		arg = next_arg;
+	} while (*arg);
+
+	return ret;
+}
+
+static struct builtin builtin_fastpath = {
+	"fastpath",
+	fastpath_func,
+	BUILTIN_CMDLINE | BUILTIN_HELP_LIST,
+	"fastpath [FILE...]",
+	"Look up the FILEs (with their devices) and print a fast path"
+	    " record for them, to be stored as " CONFIG_FASTPATH_RECORD "."
+	    " Without FILEs, show the files of the loaded record."
+};
+#endif
+
 #if CONFIG_EXPERIMENTAL
 #warning "FIND not implemented yet."
 /* find */
@@ -988,6 +1047,238 @@ static struct builtin builtin_io = {
 #endif
 #endif
 
+#if IS_ENABLED(CONFIG_IO_STATS)
+/* iostat */
+static int iostat_func(char *arg, int flags)
+{
+	iostat_show();
+
+	if (memcmp(arg, "--reset", sizeof("--reset") - 1) == 0)
+		iostat_reset();
+
+	return 0;
+}
+
+static struct builtin builtin_iostat = {
+	"iostat",
+	iostat_func,
+	BUILTIN_CMDLINE | BUILTIN_HELP_LIST,
+	"iostat [--reset]",
+	"Show block I/O statistics per drive: reads, sector cache hits,"
+	    " driver requests and histograms of their sizes and latencies."
+	    " With --reset, clear the counters afterwards."
+};
+#endif
+
+#if IS_ENABLED(CONFIG_IO_TRACE)
+/* iotrace */
+static int iotrace_func(char *arg, int flags)
+{
+	iotrace_dump();
+
+	if (memcmp(arg, "--reset", sizeof("--reset") - 1) == 0)
+		iotrace_reset();
+
+	return 0;
+}
+
+static struct builtin builtin_iotrace = {
+	"iotrace",
+	iotrace_func,
+	BUILTIN_CMDLINE | BUILTIN_HELP_LIST,
+	"iotrace [--reset]",
+	"Print the block I/O trace on the console, for util/iotrace2json."
+	    " With --reset, clear the trace afterwards."
+};
+#endif
+
+#if IS_ENABLED(CONFIG_READAHEAD)
+/* readahead */
+static int readahead_func(char *arg, int flags)
+{
+	if (memcmp(arg, "--at-jump", sizeof("--at-jump") - 1) == 0)
+		readahead_show_at_jump();
+	else
+		readahead_show();
+
+	return 0;
+}
+
+static struct builtin builtin_readahead = {
+	"readahead",
+	readahead_func,
+	BUILTIN_CMDLINE | BUILTIN_HELP_LIST,
+	"readahead [--at-jump]",
+	"Print the sectors that missed the sector cache so far, as a list"
+	    " to be stored as " CONFIG_READAHEAD_LIST ". With --at-jump,"
+	    " print it right before the OS is started instead."
+};
+#endif
+
+#ifdef CONFIG_DEVELOPER_TOOLS
+/* readbench */
+#define READBENCH_SPAN	(64 << 20)	/* default for devices */
+
+struct readbench_target {
+	int is_file;
+	u64 span;		/* bytes that are read from */
+	unsigned long part_start;
+};
+
+static int readbench_cmp(const void *a, const void *b)
+{
+	const u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static u64 readbench_us(u64 ticks)
+{
+	return ticks / MAX(timer_hz() / 1000000, 1);
+}
+
+/* Read `count` requests of `size` bytes, one after another or at random
+   offsets, and print the throughput and latency percentiles. */
+static void readbench_run(const struct readbench_target *tgt, int random,
+		int raw, unsigned long size, unsigned long count,
+		char *buf, u64 *lat)
+{
+	const u64 slots = tgt->span / size;
+	u64 rnd = currticks() | 1;
+	u64 pos = 0, start, t, us;
+	unsigned long i;
+	int ok = 1;
+
+	start = currticks();
+	for (i = 0; i < count && ok; i++) {
+		if (random) {
+			rnd ^= rnd << 13;
+			rnd ^= rnd >> 7;
+			rnd ^= rnd << 17;
+			pos = (rnd % slots) * size;
+		} else if (pos + size > tgt->span) {
+			pos = 0;
+		}
+
+		t = currticks();
+		if (raw) {
+			ok = devread_blocks(tgt->part_start + (pos >> 9),
+					size >> 9, buf) > 0;
+		} else if (tgt->is_file) {
+			file_seek(pos);
+			ok = file_read(buf, size) == (int)size;
+		} else {
+			ok = devread(pos >> 9, 0, size, buf);
+		}
+		lat[i] = currticks() - t;
+		pos += size;
+	}
+	us = readbench_us(currticks() - start);
+
+	grub_printf("%s %s", random ? "rand" : "seq ",
+			raw ? "driver " : tgt->is_file ? "file   " : "devread");
+	if (!ok) {
+		grub_printf("  read error after %lu requests\n", i - 1);
+		return;
+	}
+	us = MAX(us, 1);
+	qsort(lat, count, sizeof(*lat), readbench_cmp);
+	grub_printf(" %6llu.%llu %9llu %8llu %8llu %8llu %8llu\n",
+			(u64)size * count * 10 / us / 10,
+			(u64)size * count * 10 / us % 10,
+			(u64)count * 1000000 / us,
+			readbench_us(lat[count / 2]),
+			readbench_us(lat[count * 9 / 10]),
+			readbench_us(lat[count * 99 / 100]),
+			readbench_us(lat[count - 1]));
+}
+
+static int readbench_func(char *arg, int flags)
+{
+	struct readbench_target tgt;
+	unsigned long size = 64 << 10, count = 256, part_length;
+	u64 span = READBENCH_SPAN;
+	char *name, *buf = NULL;
+	u64 *lat = NULL;
+	int raw_ok = 1;
+
+	while (memcmp(arg, "--", 2) == 0) {
+		if (memcmp(arg, "--size=", sizeof("--size=") - 1) == 0)
+			size = strtoull_with_suffix(arg + sizeof("--size=") - 1, NULL, 0);
+		else if (memcmp(arg, "--count=", sizeof("--count=") - 1) == 0)
+			count = strtoull_with_suffix(arg + sizeof("--count=") - 1, NULL, 0);
+		else if (memcmp(arg, "--span=", sizeof("--span=") - 1) == 0)
+			span = strtoull_with_suffix(arg + sizeof("--span=") - 1, NULL, 0);
+		else
+			break;
+		arg = skip_to(0, arg);
+	}
+	name = arg;
+	nul_terminate(name);
+
+	size = ALIGN_UP(size, 512);
+	if (!*name || !size || !count) {
+		errnum = ERR_BAD_ARGUMENT;
+		return 1;
+	}
+
+	if (!file_open(name)) {
+		errnum = ERR_FILE_NOT_FOUND;
+		return 1;
+	}
+
+	memset(&tgt, 0, sizeof(tgt));
+	dev_get_partition(&tgt.part_start, &part_length);
+	tgt.is_file = !using_devsize;
+	tgt.span = tgt.is_file ? file_size() : span;
+	tgt.span = MIN(tgt.span, (u64)part_length << 9);
+	if (tgt.span < size) {
+		grub_printf("Only %llu bytes to read from.\n", tgt.span);
+		goto out;
+	}
+
+	buf = malloc(size);
+	lat = malloc(count * sizeof(*lat));
+	if (!buf || !lat) {
+		grub_printf("Out of memory.\n");
+		goto out;
+	}
+
+	grub_printf("%s: %lu requests of %lu bytes, within %llu bytes\n",
+			name, count, size, tgt.span);
+	grub_printf("               MB/s      IOPS   p50 us   p90 us   p99 us   max us\n");
+	readbench_run(&tgt, 0, 0, size, count, buf, lat);
+	readbench_run(&tgt, 1, 0, size, count, buf, lat);
+
+	/* The same amount of data, straight from the driver */
+	if (devread_blocks(tgt.part_start, 1, buf) < 0)
+		raw_ok = 0;
+	if (raw_ok) {
+		readbench_run(&tgt, 0, 1, size, count, buf, lat);
+		readbench_run(&tgt, 1, 1, size, count, buf, lat);
+	} else {
+		grub_printf("(the driver of this drive can't be read from directly)\n");
+	}
+
+out:
+	free(lat);
+	free(buf);
+	file_close();
+	return 0;
+}
+
+static struct builtin builtin_readbench = {
+	"readbench",
+	readbench_func,
+	BUILTIN_CMDLINE | BUILTIN_HELP_LIST,
+	"readbench [--size=BYTES] [--count=N] [--span=BYTES] DEVICE|FILE",
+	"Measure sequential and random read speed of DEVICE or FILE, with"
+	    " N requests of BYTES each (default 256 of 64K). Reads go through"
+	    " devread() or file_read() first, then straight to the driver."
+	    " On a device, reads stay within the first --span bytes (64M)."
+};
+#endif
+
 /* kernel */
 static int kernel_func(char *arg, int flags)
 {
@@ -1473,6 +1764,53 @@ static struct builtin builtin_root = {
 	"Set the current \"root device\" to the device DEVICE."
 };
 
+#if IS_ENABLED(CONFIG_PREFETCH)
+/* Is LINE the command NAME? Returns its argument, or NULL. */
+static char *entry_command(char *line, const char *name)
+{
+	const int len = strlen(name);
+
+	while (*line == ' ' || *line == '\t')
+		line++;
+	if (strncmp(line, name, len) || (line[len] != ' ' &&
+				line[len] != '\t' && line[len] != '='))
+		return NULL;
+	return skip_to(1, line);
+}
+
+/* Queue the kernel and initrd of a menu entry for prefetching. This
+ * builds the boot line that "boot" would get, without running the
+ * commands.
+ */
+void prefetch_menu_entry(char *entry)
+{
+	static char line[BOOT_LINE_LENGTH], initrd[BOOT_LINE_LENGTH];
+	char saved_root[sizeof(root_device)];
+	char *arg;
+
+	memcpy(saved_root, root_device, sizeof(root_device));
+	line[0] = initrd[0] = '\0';
+
+	for (; *entry; entry += strlen(entry) + 1) {
+		if ((arg = entry_command(entry, "root")))
+			root_func(arg, 0);
+		else if ((arg = entry_command(entry, "kernel")))
+			copy_path_to_filo_bootline(arg, line, 1, 0);
+		else if ((arg = entry_command(entry, "initrd")))
+			copy_path_to_filo_bootline(arg, initrd, 1, 0);
+	}
+	memcpy(root_device, saved_root, sizeof(root_device));
+
+	if (!line[0])
+		return;
+	if (initrd[0]) {
+		strlcat(line, " initrd=", BOOT_LINE_LENGTH);
+		strlcat(line, initrd, BOOT_LINE_LENGTH);
+	}
+	prefetch_start(line);
+}
+#endif
+
 void __attribute__((weak))  serial_hardware_init(int port, int speed, int
 		word_bits, int parity, int stop_bits);
 
@@ -1930,13 +2268,8 @@ static int cat_func(char *arg, int flags)
 		return 1;
 	}
 
-	while ((len = file_read(buf, sizeof(buf))) != 0) {
-		int cnt;
-
-		for (cnt = 0; cnt < len; cnt++) {
-			grub_putchar(buf[cnt]);
-		}
-	}
+	while ((len = file_read(buf, sizeof(buf))) > 0)
+		grub_putnstr(buf, len);
 
 	file_close();
 
@@ -1955,6 +2288,9 @@ static struct builtin builtin_cat = {
 
 struct builtin *builtin_table[] = {
 	&builtin_boot,
+#if IS_ENABLED(CONFIG_BOOT_TIMESTAMPS)
+	&builtin_boottime,
+#endif
 	&builtin_cat,
 	&builtin_color,
 	&builtin_configfile,
@@ -1965,6 +2301,9 @@ struct builtin *builtin_table[] = {
 	&builtin_dumppm,
 #endif
 #endif
+#if IS_ENABLED(CONFIG_FASTPATH)
+	&builtin_fastpath,
+#endif
 #ifdef CONFIG_EXPERIMENTAL
 	&builtin_find,
 #endif
@@ -1981,6 +2320,12 @@ struct builtin *builtin_table[] = {
 #ifdef CONFIG_TARGET_I386
 	&builtin_io,
 #endif
+#endif
+#if IS_ENABLED(CONFIG_IO_STATS)
+	&builtin_iostat,
+#endif
+#if IS_ENABLED(CONFIG_IO_TRACE)
+	&builtin_iotrace,
 #endif
 	&builtin_kernel,
 	&builtin_keymap,
@@ -2003,6 +2348,10 @@ struct builtin *builtin_table[] = {
 	&builtin_poweroff,
 #ifdef CONFIG_DEVELOPER_TOOLS
 	&builtin_probe,
+	&builtin_readbench,
+#endif
+#if IS_ENABLED(CONFIG_READAHEAD)
+	&builtin_readahead,
 #endif
 	&builtin_reboot,
 	&builtin_root,
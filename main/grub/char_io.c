@@ -82,6 +82,14 @@ void grub_putstr(const char *str)
 		grub_putchar(*str++);
 }
 
+/* Print LEN bytes of BUF, and put them on the screen in one go.  */
+void grub_putnstr(const char *buf, int len)
+{
+	while (len-- > 0)
+		grub_putchar(*buf++);
+	refresh();
+}
+
 void grub_printf(const char *format, ...)
 {
 	va_list args;
@@ -690,6 +698,22 @@ int terminal_flags;
 
 static color_state console_color_state = COLOR_STATE_STANDARD;
 
+/* What we put on the screen: the character in the low byte, the color
+   pair above it, 0 if we don't know. curses sends every cell that is
+   written to, even if it doesn't change. Over a serial line that makes
+   redrawing the menu slow, so console_putchar() skips cells that
+   already show what it would write. Only the changed cells are marked
+   for refresh(), which moves the cursor to each changed line and sends
+   them all at once.  */
+#define SHADOW_LINES	25
+#define SHADOW_COLS	80
+static unsigned short shadow[SHADOW_LINES][SHADOW_COLS];
+
+static void shadow_invalidate(void)
+{
+	memset(shadow, 0, sizeof(shadow));
+}
+
 void console_setcolorstate(color_state state)
 {
 	console_color_state = state;
@@ -875,8 +899,11 @@ void console_putchar(int c)
 	if (c == '\n') {
 		getyx(stdscr, y, x);
 		if (y + 1 == LINES) {
+			/* Lines that scroll off before the next refresh()
+			   would never be sent, so flush every scrolled line.  */
 			scroll(stdscr);
 			refresh();
+			shadow_invalidate();
 		} else {
 			move(y + 1, x);
 		}
@@ -884,17 +911,31 @@ void console_putchar(int c)
 		getyx(stdscr, y, x);
 		move(y, 0);
 	} else if (isprint(c)) {
+		const int pair =
+			console_color_state == COLOR_STATE_HIGHLIGHT ? 2 : 1;
+		unsigned short *cell = NULL;
+
 		getyx(stdscr, y, x);
 		if (x + 1 == COLS) {
 			console_putchar('\r');
 			console_putchar('\n');
+			getyx(stdscr, y, x);
 		}
-		if (console_color_state == COLOR_STATE_HIGHLIGHT)
-			color_set(2, NULL);
-		else
-			color_set(1, NULL);
+		if (y < SHADOW_LINES && x < SHADOW_COLS) {
+			cell = &shadow[y][x];
+			if (*cell == (pair << 8 | c)) {
+				move(y, x + 1);
+				return;
+			}
+		}
+		color_set(pair, NULL);
 		addch(c);
+		if (cell)
+			*cell = pair << 8 | c;
 	} else {
+		getyx(stdscr, y, x);
+		if (y < SHADOW_LINES && x < SHADOW_COLS)
+			shadow[y][x] = 0;
 		addch(c);
 	}
 }
@@ -916,6 +957,7 @@ int getxy(void)
 void cls(void)
 {
 	clear();
+	shadow_invalidate();
 	move(0, 0);
 }
 
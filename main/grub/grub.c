@@ -26,6 +26,8 @@
 #include <fs.h>
 #include <flashlock.h>
 #include <timer.h>
+#include <prefetch.h>
+#include <task.h>
 
 extern char config_file[];
 extern int reload_configfile;
@@ -79,6 +81,7 @@ static inline int menulst_delay(void)
 		printf("%d", sec);
 		timeout = currticks() + TICKS_PER_SEC;
 		while (currticks() < timeout) {
+			task_poll();
 			if (havechar()) {
 				key = getchar();
 				if (key == ENTER || key == ESCAPE)
@@ -274,8 +277,8 @@ static char *get_entry(char *list, int num, int nested)
 	return list;
 }
 
-/* Print an entry in a line of the menu box.  */
-static void print_entry(int y, int highlight, char *entry)
+/* Draw an entry in a line of the menu box, without refresh().  */
+static void draw_entry(int y, int highlight, char *entry)
 {
 	int x;
 
@@ -298,6 +301,12 @@ static void print_entry(int y, int highlight, char *entry)
 	gotoxy(74, y);
 
 	console_setcolorstate(COLOR_STATE_STANDARD);
+}
+
+/* Print an entry in a line of the menu box.  */
+static void print_entry(int y, int highlight, char *entry)
+{
+	draw_entry(y, highlight, entry);
 	refresh();
 }
 
@@ -316,7 +325,7 @@ static void print_entries(int y, int size, int first, int entryno, char *menu_en
 	menu_entries = get_entry(menu_entries, first, 0);
 
 	for (i = 0; i < size; i++) {
-		print_entry(y + i + 1, entryno == i, menu_entries);
+		draw_entry(y + i + 1, entryno == i, menu_entries);
 
 		while (*menu_entries)
 			menu_entries++;
@@ -386,6 +395,12 @@ static void run_menu(char *menu_entries, char *config_entries, int num_entries,
 		entryno--;
 	}
 
+#if IS_ENABLED(CONFIG_PREFETCH)
+	/* Load the default entry while the countdown runs */
+	if (grub_timeout >= 0 && config_entries)
+		prefetch_menu_entry(get_entry(config_entries, first_entry + entryno, 1));
+#endif
+
 	/* If the timeout was expired or wasn't set, force to show the menu
 	   interface. */
 	if (grub_timeout < 0)
@@ -397,6 +412,8 @@ static void run_menu(char *menu_entries, char *config_entries, int num_entries,
 		while ((time1 = getrtsecs()) == 0xFF);
 
 		while (1) {
+			task_poll();
+
 			/* Check if ESC is pressed.  */
 			if (checkkey() != -1 && ASCII_CHAR(getkey()) == '\e') {
 				grub_timeout = -1;
@@ -486,6 +503,8 @@ static void run_menu(char *menu_entries, char *config_entries, int num_entries,
 			grub_timeout--;
 		}
 
+		task_poll();
+
 		/* Check for a keypress, however if TIMEOUT has been expired
 		   (GRUB_TIMEOUT == -1) relax in GETKEY even if no key has been
 		   pressed.
@@ -881,7 +900,7 @@ static int get_line_from_config(char *cmdline, int maxlen, int read_from_file)
 
 	while (1) {
 		if (read_from_file) {
-			if (!file_read(&c, 1))
+			if (!file_stream_read(&c, 1))
 				break;
 		} else {
 			if (!read_from_preset_menu(&c, 1))
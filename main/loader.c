@@ -20,6 +20,11 @@
 #include <flashlock.h>
 #include <grub/shared.h>
 #include <loader.h>
+#include <digest.h>
+#include <physmem.h>
+#include <boottime.h>
+#include <readahead.h>
+#include <mp.h>
 
 #define DEBUG_THIS CONFIG_DEBUG_LOADER
 #include <debug.h>
@@ -34,9 +39,10 @@
  *
  * Ideally,  files will be placed directly where the next-stage program
  * needs them. Hence, we avoid using the heap and instead allocate big,
- * continuous chunks of memory below FILO from top down. FILO is expec-
- * ted to be already relocated to the top of memory. This way, we avoid
- * cluttering lower memory that may be needed by the next-stage program.
+ * continuous chunks of memory with physmem_alloc(), from top down. FILO
+ * is expected to be already relocated to the top of memory. This way,
+ * we avoid cluttering lower memory that may be needed by the next-stage
+ * program.
  *
  * We keep a linked-list of `struct boot_module` with meta data on the
  * heap. Beside the physical address and size of the module data, some
@@ -72,43 +78,42 @@
 struct boot_module_node {
 	struct boot_module module;
 	struct boot_module_node *next;
+	int planned;		/* read through the extent plan */
+	char *dev;		/* device it was mapped on */
 };
 
 static struct boot_module_node *modules_head, *modules_tail;
 
-/* Place in the highest range in the memory map, but not above `below`. */
-static uintptr_t place_boot_module(const size_t size, const uintptr_t below)
-{
-	const struct memrange *const memranges = lib_sysinfo.memrange;
-	unsigned long long highest_base = 0;
-	uintptr_t ret = 0;
-	int i;
-
-	if (size > below)
-		return 0;
-
-	for (i = 0; i < lib_sysinfo.n_memranges; ++i) {
-		if (memranges[i].type != CB_MEM_RAM)
-			continue;
-
-		if (highest_base > memranges[i].base || memranges[i].base >= below)
-			continue;
-
-		const unsigned long long top =
-			MIN(memranges[i].base + memranges[i].size, below);
-		if (top < size)
-			continue;
-
-		const unsigned long long addr = ALIGN_DOWN(top - size, 0x1000);
-		if (addr < memranges[i].base)
-			continue;
+/*
+ * Planned Loading
+ * ^^^^^^^^^^^^^^^
+ *
+ * If there are several file modules, we look up where their data lies
+ * on the drive first (file_map()), then read all extents sorted by
+ * drive position. Extents that are contiguous both on the drive and in
+ * memory are read with a single request. Every extent is read straight
+ * to its place in the module, so the data still lands right where
+ * physmem_alloc() put it, and each module is read only once.
+ *
+ * Modules that can't be mapped, e.g. on compressed filesystems, are
+ * read with file_read() as usual.
+ */
 
-		highest_base = memranges[i].base;
-		ret = addr;
-	}
+struct module_extent {
+	unsigned long long pos;		/* absolute byte position on the drive */
+	unsigned long len;
+	uintptr_t addr;			/* physical destination */
+	int drive;			/* device type and drive number */
+	const struct boot_module_node *node;
+};
 
-	return ret;
-}
+static struct {
+	struct module_extent *extents;
+	size_t count, size;
+	const struct boot_module_node *node;	/* module being mapped */
+	int drive;
+	int failed;
+} plan;
 
 static const struct boot_module *register_boot_module_(
 		const size_t size, const char *filename,
@@ -116,7 +121,6 @@ static const struct boot_module *register_boot_module_(
 {
 	struct boot_module_node *const node = calloc(1, sizeof(*node));
 	struct boot_module *const mod = &node->module;
-	extern char _start[];
 
 	if (!node)
 		goto oom_ret;
@@ -141,8 +145,7 @@ static const struct boot_module *register_boot_module_(
 
 	mod->size = size;
 
-	mod->addr = place_boot_module(size,
-			modules_tail ? modules_tail->module.addr : virt_to_phys(_start));
+	mod->addr = physmem_alloc(size, 0x1000, 0, (uint64_t)UINTPTR_MAX + 1);
 	if (!mod->addr)
 		goto oom_ret;
 
@@ -192,6 +195,153 @@ const struct boot_module *register_file_module(
 	return register_boot_module_(size, filename, params, desc);
 }
 
+static void add_module_extent(const unsigned long file_offset,
+		const unsigned long sector, const unsigned long byte_offset,
+		const unsigned long byte_len)
+{
+	const unsigned long long pos =
+		((unsigned long long)sector << DEV_SECTOR_BITS) + byte_offset;
+	const uintptr_t addr = plan.node->module.addr + file_offset;
+	struct module_extent *e;
+
+	if (!byte_len)
+		return;
+
+	/* Most drivers read a block at a time, merge right away */
+	if (plan.count) {
+		e = &plan.extents[plan.count - 1];
+		if (e->node == plan.node && e->pos + e->len == pos &&
+				e->addr + e->len == addr) {
+			e->len += byte_len;
+			return;
+		}
+	}
+
+	if (plan.count == plan.size) {
+		const size_t size = plan.size ? 2 * plan.size : 64;
+		e = realloc(plan.extents, size * sizeof(*e));
+		if (!e) {
+			plan.failed = 1;
+			return;
+		}
+		plan.extents = e;
+		plan.size = size;
+	}
+
+	e = &plan.extents[plan.count++];
+	e->pos = pos;
+	e->len = byte_len;
+	e->addr = addr;
+	e->drive = plan.drive;
+	e->node = plan.node;
+}
+
+/* Look up the extents of all file modules that can be mapped */
+static void map_file_modules(void)
+{
+	struct boot_module_node *node;
+	const char *dev;
+	size_t first;
+	int type, drive;
+
+	for (node = modules_head; node; node = node->next) {
+		const struct boot_module *const mod = &node->module;
+
+		node->planned = 0;
+		if (!mod->filename || !file_open(mod->filename))
+			continue;
+
+		dev = dev_get_name(&type, &drive);
+		if (type == DISK_MEM || file_size() != mod->size) {
+			file_close();
+			continue;
+		}
+
+		first = plan.count;
+		plan.node = node;
+		plan.drive = type << 8 | drive;
+		plan.failed = 0;
+		node->dev = strdup(dev);
+		if (node->dev &&
+				file_map(phys_to_virt(mod->addr), add_module_extent) &&
+				!plan.failed) {
+			node->planned = 1;
+		} else {
+			debug("Can't map '%s', reading it normally\n",
+					mod->filename);
+			plan.count = first;
+		}
+		file_close();
+	}
+}
+
+static int compare_extents(const void *const a, const void *const b)
+{
+	const struct module_extent *const ea = a, *const eb = b;
+
+	if (ea->drive != eb->drive)
+		return ea->drive < eb->drive ? -1 : 1;
+	if (ea->pos != eb->pos)
+		return ea->pos < eb->pos ? -1 : 1;
+	return 0;
+}
+
+/* Read all mapped extents, drive by drive in ascending order */
+static int read_planned_extents(void)
+{
+	const struct module_extent *e, *const end =
+		plan.extents + plan.count;
+	unsigned long long pos;
+	unsigned long len;
+	uintptr_t addr;
+	int reopen;
+
+	qsort(plan.extents, plan.count, sizeof(*plan.extents), compare_extents);
+
+	for (e = plan.extents; e < end; ) {
+		const int drive = e->drive;
+
+		if (!devopen(e->node->dev, &reopen))
+			return -1;
+
+		while (e < end && e->drive == drive) {
+			pos = e->pos;
+			len = e->len;
+			addr = e->addr;
+			/* Coalesce what's contiguous on the drive and in memory */
+			for (e++; e < end && e->drive == drive &&
+					e->pos == pos + len &&
+					e->addr == addr + len; e++)
+				len += e->len;
+
+			debug("reading %lu bytes at 0x%llx to 0x%08lx\n",
+					len, pos, addr);
+			if (!devread_raw(pos >> DEV_SECTOR_BITS,
+					pos & DEV_SECTOR_MASK, len,
+					phys_to_virt(addr))) {
+				devclose();
+				return -1;
+			}
+		}
+		devclose();
+	}
+
+	return 0;
+}
+
+static void free_plan(void)
+{
+	struct boot_module_node *node;
+
+	for (node = modules_head; node; node = node->next) {
+		free(node->dev);
+		node->dev = NULL;
+		node->planned = 0;
+	}
+	free(plan.extents);
+	memset(&plan, 0, sizeof(plan));
+}
+
 static int load_file_module(const struct boot_module *const mod)
 {
 	if (mod->desc)
@@ -205,29 +355,82 @@ static int load_file_module(const struct boot_module *const mod)
 		printf("failed!\n");
 		return -1;
 	}
+	verify_begin(mod->filename);
 	const int ret = file_read(phys_to_virt(mod->addr), mod->size);
+	const int verified = ret == (int)mod->size && !verify_end();
 	file_close();
 
 	if (ret != (int)mod->size) {
 		printf("failed!\n");
 		return -1;
 	}
+	if (!verified)
+		return -1;
+	printf("ok\n");
+	return 0;
+}
+
+static int check_planned_module(const struct boot_module *const mod)
+{
+	if (mod->desc)
+		printf("Loaded %s", mod->desc);
+	else
+		printf("Loaded module '%s'", mod->filename);
+	debug(" to 0x%08lx", mod->addr);
+	printf("... ");
+
+	if (verify_buffer(mod->filename, phys_to_virt(mod->addr), mod->size))
+		return -1;
 	printf("ok\n");
 	return 0;
 }
 
 int process_boot_modules(void)
 {
-	const struct boot_module *mod = NULL;
-	while ((mod = next_boot_module(mod))) {
+	struct boot_module_node *node;
+	int files = 0, ret = 0;
+
+	boottime_start(STAGE_MODULES);
+	for (node = modules_head; node; node = node->next)
+		files += !!node->module.filename;
+
+	if (files > 1) {
+		map_file_modules();
+		if (plan.count && read_planned_extents()) {
+			printf("Reading boot modules failed!\n");
+			ret = -1;
+			goto out;
+		}
+
+		/* All planned modules are in memory, hash them side by side */
+		for (node = modules_head; node; node = node->next) {
+			const struct boot_module *const mod = &node->module;
+
+			if (node->planned)
+				verify_queue(mod->filename,
+						phys_to_virt(mod->addr), mod->size);
+		}
+		verify_hash_queued();
+	}
+
+	for (node = modules_head; node; node = node->next) {
+		const struct boot_module *const mod = &node->module;
+
 		if (!mod->filename)
 			continue;
 
-		if (load_file_module(mod))
-			return -1;
+		if (node->planned)
+			ret = check_planned_module(mod);
+		else
+			ret = load_file_module(mod);
+		if (ret)
+			break;
 	}
 
-	return 0;
+out:
+	free_plan();
+	boottime_end(STAGE_MODULES);
+	return ret;
 }
 
 void clear_boot_modules(void)
@@ -237,6 +440,7 @@ void clear_boot_modules(void)
 		struct boot_module *const mod = &node->module;
 
 		modules_head = node->next;
+		physmem_free(mod->addr, mod->size);
 		free(mod->filename);
 		free(mod->params);
 		free(mod->desc);
@@ -275,6 +479,12 @@ int prepare_for_jump(void) {
 			cf_bar[i] = 0;
 	}
 
+	/* The APs spin in FILO's memory, which the OS may use */
+	mp_stop();
+
+	boottime_jump();
+	readahead_jump();
+
 	return 0;
 }
 
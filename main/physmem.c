@@ -0,0 +1,388 @@
+/*
+ * This file is part of FILO.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <libpayload.h>
+#include <coreboot_tables.h>
+#include <stdint.h>
+
+#include <physmem.h>
+#if IS_ENABLED(CONFIG_X86_PAE)
+#include <pae.h>
+#endif
+
+#define DEBUG_THIS CONFIG_DEBUG_LOADER
+#include <debug.h>
+
+/*
+ * Physical Memory Allocator
+ * ^^^^^^^^^^^^^^^^^^^^^^^^^
+ *
+ * We keep a sorted list of the free ranges of physical memory, seeded
+ * with the RAM ranges of the coreboot memory map minus FILO itself.
+ * Loaders reserve the fixed ranges they need (e.g. ELF segments, or a
+ * kernel and the room it needs to decompress itself) and allocate the
+ * rest (initrds, boot modules) from the top down, below a given limit.
+ *
+ * Nothing is allocated in the first MiB. Loaders keep real-mode data
+ * at fixed addresses there (Linux boot parameters, trampolines).
+ *
+ * Allocations that have to outlive a boot attempt (e.g. files that were
+ * prefetched before the boot command came) are kept. They stay out of
+ * the free list when it's set up again, like FILO itself. Kept ranges
+ * are made before anyone knows where the OS wants to go, so they must
+ * not be in its way: if a loader reserves a fixed range that overlaps
+ * one, its contents are moved elsewhere and the owner is told. They
+ * also stay clear of the PAE vmem window, whose mapping would hide
+ * them while data is read through it.
+ */
+
+#define PHYSMEM_MAX_RANGES	128
+#define PHYSMEM_ALLOC_MIN	(1ULL << 20)
+#define PHYSMEM_MAX_KEPT	8
+
+struct phys_range {
+	uint64_t base;
+	uint64_t end;
+};
+
+static struct phys_range ranges[PHYSMEM_MAX_RANGES];
+static int nranges;
+static int initialized;
+
+struct kept_range {
+	uint64_t base;
+	uint64_t end;
+	uint64_t max;
+	void (*moved)(uint64_t from, uint64_t to);
+};
+
+static struct kept_range kept[PHYSMEM_MAX_KEPT];
+static int nkept;
+
+static void filo_range(uint64_t *const base, uint64_t *const end)
+{
+	extern char _start[], _end[];
+
+	*base = virt_to_phys(_start);
+	*end = virt_to_phys(_end);
+}
+
+/* Add [base, end) to the free list, merging with its neighbours */
+static void range_add(uint64_t base, uint64_t end)
+{
+	int i, j;
+
+	if (base >= end)
+		return;
+
+	for (i = 0; i < nranges && ranges[i].end < base; i++)
+		;
+	for (j = i; j < nranges && ranges[j].base <= end; j++) {
+		base = MIN(base, ranges[j].base);
+		end = MAX(end, ranges[j].end);
+	}
+
+	if (j == i) {
+		if (nranges == PHYSMEM_MAX_RANGES) {
+			debug("physmem: dropping [%#llx-%#llx)\n", base, end);
+			return;
+		}
+		memmove(&ranges[i + 1], &ranges[i],
+				(nranges - i) * sizeof(ranges[0]));
+		nranges++;
+	} else {
+		memmove(&ranges[i + 1], &ranges[j],
+				(nranges - j) * sizeof(ranges[0]));
+		nranges -= j - i - 1;
+	}
+	ranges[i].base = base;
+	ranges[i].end = end;
+}
+
+/* Remove [base, end) from the free list */
+static int range_remove(const uint64_t base, const uint64_t end)
+{
+	int i;
+
+	if (base >= end)
+		return 0;
+
+	for (i = 0; i < nranges; i++) {
+		struct phys_range *const r = &ranges[i];
+
+		if (r->end <= base || r->base >= end)
+			continue;
+
+		if (r->base < base && r->end > end) {
+			/* Split the range in two */
+			if (nranges == PHYSMEM_MAX_RANGES)
+				return -1;
+			memmove(r + 2, r + 1, (nranges - i - 1) * sizeof(*r));
+			r[1].base = end;
+			r[1].end = r->end;
+			r->end = base;
+			nranges++;
+			return 0;
+		}
+
+		if (r->base < base) {
+			r->end = base;
+		} else if (r->end > end) {
+			r->base = end;
+		} else {
+			memmove(r, r + 1, (nranges - i - 1) * sizeof(*r));
+			nranges--;
+			i--;
+		}
+	}
+	return 0;
+}
+
+/* Check that [base, end) is free, except for kept ranges, which move */
+static int range_is_available(uint64_t base, const uint64_t end)
+{
+	int i;
+
+	while (base < end) {
+		for (i = 0; i < nranges; i++) {
+			if (ranges[i].base <= base && base < ranges[i].end)
+				break;
+		}
+		if (i < nranges) {
+			base = ranges[i].end;
+			continue;
+		}
+		for (i = 0; i < nkept; i++) {
+			if (kept[i].base <= base && base < kept[i].end)
+				break;
+		}
+		if (i == nkept)
+			return 0;
+		base = kept[i].end;
+	}
+	return 1;
+}
+
+/* Check that [base, end) is covered by RAM ranges of the memory map */
+static int range_is_ram(uint64_t base, const uint64_t end)
+{
+	const struct memrange *const mem = lib_sysinfo.memrange;
+	int i;
+
+	while (base < end) {
+		for (i = 0; i < lib_sysinfo.n_memranges; i++) {
+			if (mem[i].type == CB_MEM_RAM && mem[i].base <= base &&
+					base < mem[i].base + mem[i].size)
+				break;
+		}
+		if (i == lib_sysinfo.n_memranges)
+			return 0;
+		base = mem[i].base + mem[i].size;
+	}
+	return 1;
+}
+
+void physmem_init(void)
+{
+	const struct memrange *const mem = lib_sysinfo.memrange;
+	uint64_t filo_base, filo_end;
+	int i;
+
+	nranges = 0;
+	for (i = 0; i < lib_sysinfo.n_memranges; i++) {
+		if (mem[i].type == CB_MEM_RAM)
+			range_add(mem[i].base, mem[i].base + mem[i].size);
+	}
+
+	filo_range(&filo_base, &filo_end);
+	range_remove(filo_base, filo_end);
+	for (i = 0; i < nkept; i++)
+		range_remove(kept[i].base, kept[i].end);
+	initialized = 1;
+
+	for (i = 0; i < nranges; i++)
+		debug("physmem: free [%#llx-%#llx)\n",
+				ranges[i].base, ranges[i].end);
+}
+
+/*
+ * Find the highest `size` bytes within [min, max) of the free list that
+ * don't overlap any of the `navoid` ranges in `avoid`.
+ */
+static uint64_t alloc_avoiding(const uint64_t size, const uint64_t align,
+		uint64_t min, const uint64_t max,
+		const struct phys_range *const avoid, const int navoid)
+{
+	uint64_t top, addr;
+	int i, j;
+
+	if (!initialized)
+		physmem_init();
+
+	min = MAX(min, PHYSMEM_ALLOC_MIN);
+	for (i = nranges - 1; i >= 0; i--) {
+		top = MIN(ranges[i].end, max);
+		while (top >= size) {
+			addr = ALIGN_DOWN(top - size, align);
+			if (addr < MAX(ranges[i].base, min))
+				break;
+
+			for (j = 0; j < navoid; j++) {
+				if (addr < avoid[j].end &&
+						addr + size > avoid[j].base)
+					break;
+			}
+			if (j == navoid) {
+				if (range_remove(addr, addr + size))
+					return 0;
+				debug("physmem: allocated [%#llx-%#llx)\n",
+						addr, addr + size);
+				return addr;
+			}
+			top = avoid[j].base;
+		}
+	}
+
+	return 0;
+}
+
+uint64_t physmem_alloc(const uint64_t size, const uint64_t align,
+		const uint64_t min, const uint64_t max)
+{
+	return alloc_avoiding(size, align, min, max, NULL, 0);
+}
+
+/* Allocate room for a kept range, away from `busy` if it's given */
+static uint64_t alloc_kept(const uint64_t size, const uint64_t max,
+		const struct phys_range *const busy)
+{
+	struct phys_range avoid[2];
+	int navoid = 0;
+
+#if IS_ENABLED(CONFIG_X86_PAE)
+	uint64_t vmem_base, vmem_size;
+
+	pae_vmem_range(&vmem_base, &vmem_size);
+	avoid[navoid].base = vmem_base;
+	avoid[navoid].end = vmem_base + vmem_size;
+	navoid++;
+#endif
+	if (busy)
+		avoid[navoid++] = *busy;
+
+	return alloc_avoiding(size, 4096, 0, max, avoid, navoid);
+}
+
+/* Move the kept ranges that overlap [base, end) out of the way */
+static int move_kept(const uint64_t base, const uint64_t end)
+{
+	const struct phys_range busy = { base, end };
+	uint64_t from, to, size;
+	int i;
+
+	for (i = 0; i < nkept; i++) {
+		struct kept_range *const k = &kept[i];
+
+		if (base >= k->end || end <= k->base)
+			continue;
+
+		size = k->end - k->base;
+		to = alloc_kept(size, k->max, &busy);
+		if (!to) {
+			printf("physmem: no room to move [%#llx-%#llx) "
+					"out of the way\n", k->base, k->end);
+			return -1;
+		}
+		debug("physmem: moving [%#llx-%#llx) to %#llx\n",
+				k->base, k->end, to);
+		memcpy(phys_to_virt(to), phys_to_virt(k->base), size);
+
+		from = k->base;
+		k->base = to;
+		k->end = to + size;
+		range_add(from, from + size);
+		k->moved(from, to);
+	}
+	return 0;
+}
+
+int physmem_reserve(const uint64_t base, const uint64_t size)
+{
+	if (!initialized)
+		physmem_init();
+
+	if (!size)
+		return 0;
+	if (base + size < base || !range_is_available(base, base + size) ||
+			move_kept(base, base + size))
+		return -1;
+
+	debug("physmem: reserved [%#llx-%#llx)\n", base, base + size);
+	return range_remove(base, base + size);
+}
+
+int physmem_claim(const uint64_t base, const uint64_t size)
+{
+	uint64_t filo_base, filo_end;
+
+	if (!initialized)
+		physmem_init();
+
+	filo_range(&filo_base, &filo_end);
+	if (base + size < base || !range_is_ram(base, base + size) ||
+			(base < filo_end && base + size > filo_base) ||
+			move_kept(base, base + size))
+		return -1;
+
+	return range_remove(base, base + size);
+}
+
+void physmem_free(const uint64_t base, const uint64_t size)
+{
+	range_add(base, base + size);
+}
+
+uint64_t physmem_alloc_kept(const uint64_t size, const uint64_t max,
+		void (*const moved)(uint64_t from, uint64_t to))
+{
+	uint64_t addr;
+
+	if (nkept == PHYSMEM_MAX_KEPT)
+		return 0;
+
+	addr = alloc_kept(size, MIN(max, 1ULL << 32), NULL);
+	if (!addr)
+		return 0;
+
+	kept[nkept].base = addr;
+	kept[nkept].end = addr + size;
+	kept[nkept].max = MIN(max, 1ULL << 32);
+	kept[nkept].moved = moved;
+	nkept++;
+	return addr;
+}
+
+void physmem_release(const uint64_t base, const uint64_t size)
+{
+	int i;
+
+	for (i = 0; i < nkept; i++) {
+		if (kept[i].base == base) {
+			memmove(&kept[i], &kept[i + 1],
+					(nkept - i - 1) * sizeof(kept[0]));
+			nkept--;
+			break;
+		}
+	}
+	physmem_free(base, size);
+}
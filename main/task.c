@@ -0,0 +1,121 @@
+/*
+ * This file is part of FILO.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <libpayload.h>
+#include <config.h>
+#include <timer.h>
+#include <task.h>
+
+#define DEBUG_THIS CONFIG_DEBUG_LOADER
+#include <debug.h>
+
+/*
+ * Cooperative Tasks
+ * ^^^^^^^^^^^^^^^^^
+ *
+ * FILO has a single flow of control. Things that take a while without
+ * keeping the CPU busy (drives spinning up, USB devices showing up,
+ * files loaded ahead during the menu countdown) are tasks, and run
+ * whenever that flow waits anyway:
+ *
+ * - task_poll() from the loops that wait for a key,
+ * - task_delay() and task_wait() from drivers that wait for hardware.
+ *
+ * Drivers may be in the middle of a request when they wait, and the
+ * vfs has only one open file. So only task_poll() runs tasks that use
+ * drives or files (TASK_IO). A task never runs inside itself.
+ */
+
+static struct task *tasks;
+
+void task_start(struct task *t, const char *name,
+		int (*run)(struct task *t), int flags)
+{
+	task_stop(t);
+
+	t->name = name;
+	t->run = run;
+	t->flags = (flags & TASK_IO) | TASK_ACTIVE;
+	t->line = 0;
+	t->wake = 0;
+	t->next = tasks;
+	tasks = t;
+	debug("task: started %s\n", name);
+}
+
+void task_stop(struct task *t)
+{
+	struct task **p;
+
+	for (p = &tasks; *p; p = &(*p)->next) {
+		if (*p == t) {
+			*p = t->next;
+			break;
+		}
+	}
+	t->flags &= ~TASK_ACTIVE;
+}
+
+void task_set_wake(struct task *t, unsigned int ms)
+{
+	t->wake = currticks() + (u64)ms * TICKS_PER_SEC / 1000;
+}
+
+static void run_tasks(const int io)
+{
+	struct task *t, *next;
+	const u64 now = currticks();
+
+	for (t = tasks; t; t = next) {
+		next = t->next;
+		if ((t->flags & TASK_RUNNING) || t->wake > now ||
+				((t->flags & TASK_IO) && !io))
+			continue;
+
+		t->flags |= TASK_RUNNING;
+		if (t->run(t) == TASK_DONE) {
+			debug("task: %s is done\n", t->name);
+			task_stop(t);
+		}
+		t->flags &= ~TASK_RUNNING;
+
+		/* Start over next time if it stopped the next one */
+		if (next && !task_active(next))
+			break;
+	}
+}
+
+void task_poll(void)
+{
+	run_tasks(1);
+}
+
+void task_delay(unsigned int ms)
+{
+	const u64 end = currticks() + (u64)ms * TICKS_PER_SEC / 1000;
+
+	do {
+		run_tasks(0);
+	} while (currticks() < end);
+}
+
+void task_wait(struct task *t)
+{
+	while (task_active(t)) {
+		if (t->flags & TASK_RUNNING) {
+			printf("task: %s waits for itself\n", t->name);
+			return;
+		}
+		run_tasks(0);
+	}
+}
@@ -0,0 +1,303 @@
+/*
+ * iotrace2json - convert FILO's block I/O trace to a Chrome trace
+ *
+ * Reads a console or serial log that contains the output of FILO's
+ * "iotrace" command and writes it in the Chrome trace event format,
+ * which Perfetto (ui.perfetto.dev) and chrome://tracing can load.
+ *
+ * Boot stages and filesystem reads get a track each, driver requests
+ * and sector cache lookups one per drive.
+ *
+ * Build with: cc -o iotrace2json iotrace2json.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PROG_NAME "iotrace2json"
+#define VERSION "1.0"
+
+#define PREFIX		"iotrace: "
+#define MAX_NAMES	256
+#define MAX_DEVS	64
+
+#define TID_STAGES	1
+#define TID_FS		2
+#define TID_DEVS	16
+
+#define IOTRACE_OK	0x01
+#define IOTRACE_HIT	0x02
+#define IOTRACE_NO_STAGE 0xff
+
+static const char *dev_prefix[] = { "?", "hd", "mem", "ud", "flash" };
+
+static char *tags[MAX_NAMES];
+static char *stages[MAX_NAMES];
+static int devs[MAX_DEVS];		/* type << 8 | drive, + 1 */
+
+static unsigned long long hz, base;
+static int have_base;
+static int first_event = 1;
+static FILE *out;
+
+static void usage(void)
+{
+	printf("%s %s - convert FILO's block I/O trace to a Chrome trace\n\n",
+			PROG_NAME, VERSION);
+	printf("Usage: %s [-h] [-o output.json] [console.log]\n\n", PROG_NAME);
+	printf("  -o FILE   write the trace to FILE instead of stdout\n");
+	printf("  -h        show this help\n\n");
+	printf("The log is read from stdin if no file is given.\n");
+}
+
+static void set_name(char **names, const char *line)
+{
+	unsigned int idx;
+	int n;
+	char *nl;
+
+	if (sscanf(line, "%u %n", &idx, &n) < 1 || idx >= MAX_NAMES)
+		return;
+	free(names[idx]);
+	names[idx] = strdup(line + n);
+	nl = strpbrk(names[idx], "\r\n");
+	if (nl)
+		*nl = '\0';
+}
+
+static void json_string(const char *s)
+{
+	fputc('"', out);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fputc('\\', out);
+		if ((unsigned char)*s >= 0x20)
+			fputc(*s, out);
+	}
+	fputc('"', out);
+}
+
+static const char *tag_name(unsigned int tag)
+{
+	return tag && tag < MAX_NAMES && tags[tag] ? tags[tag] : "";
+}
+
+static const char *stage_name(unsigned int stage)
+{
+	static char buf[32];
+
+	if (stage == IOTRACE_NO_STAGE)
+		return "";
+	if (stage < MAX_NAMES && stages[stage])
+		return stages[stage];
+	snprintf(buf, sizeof(buf), "stage %u", stage);
+	return buf;
+}
+
+static void begin_event(const char *name, const char *ph, int tid,
+		unsigned long long start)
+{
+	if (!have_base) {
+		base = start;
+		have_base = 1;
+	}
+	fprintf(out, "%s\n{\"name\":", first_event ? "" : ",");
+	json_string(name);
+	fprintf(out, ",\"ph\":\"%s\",\"pid\":1,\"tid\":%d,\"ts\":%.3f",
+			ph, tid, (double)(long long)(start - base) * 1e6 / hz);
+	first_event = 0;
+}
+
+static void thread_name(int tid, const char *name)
+{
+	fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+			"\"tid\":%d,\"args\":{\"name\":", first_event ? "" : ",",
+			tid);
+	json_string(name);
+	fprintf(out, "}}");
+	first_event = 0;
+}
+
+static int dev_tid(unsigned int type, unsigned int drive)
+{
+	const int key = (type << 8 | drive) + 1;
+	char name[32];
+	int i;
+
+	for (i = 0; i < MAX_DEVS && devs[i]; i++)
+		if (devs[i] == key)
+			return TID_DEVS + i;
+	if (i == MAX_DEVS)
+		return TID_DEVS + MAX_DEVS;
+
+	devs[i] = key;
+	if (type == 2)
+		snprintf(name, sizeof(name), "mem");
+	else
+		snprintf(name, sizeof(name), "%s%c",
+				type < 5 ? dev_prefix[type] : "?", 'a' + drive);
+	thread_name(TID_DEVS + i, name);
+	return TID_DEVS + i;
+}
+
+static void common_args(unsigned int tag, unsigned int stage)
+{
+	fprintf(out, ",\"fs\":");
+	json_string(tag_name(tag));
+	fprintf(out, ",\"stage\":");
+	json_string(stage_name(stage));
+}
+
+static int record(const char *line)
+{
+	unsigned long long start, where;
+	unsigned int ticks, type, drive, len, flags, tag, stage;
+	char ev;
+	char name[300];
+
+	if (sscanf(line, "%c %llx %x %x %x %llx %x %x %x %x", &ev, &start,
+				&ticks, &type, &drive, &where, &len, &flags,
+				&tag, &stage) != 10)
+		return 0;
+
+	switch (ev) {
+	case 'B':
+	case 'E':
+		begin_event(stage_name(where), ev == 'B' ? "B" : "E",
+				TID_STAGES, start);
+		fprintf(out, "}");
+		break;
+	case 'F':
+		snprintf(name, sizeof(name), "read %s", tag_name(tag));
+		begin_event(name, "X", TID_FS, start);
+		fprintf(out, ",\"dur\":%.3f,\"args\":{\"pos\":%llu,"
+				"\"bytes\":%u,\"ok\":%d", ticks * 1e6 / hz,
+				where, len, flags & IOTRACE_OK);
+		common_args(tag, stage);
+		fprintf(out, "}}");
+		break;
+	case 'M':
+		snprintf(name, sizeof(name), "mount %s", tag_name(tag));
+		begin_event(name, "X", TID_FS, start);
+		fprintf(out, ",\"dur\":%.3f,\"args\":{\"ok\":%d",
+				ticks * 1e6 / hz, flags & IOTRACE_OK);
+		common_args(tag, stage);
+		fprintf(out, "}}");
+		break;
+	case 'R':
+	{
+		const int tid = dev_tid(type, drive);
+
+		snprintf(name, sizeof(name), "%s %u",
+				flags & IOTRACE_OK ? "read" : "error", len);
+		begin_event(name, "X", tid, start);
+		fprintf(out, ",\"dur\":%.3f,\"args\":{\"sector\":%llu,"
+				"\"count\":%u", ticks * 1e6 / hz, where, len);
+		common_args(tag, stage);
+		fprintf(out, "}}");
+		break;
+	}
+	case 'C':
+	{
+		const int tid = dev_tid(type, drive);
+
+		begin_event(flags & IOTRACE_HIT ? "cache hit" : "cache miss",
+				"i", tid, start);
+		fprintf(out, ",\"s\":\"t\",\"args\":{\"sector\":%llu", where);
+		common_args(tag, stage);
+		fprintf(out, "}}");
+		break;
+	}
+	default:
+		return 0;
+	}
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	FILE *in = stdin;
+	char buf[1024];
+	unsigned long count, lost;
+	unsigned int version;
+	int c, records = 0, in_trace = 0;
+	const char *p;
+
+	out = stdout;
+	while ((c = getopt(argc, argv, "ho:")) != -1) {
+		switch (c) {
+		case 'o':
+			out = fopen(optarg, "w");
+			if (!out) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		case 'h':
+			usage();
+			return 0;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if (optind < argc) {
+		in = fopen(argv[optind], "r");
+		if (!in) {
+			perror(argv[optind]);
+			return 1;
+		}
+	}
+
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	thread_name(TID_STAGES, "boot stages");
+	thread_name(TID_FS, "filesystem");
+
+	while (fgets(buf, sizeof(buf), in)) {
+		/* the console may put anything in front of it */
+		p = strstr(buf, PREFIX);
+		if (!p)
+			continue;
+		p += strlen(PREFIX);
+
+		if (sscanf(p, "begin %u %llu %lu %lu", &version, &hz,
+					&count, &lost) == 4) {
+			if (version != 1) {
+				fprintf(stderr, "Unknown trace version %u\n",
+						version);
+				return 1;
+			}
+			if (!hz)
+				hz = 1;
+			if (lost)
+				fprintf(stderr, "%lu records were overwritten"
+						" before the dump\n", lost);
+			in_trace = 1;
+		} else if (!in_trace) {
+			continue;
+		} else if (!strncmp(p, "end", 3)) {
+			/* only the first dump in the log */
+			break;
+		} else if (!strncmp(p, "tag ", 4)) {
+			set_name(tags, p + 4);
+		} else if (!strncmp(p, "stage ", 6)) {
+			set_name(stages, p + 6);
+		} else {
+			records += record(p);
+		}
+	}
+
+	fprintf(out, "\n]}\n");
+	if (!in_trace) {
+		fprintf(stderr, "No trace found, run \"iotrace\" in FILO first.\n");
+		return 1;
+	}
+	fprintf(stderr, "Converted %d records.\n", records);
+	return 0;
+}
@@ -33,14 +33,14 @@
 
 static ARTECBOOT_HEADER bootHdr;
 
-int artecboot_load(const char *file, const char *cmdline)
+int artecboot_probe(const void *buf, size_t len)
 {
-	int i;
-
-	printf("Starting the Artecboot loader...\n");
-	// clear the boot header
-	memset(&bootHdr, 0, sizeof(bootHdr));
+	return len >= sizeof(ARTECBOOT_HEADER) &&
+		((const ARTECBOOT_HEADER *)buf)->magicHeader == ARTECBOOT_HEADER_MAGIC;
+}
 
+int artecboot_load(const char *file, const char *cmdline)
+{
 	// try opening the boot parameter file
 	if (!file_open(file))
 	{
@@ -48,6 +48,17 @@ int artecboot_load(const char *file, const char *cmdline)
 		return LOADER_NOT_SUPPORT;
 	}
 
+	return artecboot_load_opened(file, cmdline);
+}
+
+int artecboot_load_opened(const char *file, const char *cmdline)
+{
+	int i;
+
+	printf("Starting the Artecboot loader...\n");
+	// clear the boot header
+	memset(&bootHdr, 0, sizeof(bootHdr));
+
 	file_seek(0);	// seek to the beginning of the parameter file
 
 	// now read out the boot header
@@ -153,6 +164,7 @@ int artecboot_load(const char *file, const char *cmdline)
 
 	default:
 		printf("Boot error: unknown OS type, aborting: %d\n", bootHdr.osType);
+		file_close();
 		return LOADER_NOT_SUPPORT;
 	}
 
@@ -17,6 +17,9 @@
 #include <libpayload.h>
 #include <grub/shared.h>
 #include <pae.h>
+#include <physmem.h>
+#include <mp.h>
+#include <boottime.h>
 #include <fs.h>
 #include <csl.h>
 
@@ -84,7 +87,8 @@ static u32 entry_point = ULONG_MAX;
 
 struct csl_file_operations csl_fs_ops = {
 	.open  = file_open,
-	.read  = file_read,
+	.read  = file_stream_read,
+	.skip  = file_stream_skip,
 	.size  = file_size,
 	.close = file_close,
 };
@@ -140,6 +144,12 @@ static int ram_region_check(const u64 address, const u64 size,
 				cmd_name, address + size - 1, ram_region_limit - 1);
 		return -1;
 	}
+	if (physmem_claim(address, size)) {
+		grub_printf("%s - data would overwrite FILO "
+				"[0x%08llx-0x%08llx]\n",
+				cmd_name, address, address + size - 1);
+		return -1;
+	}
 	return 0;
 }
 
@@ -225,7 +235,7 @@ static int csl_cmd_fill(const data_length_t data_length)
 	if (address + fill_length > ULONG_MAX)
 		memset_pae(address, (int) pattern & 0xff, fill_length);
 	else
-		memset(phys_to_virt(address), (int) pattern & 0xff, (size_t) fill_length);
+		mp_memset(phys_to_virt(address), (int) pattern & 0xff, (size_t) fill_length);
 
 	return 0;
 }
@@ -345,9 +355,6 @@ static int csl_cmd_check_cpuid(const data_length_t data_length)
 
 static int csl_dispatch(const u16 cmd, const u64 length)
 {
-	unsigned int i;
-	u8 dummy;
-
 	debug("Dispatching cmd %u with data length 0x%llx\n", cmd, length);
 
 	switch (cmd)
@@ -361,11 +368,10 @@ static int csl_dispatch(const u16 cmd, const u64 length)
 		case CMD_CHECK_CPUID:
 			return csl_cmd_check_cpuid(length);
 		case VENDOR_CMD_ID_START ... VENDOR_CMD_ID_END:
-			for (i = 0; i < length; i++)
-				if (csl_fs_ops.read(&dummy, 1) != 1) {
-					grub_printf("Unable to discard vendor command payload\n");
-					return -1;
-				}
+			if (length > ULONG_MAX || csl_fs_ops.skip(length) != length) {
+				grub_printf("Unable to discard vendor command payload\n");
+				return -1;
+			}
 
 			return 0;
 		default:
@@ -405,24 +411,44 @@ static int csl_entry(size_t entry_addr)
 	ctx->eip = (u32) entry_addr;
 
 	grub_printf("Jumping to entry point @ 0x%x\n", ctx->eip);
+
+	/* The APs spin in FILO's memory, which the CSL may use */
+	mp_stop();
+
+	boottime_jump();
 	ctx = switch_to(ctx);
 
 	/* Not reached */
 	return 0;
 }
 
-int csl_load(const char *const file, const char *const cmdline)
+int csl_probe(const void *const buf, const size_t len)
 {
-	u64 cmd, length, vermagic;
-	int err = -1;
+	u64 vermagic;
 
-	grub_printf("CSL - processing stream '%s'\n", file);
+	if (len < sizeof(vermagic))
+		return 0;
+	memcpy(&vermagic, buf, sizeof(vermagic));
+	return vermagic == my_vermagic;
+}
 
+int csl_load(const char *const file, const char *const cmdline)
+{
 	if (!csl_fs_ops.open(file)) {
 		grub_printf("CSL - failed to open '%s'\n", file);
 		return -1;
 	}
 
+	return csl_load_opened(file, cmdline);
+}
+
+int csl_load_opened(const char *const file, const char *const cmdline)
+{
+	u64 cmd, length, vermagic;
+	int err = -1;
+
+	grub_printf("CSL - processing stream '%s'\n", file);
+
 	if (csl_fs_ops.read(&vermagic, 8) != 8) {
 		grub_printf("CSL - failed to read version magic from '%s'\n", file);
 		goto err_file_close;
@@ -18,6 +18,7 @@
 #ifndef X86_PAE_H
 #define X86_PAE_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 /* Fill memory specified by physical address and length with a constant byte */
@@ -30,4 +31,14 @@ void memset_pae(uint64_t dest, unsigned char pat, uint64_t length);
 int64_t read_pae(uint64_t dest, uint64_t length,
 		 int (*read_func)(void *buf, unsigned long len));
 
+/*
+ * Return the range of physical memory whose identity mapping the vmem
+ * window hides while it's mapped, i.e. during memset_pae() and
+ * read_pae(). Data read into the window mustn't come from there.
+ */
+void pae_vmem_range(uint64_t *base, uint64_t *size);
+
+/* Tell if paging is enabled and [buf, buf + len) overlaps the vmem window */
+int pae_window_mapped(const void *buf, size_t len);
+
 #endif /* X86_PAE_H  */
@@ -32,6 +32,11 @@
 #include <fs.h>
 #include <flashlock.h>
 #include <loader.h>
+#include <digest.h>
+#include <physmem.h>
+#include <boottime.h>
+#include <pae.h>
+#include <arch/cpuid.h>
 #include "context.h"
 #include "segment.h"
 
@@ -42,6 +47,8 @@
 #define COMMAND_LINE_LOC 0x91000
 #define GDT_LOC 0x92000
 #define STACK_LOC 0x93000
+#define PGTABLE64_LOC 0x94000	/* PML4, PDPT and 4 PDs */
+#define TRAMPOLINE64_LOC 0x9a000
 
 #define E820MAX	32		/* number of entries in E820MAP */
 struct e820entry {
@@ -89,7 +96,9 @@ struct linux_header {
 	u32 kernel_alignment;	/* 0x230 */
 	u8 relocatable_kernel;	/* 0x234 */
 	u8 min_alignment;	/* 0x235 (2.10+) */
-	u8 reserved6[2];	/* 0x236 */
+	u16 xloadflags;		/* 0x236 (2.12+) */
+#define XLF_KERNEL_64			(1 << 0)
+#define XLF_CAN_BE_LOADED_ABOVE_4G	(1 << 1)
 	/* 2.06+ */
 	u32 cmdline_size;	/* 0x238 */
 	/* 2.07+ */
@@ -151,7 +160,11 @@ struct linux_params {
 	//struct drive_info_struct drive_info;  /* 0x80 */
 	u8 drive_info[0x20];
 	//struct sys_desc_table sys_desc_table; /* 0xa0 */
-	u8 sys_desc_table[0x140];
+	u8 sys_desc_table[0x20];
+	u32 ext_ramdisk_image;	/* 0xc0 */
+	u32 ext_ramdisk_size;	/* 0xc4 */
+	u32 ext_cmd_line_ptr;	/* 0xc8 */
+	u8 reserved4_3[0x114];	/* 0xcc */
 	u32 alt_mem_k;		/* 0x1e0 */
 	u8 reserved5[4];	/* 0x1e4 */
 	u8 e820_map_nr;		/* 0x1e8 */
@@ -397,7 +410,9 @@ static void set_acpi_rsdp(struct linux_params *params)
  * Parse command line
  * Some parameters, like initrd=<file>, are not passed to kernel,
  * we are responsible to process them.
- * Parameters for kernel are copied to kern_cmdline. Returns name of initrd.
+ * Parameters for kernel are copied to kern_cmdline. Returns name of initrd,
+ * or a comma separated list of names if there are more (initrd=/a,/b or
+ * repeated initrd= options).
  */
 static char *parse_command_line(const char *orig_cmdline,
 				char *kern_cmdline)
@@ -454,9 +469,14 @@ static char *parse_command_line(const char *orig_cmdline,
 				printf
 				    ("Missing filename to initrd parameter\n");
 			} else {
-				initrd = malloc(len + 1);
-				memcpy(initrd, val, len);
-				initrd[len] = 0;
+				/* Repeated options add to the list */
+				int old_len = initrd ? strlen(initrd) + 1 : 0;
+
+				initrd = realloc(initrd, old_len + len + 1);
+				if (old_len)
+					initrd[old_len - 1] = ',';
+				memcpy(initrd + old_len, val, len);
+				initrd[old_len + len] = 0;
 				debug("initrd=%s\n", initrd);
 			}
 			/* Don't pass this to kernel */
@@ -530,10 +550,20 @@ static void set_command_line_loc(struct linux_params *params,
 	}
 }
 
+/* Memory the kernel needs from its load address on, to decompress itself */
+static u32 linux_init_size(const struct linux_header *hdr, u32 kern_size)
+{
+	if (hdr->protocol_version < 0x020a) {
+		/* conservative size assumption */
+		return 3 * kern_size;
+	}
+	return hdr->init_size;
+}
+
 /* Load 32-bit part of kernel */
 static int load_linux_kernel(struct linux_header *hdr, u32 kern_addr)
 {
-	u32 kern_offset, kern_size;
+	u32 kern_offset, kern_size, init_size;
 
 	if (hdr->setup_sects == 0)
 		hdr->setup_sects = 4;
@@ -549,38 +579,93 @@ static int load_linux_kernel(struct linux_header *hdr, u32 kern_addr)
 		return 0;
 	}
 
+	/* Keep the initrd and boot modules out of the way of the
+	 * decompressor. Newer kernels tell exactly what they need. Old
+	 * ones only get what they occupy if the conservative guess
+	 * doesn't fit. */
+	init_size = MAX(kern_size, linux_init_size(hdr, kern_size));
+	if (physmem_reserve(kern_addr, init_size) &&
+			(hdr->protocol_version >= 0x020a ||
+			 physmem_reserve(kern_addr, kern_size))) {
+		printf("Kernel [%#x-%#x] doesn't fit into memory\n",
+		       kern_addr, kern_addr + init_size - 1);
+		return 0;
+	}
+
 	printf("Loading kernel... ");
 	if (file_read(phys_to_virt(kern_addr), kern_size) != kern_size) {
 		printf("Can't read kernel\n");
 		return 0;
 	}
+	if (verify_end())
+		return 0;
 	printf("ok\n");
 
 	return kern_size;
 }
 
-static int load_initrd(struct linux_header *hdr,
-		       u32 kern_end, struct linux_params *params,
-		       const char *initrd_file)
+/* Read the open initrd `name` to physical address `addr`, then close it */
+static int read_initrd(const char *name, u64 addr, u32 size)
 {
-	u32 max;
-	u32 start, end, size;
-	uint64_t forced;
-	extern char _start[];
-#if 0
-	extern char _end[];
-#endif
+	int64_t ret;
 
-	if (!file_open(initrd_file)) {
-		printf("Can't open initrd: %s\n", initrd_file);
+	verify_begin(name);
+	printf("Loading initrd %s... ", name);
+	if (addr >> 32)
+		ret = read_pae(addr, size, file_read);
+	else
+		ret = file_read(phys_to_virt(addr), size);
+	if (ret != size) {
+		printf("Can't read initrd\n");
+		file_close();
 		return -1;
 	}
-	if (using_devsize) {
-		printf("Attempt to load up to end of device as initrd; "
-		       "specify the image size\n");
+	if (verify_end()) {
+		file_close();
+		return -1;
+	}
+	file_close();
+	printf("ok\n");
+	return 0;
+}
+
+/* Load all initrds back to back, each one 4-byte aligned */
+static int load_initrd(struct linux_header *hdr,
+		       struct linux_params *params, char *initrd_files)
+{
+	u32 max;
+	u32 size, *sizes;
+	u64 start = 0, limit, offset;
+	const char *name, *last = NULL;
+	int i, count;
+
+	/* Size the whole region up front. The last initrd stays open
+	 * and is read first, the others have to be opened again. */
+	count = file_list_split(initrd_files);
+	sizes = malloc(count * sizeof(*sizes));
+	if (!sizes)
 		return -1;
+	size = 0;
+	for (i = 0, name = initrd_files; i < count; i++, name += strlen(name) + 1) {
+		if (last)
+			file_close();
+		last = name;
+		if (!file_open(name)) {
+			printf("Can't open initrd: %s\n", name);
+			goto err_free;
+		}
+		if (using_devsize) {
+			printf("Attempt to load up to end of device as initrd; "
+			       "specify the image size\n");
+			goto err_close;
+		}
+		sizes[i] = file_size();
+		if (size > ALIGN_UP(size, 4) + sizes[i]) {
+			printf("Initrds are too big\n");
+			goto err_close;
+		}
+		size = ALIGN_UP(size, 4) + sizes[i];
 	}
-	size = file_size();
 
 	/* Find out the kernel's restriction on how high the initrd can be
 	 * placed */
@@ -588,70 +673,73 @@ static int load_initrd(struct linux_header *hdr,
 		max = hdr->initrd_addr_max;
 	else
 		max = 0x38000000;	/* Hardcoded value for older kernels */
-
-	/* FILO itself is at the top of RAM. (relocated)
-	 * So, try putting initrd just below us. */
-	end = virt_to_phys(_start - 1);
-	if (end > max)
-		end = max;
+	limit = (u64)max + 1;
 
 	/* If "mem=" option is given, we have to put the initrd within
 	 * the specified range. */
-	if (forced_memsize) {
-		forced = forced_memsize;
-		if (forced > max)
-			forced = max;
-		/* If the "mem=" is lower, it's easy */
-		if (forced <= end)
-			end = forced;
-#if 0
-		else {
-			/* Otherwise, see if we can put it above us.
-			 *
-			 *   This would be a good idea if we could easily find
-			 *   out where the memory hole lives.
-			 *
-			 *   There's nothing wrong with the initrd living below
-			 *   FILO. (stepan)
-			 *
-			 *   The problems is even a 64bit kernel will live in
-			 *   32bit address space, so if you have a lot of
-			 *   memory and specify mem=xG with x>4, the maximum
-			 *   allowed initrd address (2.6.x sets this to
-			 *   0xffffffff) will be used for the high limit.
-			 *   (offset 22c in vmlinuz)
-			 *
-			 *   you might want to enable this if you limit memory
-			 *   with mem=yG with y<4.
-			 */
-			if (virt_to_phys(_end) + size <= forced)
-				end = forced;	/* Ok */
-		}
-#endif
-	}
+	if (forced_memsize && forced_memsize < limit)
+		limit = forced_memsize;
 
-	start = end - size;
-	start &= ~0xfff;	/* page align */
-	end = start + size;
+	/* As high as possible below the limit. FILO and the kernel,
+	 * including the room it decompresses into, are reserved. */
+	start = physmem_alloc(size, 0x1000, 0, limit);
 
-	debug("start=%#x end=%#x\n", start, end);
+	/* Doesn't fit below the limit, put it above 4GiB if the kernel
+	 * can take it from there. */
+	if (!start && hdr->protocol_version >= 0x20c &&
+			(hdr->xloadflags & XLF_CAN_BE_LOADED_ABOVE_4G))
+		start = physmem_alloc(size, 0x1000, 1ULL << 32,
+				forced_memsize ? forced_memsize : ~0ULL);
 
-	if (start < kern_end) {
+	debug("start=%#llx end=%#llx\n", start, start + size);
+
+	if (!start) {
 		printf("Initrd is too big to fit in memory\n");
-		return -1;
+		goto err_close;
 	}
 
-	printf("Loading initrd... ");
-	if (file_read(phys_to_virt(start), size) != size) {
-		printf("Can't read initrd\n");
-		return -1;
+	/* It ends the region */
+	if (read_initrd(last, start + size - sizes[count - 1],
+			sizes[count - 1]))
+		goto err_free;
+
+	for (i = 0, name = initrd_files, offset = 0; i < count;
+			i++, name += strlen(name) + 1) {
+		/* Zero the padding to the 4-byte aligned start */
+		if (offset & 3) {
+			if (start >> 32)
+				memset_pae(start + offset, 0, 4 - (offset & 3));
+			else
+				memset(phys_to_virt(start + offset), 0, 4 - (offset & 3));
+			offset = ALIGN_UP(offset, 4);
+		}
+
+		if (i < count - 1) {
+			if (!file_open(name)) {
+				printf("Can't open initrd: %s\n", name);
+				goto err_free;
+			}
+			if (read_initrd(name, start + offset, sizes[i]))
+				goto err_free;
+		}
+		offset += sizes[i];
 	}
-	printf("ok\n");
+	free(sizes);
 
 	params->initrd_start = start;
 	params->initrd_size = size;
+	params->ext_ramdisk_image = start >> 32;
+	params->ext_ramdisk_size = 0;	/* FILO's file sizes are 32-bit */
 
 	return 0;
+
+err_close:
+	file_close();
+err_free:
+	if (start)
+		physmem_free(start, size);
+	free(sizes);
+	return -1;
 }
 
 static void hardware_setup(void)
@@ -693,9 +781,40 @@ static void hardware_setup(void)
 	outb(0xFB, 0x21);	/* mask all irq's but irq2 which is cascaded */
 }
 
-/* Start Linux */
-static int start_linux(u32 kern_addr, struct linux_params *params)
+static int cpu_has_long_mode(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	cpuid(0x80000000, eax, ebx, ecx, edx);
+	if (eax < 0x80000001)
+		return 0;
+	cpuid(0x80000001, eax, ebx, ecx, edx);
+	return !!(edx & (1 << 29));
+}
+
+/* Identity map the lower 4GiB with 2MiB pages for the 64-bit entry */
+static u32 setup_identity_map64(void)
+{
+	u64 *const pml4 = phys_to_virt(PGTABLE64_LOC);
+	u64 *const pdpt = pml4 + 512;
+	u64 *const pd = pdpt + 512;
+	int i;
+
+	memset(pml4, 0, 2 * 4096);
+	pml4[0] = (PGTABLE64_LOC + 0x1000) | 0x3;		/* present, rw */
+	for (i = 0; i < 4; i++)
+		pdpt[i] = (PGTABLE64_LOC + 0x2000 + i * 0x1000) | 0x3;
+	for (i = 0; i < 4 * 512; i++)
+		pd[i] = ((u64)i << 21) | 0x83;			/* present, rw, 2MiB */
+
+	return PGTABLE64_LOC;
+}
+
+/* Start Linux, through the 64-bit entry point if `entry64` is set */
+static int start_linux(u32 kern_addr, struct linux_params *params, int entry64)
 {
+	extern char linux64_trampoline[], linux64_trampoline_end[];
+	extern char linux64_trampoline_cr3[], linux64_trampoline_entry[];
 	struct segment_desc *linux_gdt;
 	struct context *ctx;
 #if IS_ENABLED(CONFIG_LP_VGA_VIDEO_CONSOLE)
@@ -735,6 +854,25 @@ static int start_linux(u32 kern_addr, struct linux_params *params)
 	/* Entry point */
 	ctx->eip = kern_addr;
 
+	if (entry64) {
+		char *const tramp = phys_to_virt(TRAMPOLINE64_LOC);
+
+		/* The kernel runs on a 64-bit __BOOT_CS, the
+		 * trampoline starts on a 32-bit copy of it. */
+		linux_gdt[2].flags = (linux_gdt[2].flags & ~0x40) | 0x20;
+		linux_gdt[4] = gdt[FLAT_CODE];
+		ctx->cs = 0x20;
+
+		memcpy(tramp, linux64_trampoline,
+		       linux64_trampoline_end - linux64_trampoline);
+		*(u32 *)(tramp + (linux64_trampoline_cr3 - linux64_trampoline)) =
+			setup_identity_map64();
+		*(u64 *)(tramp + (linux64_trampoline_entry - linux64_trampoline)) =
+			kern_addr + 0x200;
+		ctx->eip = TRAMPOLINE64_LOC;
+		debug("64-bit entry at %#x\n", kern_addr + 0x200);
+	}
+
 	/* set this field in any case to support relocatable kernels */
 	params->kernel_start = kern_addr;
 
@@ -764,15 +902,30 @@ static int start_linux(u32 kern_addr, struct linux_params *params)
 	return ctx->eax;
 }
 
+int linux_probe(const void *buf, size_t len)
+{
+	const struct linux_header *hdr = buf;
+
+	return len >= 0x200 && hdr->boot_sector_magic == 0xaa55;
+}
+
 int linux_load(const char *file, const char *cmdline)
+{
+	if (!file_open(file))
+		return -1;
+
+	return linux_load_opened(file, cmdline);
+}
+
+int linux_load_opened(const char *file, const char *cmdline)
 {
 	struct linux_header hdr;
 	struct linux_params *params;
 	u32 kern_addr, kern_size;
 	char *initrd_file = 0;
+	int entry64, ret;
 
-	if (!file_open(file))
-		return -1;
+	verify_begin(file);
 
 	kern_addr = load_linux_header(&hdr);
 	if (kern_addr == 0) {
@@ -789,7 +942,9 @@ int linux_load(const char *file, const char *cmdline)
 	    parse_command_line(cmdline, phys_to_virt(COMMAND_LINE_LOC));
 	set_command_line_loc(params, &hdr);
 
+	boottime_start(STAGE_KERNEL_READ);
 	kern_size = load_linux_kernel(&hdr, kern_addr);
+	boottime_end(STAGE_KERNEL_READ);
 	if (kern_size == 0) {
 		if (initrd_file)
 			free(initrd_file);
@@ -798,8 +953,10 @@ int linux_load(const char *file, const char *cmdline)
 	}
 
 	if (initrd_file) {
-		if (load_initrd(&hdr, kern_addr + kern_size,
-					params, initrd_file) != 0) {
+		boottime_start(STAGE_INITRD_READ);
+		ret = load_initrd(&hdr, params, initrd_file);
+		boottime_end(STAGE_INITRD_READ);
+		if (ret != 0) {
 			free(initrd_file);
 			file_close();
 			return -1;
@@ -807,22 +964,21 @@ int linux_load(const char *file, const char *cmdline)
 		free(initrd_file);
 	}
 
-	/* set init_size */
-	if (hdr.protocol_version < 0x020a) {
-		/* conservative size assumption */
-		params->init_size = 3 * kern_size;
-	} else {
-		params->init_size = hdr.init_size;
-	}
+	params->init_size = linux_init_size(&hdr, kern_size);
 
 	file_close();
 
+	/* Prefer the 64-bit entry point of 2.12+ kernels */
+	entry64 = IS_ENABLED(CONFIG_LINUX_64BIT_ENTRY) &&
+		hdr.protocol_version >= 0x20c &&
+		(hdr.xloadflags & XLF_KERNEL_64) && cpu_has_long_mode();
+
 	if (prepare_for_jump())
 		return -1;
 
 	hardware_setup();
 
-	start_linux(kern_addr, params);
+	start_linux(kern_addr, params, entry64);
 
 	restore_after_jump();
 
@@ -0,0 +1,421 @@
+/*
+ * This file is part of FILO.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <libpayload.h>
+#include <config.h>
+#include <timer.h>
+#include <mp.h>
+#include "segment.h"
+
+#define DEBUG_THIS CONFIG_DEBUG_SEGMENT
+#include <debug.h>
+
+/*
+ * AP Workers
+ * ^^^^^^^^^^
+ *
+ * The application processors are woken with a broadcast INIT-SIPI-SIPI.
+ * They start in real mode in a trampoline below 1 MiB, switch to FILO's
+ * GDT and take a number and a stack each (mp_entry.S). Then they spin
+ * in mp_ap_main(), waiting for jobs.
+ *
+ * The ACPI MADT tells how many APs to expect. The trampoline stays in
+ * place until all of them checked in, and not a moment longer. If any
+ * is missing when the time is up, all APs get an INIT again before the
+ * page is restored, so none can run into what's there then, and FILO
+ * goes on with one CPU. Without a MADT, the APs aren't started at all.
+ *
+ * A job is a range of items that all CPUs, the BSP included, take one
+ * by one until none are left. The BSP waits until every AP has seen the
+ * end of a job before it sets up the next one, so no AP can get hold
+ * of a half-written job.
+ *
+ * Before the OS is started, the APs get an INIT again. They stop running
+ * FILO's code, and wait for a SIPI. That isn't where the firmware left
+ * them (coreboot parks them in a loop of its own), but an OS starts its
+ * APs with INIT-SIPI-SIPI anyway, which works from this state as well.
+ */
+
+#define MP_MAX_APS		(CONFIG_MP_MAX_CPUS - 1)
+#define MP_STACK_SIZE		(16 << 10)
+#define MP_TRAMPOLINE		0x8000	/* SIPI vector 0x08 */
+#define MP_CHECKIN_MS		100
+#define MP_MEMSET_CHUNK		(1 << 20)
+
+#define MSR_APIC_BASE		0x1b
+#define  APIC_BASE_X2APIC	(1 << 10)
+#define  APIC_BASE_ENABLE	(1 << 11)
+#define LAPIC_ICR_LOW		0x300
+#define LAPIC_ICR_HIGH		0x310
+#define  ICR_BUSY		(1 << 12)
+#define  ICR_INIT		0x000c4500	/* all excluding self, assert */
+#define  ICR_SIPI		0x000c4600	/* all excluding self */
+
+#define CR0_PG			(1 << 31)
+
+#define MADT_LAPIC		0
+#define MADT_X2APIC		9
+#define  MADT_ENABLED		(1 << 0)
+
+struct acpi_rsdp {
+	char signature[8];
+	u8 checksum;
+	char oem_id[6];
+	u8 revision;
+	u32 rsdt;
+	u32 length;
+	u64 xsdt;
+	u8 ext_checksum;
+	u8 reserved[3];
+} __attribute__ ((packed));
+
+struct acpi_header {
+	char signature[4];
+	u32 length;
+	u8 revision;
+	u8 checksum;
+	char oem_id[6];
+	char oem_table_id[8];
+	u32 oem_revision;
+	u32 creator_id;
+	u32 creator_revision;
+} __attribute__ ((packed));
+
+extern char mp_trampoline[], mp_trampoline_end[];
+extern char mp_trampoline_gdt[], mp_trampoline_jump[];
+extern char mp_ap_entry[];
+
+/* For mp_entry.S */
+volatile int mp_ap_count;
+int mp_ap_max;
+unsigned long mp_ap_stacks[MP_MAX_APS];
+
+static enum { MP_OFF, MP_RUNNING, MP_FAILED } state;
+static int aps;				/* APs that checked in */
+static volatile unsigned int ap_seen[MP_MAX_APS];
+
+static struct {
+	void (*fn)(void *arg, unsigned long i);
+	void *arg;
+	unsigned long count;
+	volatile unsigned long next;
+	volatile unsigned long done;
+} job;
+static volatile unsigned int job_gen;
+
+static inline void cpu_relax(void)
+{
+	asm volatile ("pause" ::: "memory");
+}
+
+static u64 read_msr(unsigned int index)
+{
+	u32 lo, hi;
+
+	asm volatile ("rdmsr" : "=a" (lo), "=d" (hi) : "c" (index));
+	return (u64)hi << 32 | lo;
+}
+
+static u32 read_cr0(void)
+{
+	u32 cr0;
+
+	asm volatile ("movl %%cr0, %0" : "=r" (cr0));
+	return cr0;
+}
+
+static void run_items(void)
+{
+	unsigned long i;
+
+	while ((i = __sync_fetch_and_add(&job.next, 1)) < job.count) {
+		job.fn(job.arg, i);
+		__sync_fetch_and_add(&job.done, 1);
+	}
+}
+
+void mp_ap_main(int idx)
+{
+	unsigned int seen = 0;
+
+	ap_seen[idx] = seen;
+	for (;;) {
+		while (job_gen == seen)
+			cpu_relax();
+		seen = job_gen;
+		__sync_synchronize();
+		run_items();
+		ap_seen[idx] = seen;
+	}
+}
+
+static void lapic_write(volatile u32 *lapic, unsigned int reg, u32 val)
+{
+	lapic[reg / 4] = val;
+}
+
+static int lapic_send(volatile u32 *lapic, u32 icr)
+{
+	int i;
+
+	lapic_write(lapic, LAPIC_ICR_HIGH, 0);
+	lapic_write(lapic, LAPIC_ICR_LOW, icr);
+	for (i = 0; i < 1000; i++) {
+		if (!(lapic[LAPIC_ICR_LOW / 4] & ICR_BUSY))
+			return 0;
+		udelay(1);
+	}
+	return -1;
+}
+
+static volatile u32 *lapic_base(void)
+{
+	const u64 base = read_msr(MSR_APIC_BASE);
+
+	/* We only talk to the xAPIC through MMIO */
+	if (!(base & APIC_BASE_ENABLE) || (base & APIC_BASE_X2APIC))
+		return NULL;
+	return phys_to_virt(base & ~0xfffULL);
+}
+
+/* Find the ACPI table `sig` through the XSDT or RSDT */
+static const struct acpi_header *acpi_find(const char *const sig)
+{
+	const struct acpi_rsdp *rsdp;
+	const struct acpi_header *sdt, *t;
+	unsigned int i, n, width;
+	u64 addr;
+
+	if (!lib_sysinfo.acpi_rsdp)
+		return NULL;
+	rsdp = phys_to_virt(lib_sysinfo.acpi_rsdp);
+	if (memcmp(rsdp->signature, "RSD PTR ", 8))
+		return NULL;
+
+	if (rsdp->revision >= 2 && rsdp->xsdt && rsdp->xsdt < (1ULL << 32)) {
+		sdt = phys_to_virt(rsdp->xsdt);
+		width = 8;
+	} else {
+		sdt = phys_to_virt(rsdp->rsdt);
+		width = 4;
+	}
+	if (sdt->length < sizeof(*sdt))
+		return NULL;
+
+	n = (sdt->length - sizeof(*sdt)) / width;
+	for (i = 0; i < n; i++) {
+		const u8 *const entry = (const u8 *)(sdt + 1) + i * width;
+
+		addr = width == 8 ? *(const u64 *)entry : *(const u32 *)entry;
+		if (!addr || addr >= (1ULL << 32))
+			continue;
+		t = phys_to_virt(addr);
+		if (!memcmp(t->signature, sig, 4))
+			return t;
+	}
+	return NULL;
+}
+
+/* Number of APs the MADT lists as enabled, -1 without a MADT */
+static int madt_aps(void)
+{
+	const struct acpi_header *const madt = acpi_find("APIC");
+	const u8 *p, *end;
+	int cpus = 0;
+
+	if (!madt)
+		return -1;
+
+	/* Entries follow the local APIC address and the flags */
+	p = (const u8 *)(madt + 1) + 8;
+	end = (const u8 *)madt + madt->length;
+	for (; p + 2 <= end && p[1] >= 2 && p + p[1] <= end; p += p[1]) {
+		if (p[0] == MADT_LAPIC && p[1] >= 8 &&
+				(*(const u32 *)(p + 4) & MADT_ENABLED))
+			cpus++;
+		if (p[0] == MADT_X2APIC && p[1] >= 16 &&
+				(*(const u32 *)(p + 8) & MADT_ENABLED))
+			cpus++;
+	}
+	return cpus - 1;
+}
+
+static void mp_start(void)
+{
+	static char saved[4096];
+	const size_t len = mp_trampoline_end - mp_trampoline;
+	char *const tramp = phys_to_virt(MP_TRAMPOLINE);
+	volatile u32 *const lapic = lapic_base();
+	const int expected = madt_aps();
+	u64 timeout;
+	int i, ok;
+
+	state = MP_FAILED;
+	if (!lapic) {
+		debug("mp: no xAPIC, using one CPU\n");
+		return;
+	}
+	if (expected <= 0) {
+		debug("mp: %s, using one CPU\n",
+				expected ? "no MADT" : "no APs in the MADT");
+		return;
+	}
+
+	/* The stacks are kept when the APs are stopped again */
+	for (i = 0; i < MP_MAX_APS; i++) {
+		char *stack;
+
+		if (mp_ap_stacks[i])
+			continue;
+		stack = malloc(MP_STACK_SIZE);
+		if (!stack)
+			break;
+		mp_ap_stacks[i] = (unsigned long)stack + MP_STACK_SIZE;
+	}
+	mp_ap_max = i;
+	if (!mp_ap_max)
+		return;
+
+	/* The trampoline page may be in use already, e.g. by an image
+	   that is being loaded. Put it back when all APs are through. */
+	memcpy(saved, tramp, sizeof(saved));
+	memcpy(tramp, mp_trampoline, len);
+	*(u16 *)(tramp + (mp_trampoline_gdt - mp_trampoline)) = GDT_LIMIT;
+	*(u32 *)(tramp + (mp_trampoline_gdt - mp_trampoline) + 2) =
+		virt_to_phys(gdt);
+	/* Offsets in the relocated segments are C addresses */
+	*(u32 *)(tramp + (mp_trampoline_jump - mp_trampoline)) =
+		(u32)mp_ap_entry;
+	*(u16 *)(tramp + (mp_trampoline_jump - mp_trampoline) + 4) =
+		RELOC_CS;
+
+	ok = !lapic_send(lapic, ICR_INIT);
+	mdelay(10);
+	for (i = 0; ok && i < 2; i++) {
+		ok = !lapic_send(lapic, ICR_SIPI | MP_TRAMPOLINE >> 12);
+		udelay(200);
+	}
+
+	/* APs check in once they left the trampoline */
+	timeout = currticks() + MP_CHECKIN_MS * TICKS_PER_SEC / 1000;
+	while (ok && mp_ap_count < expected && currticks() < timeout)
+		cpu_relax();
+
+	if (mp_ap_count < expected) {
+		/* Don't let a straggler run into the restored page */
+		debug("mp: %d of %d APs came up\n", mp_ap_count, expected);
+		lapic_send(lapic, ICR_INIT);
+		mdelay(10);
+		mp_ap_count = 0;
+	}
+	memcpy(tramp, saved, sizeof(saved));
+
+	/* APs we have no room for halt, they get no stack */
+	aps = MIN(mp_ap_count, mp_ap_max);
+	mp_ap_max = aps;
+	for (i = aps; i < MP_MAX_APS; i++) {
+		if (!mp_ap_stacks[i])
+			continue;
+		free((void *)(mp_ap_stacks[i] - MP_STACK_SIZE));
+		mp_ap_stacks[i] = 0;
+	}
+	if (!aps) {
+		debug("mp: no APs came up\n");
+		return;
+	}
+
+	state = MP_RUNNING;
+	debug("mp: %d CPUs%s\n", aps + 1,
+			mp_ap_count > mp_ap_max ? ", more are halted" : "");
+}
+
+void mp_parallel_for(unsigned long count,
+		void (*fn)(void *arg, unsigned long i), void *arg)
+{
+	int i;
+
+	if (state == MP_OFF && count >= 2)
+		mp_start();
+
+	if (state != MP_RUNNING || count < 2 || (read_cr0() & CR0_PG)) {
+		unsigned long n;
+
+		for (n = 0; n < count; n++)
+			fn(arg, n);
+		return;
+	}
+
+	/* Every AP is done with the last job, so it's ours to set up */
+	job.fn = fn;
+	job.arg = arg;
+	job.count = count;
+	job.next = 0;
+	job.done = 0;
+	__sync_synchronize();
+	job_gen++;
+
+	run_items();
+	while (job.done < count)
+		cpu_relax();
+
+	for (i = 0; i < aps; i++) {
+		while (ap_seen[i] != job_gen)
+			cpu_relax();
+	}
+}
+
+struct memset_job {
+	char *dest;
+	int c;
+	size_t len;
+};
+
+static void memset_chunk(void *arg, unsigned long i)
+{
+	const struct memset_job *const job = arg;
+	const size_t offset = i * MP_MEMSET_CHUNK;
+
+	memset(job->dest + offset, job->c,
+			MIN(job->len - offset, MP_MEMSET_CHUNK));
+}
+
+void mp_memset(void *dest, int c, size_t len)
+{
+	struct memset_job job = { dest, c, len };
+
+	if (len < 2 * MP_MEMSET_CHUNK) {
+		memset(dest, c, len);
+		return;
+	}
+	mp_parallel_for((len + MP_MEMSET_CHUNK - 1) / MP_MEMSET_CHUNK,
+			memset_chunk, &job);
+}
+
+int mp_cpus(void)
+{
+	return state == MP_RUNNING ? aps + 1 : 1;
+}
+
+void mp_stop(void)
+{
+	volatile u32 *const lapic = lapic_base();
+
+	if (state != MP_RUNNING || !lapic)
+		return;
+
+	lapic_send(lapic, ICR_INIT);
+	mdelay(10);
+	state = MP_OFF;
+	aps = 0;
+	mp_ap_count = 0;
+}
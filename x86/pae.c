@@ -14,6 +14,7 @@
 #include <libpayload.h>
 #include <debug.h>
 #include <pae.h>
+#include <fs.h>
 
 #define PDPTE_PRES	(1ULL << 0)
 
@@ -30,6 +31,9 @@
 
 static const size_t s2MiB = 2 * MiB;
 
+/* Upper bound for the size of the vmem window */
+#define VMEM_WINDOW_MAX	(64 * MiB)
+
 struct pde {
 	uint32_t addr_lo;
 	uint32_t addr_hi;
@@ -45,6 +49,10 @@ struct pg_table {
 static struct pg_table pgtbl;
 static unsigned int pgtbl_initialized = 0;
 
+/* Location and size of the vmem window, set up with the page table. */
+static uintptr_t vmem_addr;
+static size_t vmem_size;
+
 static inline CRx_TYPE read_cr0(void) __attribute__((always_inline));
 static inline CRx_TYPE read_cr4(void) __attribute__((always_inline));
 static inline void write_cr0(CRx_TYPE data) __attribute__((always_inline));
@@ -181,44 +189,111 @@ static uintptr_t get_vmem_addr(void)
 }
 
 /*
- * Add mapping for given phys address to specified page directory entry pd.
- * Then invalidate given virtual address virt.
+ * Return the size of the vmem window at addr. It spans as many 2 MiB pages
+ * as fit into the RAM range holding addr, up to VMEM_WINDOW_MAX and short
+ * of relocated FILO. Thus nothing that may be accessed while the window is
+ * mapped (MMIO, framebuffers, coreboot tables) gets shadowed. If addr isn't
+ * in RAM, fall back to a single 2 MiB page.
  */
-static void map_page(struct pde *const pd, uint64_t phys, void *const virt)
+static size_t get_vmem_size(const uintptr_t addr)
 {
-	pd->addr_lo = phys | PDE_PS | PDE_RW | PDE_PRES;
-	pd->addr_hi = phys >> 32;
-	asm volatile ("invlpg (%0)" :: "b"(virt) : "memory");
+	extern char _start[];
+	const uint64_t filo_start = virt_to_phys((uintptr_t)&_start);
+	const struct memrange *const mem = lib_sysinfo.memrange;
+	uint64_t end = MIN((uint64_t)addr + VMEM_WINDOW_MAX, 1ULL << 32);
+	int i;
+
+	if (filo_start > addr)
+		end = MIN(end, filo_start);
+
+	for (i = 0; i < lib_sysinfo.n_memranges; i++) {
+		if (mem[i].type != CB_MEM_RAM)
+			continue;
+		if (addr < mem[i].base || addr >= mem[i].base + mem[i].size)
+			continue;
+
+		end = ALIGN_DOWN(MIN(end, mem[i].base + mem[i].size), s2MiB);
+		if (end > addr)
+			return end - addr;
+		break;
+	}
+
+	return s2MiB;
 }
 
-void memset_pae(uint64_t dest, unsigned char pat, uint64_t length)
+void pae_vmem_range(uint64_t *const base, uint64_t *const size)
 {
-	const uintptr_t vmem_addr = get_vmem_addr();
-	struct pde *const pd = &pgtbl.pd[vmem_addr >> PDE_IDX_SHIFT];
+	const uintptr_t addr = get_vmem_addr();
 
-	ssize_t offset;
+	*base = addr;
+	*size = get_vmem_size(addr);
+}
+
+int pae_window_mapped(const void *const buf, const size_t len)
+{
+	const uintptr_t addr = virt_to_phys(buf);
+
+	if (!(read_cr0() & CR0_PG))
+		return 0;
+	return addr < vmem_addr + vmem_size && addr + len > vmem_addr;
+}
 
+/*
+ * Build the identity map once and find a place for the vmem window, then
+ * enable paging.
+ */
+static struct pde *vmem_enable(void)
+{
 	if (!pgtbl_initialized) {
 		identity_paging_enable();
+		vmem_addr = get_vmem_addr();
+		vmem_size = get_vmem_size(vmem_addr);
+		debug("%s: vmem window at 0x%lx[0x%zx]\n", __func__,
+				vmem_addr, vmem_size);
 		pgtbl_initialized = 1;
 	}
 
 	paging_enable_pae_cr3(virt_to_phys((uintptr_t)&pgtbl.pdp));
 
+	return &pgtbl.pd[vmem_addr >> PDE_IDX_SHIFT];
+}
+
+/*
+ * Map the vmem window to phys, starting with page directory entry pd. Only
+ * the first `len` bytes are mapped. The TLB is flushed once by reloading
+ * CR3, instead of an invlpg per page.
+ */
+static void map_window(struct pde *const pd, uint64_t phys, size_t len)
+{
+	const size_t pages = ALIGN_UP(len, s2MiB) / s2MiB;
+
+	for (size_t i = 0; i < pages; i++, phys += s2MiB) {
+		pd[i].addr_lo = phys | PDE_PS | PDE_RW | PDE_PRES;
+		pd[i].addr_hi = phys >> 32;
+	}
+	write_cr3(virt_to_phys((uintptr_t)&pgtbl.pdp));
+}
+
+void memset_pae(uint64_t dest, unsigned char pat, uint64_t length)
+{
+	struct pde *const pd = vmem_enable();
+
+	ssize_t offset;
+
 	offset = dest - ALIGN_DOWN(dest, s2MiB);
 	dest = ALIGN_DOWN(dest, s2MiB);
 
 	do {
-		const size_t len = MIN(length, s2MiB - offset);
+		const size_t len = MIN(length, vmem_size - offset);
 
-		map_page(pd, dest, phys_to_virt(vmem_addr));
+		map_window(pd, dest, offset + len);
 		debug("%s: Mapped 0x%llx[0x%lx] - 0x%zx\n", __func__,
 				dest + offset, vmem_addr + offset, len);
 
 		/* phys_to_virt: Add FILO relocation offset (segmentation) */
 		memset(phys_to_virt(vmem_addr + offset), pat, len);
 
-		dest += s2MiB;
+		dest += vmem_size;
 		length -= len;
 		offset = 0;
 	} while (length > 0);
@@ -229,8 +304,7 @@ void memset_pae(uint64_t dest, unsigned char pat, uint64_t length)
 int64_t read_pae(uint64_t dest, uint64_t length,
 		int (*read_func)(void *buf, unsigned long len))
 {
-	const uintptr_t vmem_addr = get_vmem_addr();
-	struct pde *const pd = &pgtbl.pd[vmem_addr >> PDE_IDX_SHIFT];
+	struct pde *pd;
 
 	int64_t ret = length;
 	ssize_t offset;
@@ -241,20 +315,15 @@ int64_t read_pae(uint64_t dest, uint64_t length,
 	if (read_func == NULL)
 		return -1;
 
-	if (!pgtbl_initialized) {
-		identity_paging_enable();
-		pgtbl_initialized = 1;
-	}
-
-	paging_enable_pae_cr3(virt_to_phys((uintptr_t)&pgtbl.pdp));
+	pd = vmem_enable();
 
 	offset = dest - ALIGN_DOWN(dest, s2MiB);
 	dest = ALIGN_DOWN(dest, s2MiB);
 
 	do {
-		const size_t len = MIN(length, s2MiB - offset);
+		const size_t len = MIN(length, vmem_size - offset);
 
-		map_page(pd, dest, phys_to_virt(vmem_addr));
+		map_window(pd, dest, offset + len);
 		debug("%s: Mapped 0x%llx[0x%lx] - 0x%zx\n", __func__,
 				dest + offset, vmem_addr + offset, len);
 
@@ -268,7 +337,7 @@ int64_t read_pae(uint64_t dest, uint64_t length,
 			goto _disable_ret;
 		}
 
-		dest += s2MiB;
+		dest += vmem_size;
 		length -= len;
 		offset = 0;
 	} while (length > 0);
@@ -261,18 +261,30 @@ void wince_init_bootarg(u32 entryPoint)
 	      (unsigned int) *g_ppBootArgs);
 }
 
-int wince_load(const char *file, const char *cmdline)
+int wince_probe(const void *buf, size_t len)
 {
-	u8 signBuf[BIN_HDRSIG_SIZE], *pDest = NULL;
-	SEGMENT_INFO segInfo;
-	u32 totalBytes = 0;
+	return len >= BIN_HDRSIG_SIZE &&
+		!memcmp(buf, g_ceSignature, BIN_HDRSIG_SIZE);
+}
 
+int wince_load(const char *file, const char *cmdline)
+{
 	if (!file_open(file)) {
 		printf("Failed opening image file: %s\n", file);
 		return LOADER_NOT_SUPPORT;
 	}
+
+	return wince_load_opened(file, cmdline);
+}
+
+int wince_load_opened(const char *file, const char *cmdline)
+{
+	u8 signBuf[BIN_HDRSIG_SIZE], *pDest = NULL;
+	SEGMENT_INFO segInfo;
+	u32 totalBytes = 0;
+
 	// read the image signature
-	file_read((void *) signBuf, BIN_HDRSIG_SIZE);
+	file_stream_read((void *) signBuf, BIN_HDRSIG_SIZE);
 
 	if (memcmp(signBuf, g_ceSignature, BIN_HDRSIG_SIZE)) {
 		printf("Bad or unknown Windows CE image signature\n");
@@ -280,8 +292,8 @@ int wince_load(const char *file, const char *cmdline)
 		return LOADER_NOT_SUPPORT;
 	}
 	// now read image start address and size
-	file_read((void *) &g_imageStart, sizeof(u32));
-	file_read((void *) &g_imageSize, sizeof(u32));
+	file_stream_read((void *) &g_imageStart, sizeof(u32));
+	file_stream_read((void *) &g_imageSize, sizeof(u32));
 
 	if (!g_imageStart || !g_imageSize)	// sanity check
 	{
@@ -296,7 +308,7 @@ int wince_load(const char *file, const char *cmdline)
 	// main image reading loop
 	while (1) {
 		// first grab the segment descriptor
-		if (file_read(&segInfo, sizeof(SEGMENT_INFO)) <
+		if (file_stream_read(&segInfo, sizeof(SEGMENT_INFO)) <
 		    sizeof(SEGMENT_INFO)) {
 			printf ("\nFailed reading image segment descriptor\n");
 			file_close();
@@ -317,7 +329,7 @@ int wince_load(const char *file, const char *cmdline)
 		      segInfo.segSize);
 
 		// read the image segment data from VFS
-		if (file_read((void *) pDest, segInfo.segSize) <
+		if (file_stream_read((void *) pDest, segInfo.segSize) <
 		    segInfo.segSize) {
 			printf ("\nFailed reading image segment data (address 0x%x, size %d)\n",
 			     segInfo.segAddr, segInfo.segSize);